@@ -18,7 +18,9 @@
  *   along with emu3fs. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <linux/blkdev.h>
 #include "emu3_fs.h"
+#include "emu3_trace.h"
 
 static void emu3_set_dentry_name(struct emu3_dentry *e3d, struct qstr *q)
 {
@@ -26,45 +28,80 @@ static void emu3_set_dentry_name(struct emu3_dentry *e3d, struct qstr *q)
 	memset(&e3d->name[q->len], ' ', EMU3_LENGTH_FILENAME - q->len);
 }
 
-static void emu3_filename_fix(char *in, char *out)
+static inline char emu3_filename_fix_char(char c)
+{
+	// 32 <= c <= 126
+	return c == '/' ? '?' : c;	//Whatever will be nicer
+}
+
+void emu3_filename_fix(char *in, char *out)
 {
 	int i;
-	char c;
 
-	for (i = 0; i < EMU3_LENGTH_FILENAME; i++) {
-		c = in[i];
-		// 32 <= c <= 126
-		if (c == '/')
-			c = '?';	//Whatever will be nicer
-		out[i] = c;
-	}
+	for (i = 0; i < EMU3_LENGTH_FILENAME; i++)
+		out[i] = emu3_filename_fix_char(in[i]);
 }
 
-static int emu3_filename_length(const char *filename)
+//Names are padded with spaces or NULs, which are not part of the name.
+unsigned int emu3_name_length(const char *name, unsigned int len)
 {
-	const char *last = &filename[EMU3_LENGTH_FILENAME - 1];
-	int len;
+	while (len > 0 && (name[len - 1] == ' ' || name[len - 1] == '\0'))
+		len--;
+	return len;
+}
 
-	for (len = EMU3_LENGTH_FILENAME; len > 0; len--) {
-		if (*last != ' ' && *last != '\0')
-			return len;
-		last--;
-	}
+EMU3_VISIBLE_IF_KUNIT int emu3_filename_length(const char *filename)
+{
+	int len = emu3_name_length(filename, EMU3_LENGTH_FILENAME);
 
-	return -1;		//A dentry with an empty name?
+	return len ? len : -1;	//A dentry with an empty name?
 }
 
-static int emu3_strncmp(struct dentry *dentry, struct emu3_dentry *e3d)
+EMU3_VISIBLE_IF_KUNIT int emu3_strncmp(struct dentry *dentry,
+				       struct emu3_dentry *e3d)
 {
-	int len;
-	char fixed[EMU3_LENGTH_FILENAME];
+	unsigned int i, len;
+	const struct qstr *q = &dentry->d_name;
 
-	emu3_filename_fix(e3d->name, fixed);
-	len = emu3_filename_length(e3d->name);
-	len = len > dentry->d_name.len ? len : dentry->d_name.len;
-	return strncmp(fixed, dentry->d_name.name, len);
+	len = emu3_name_length(e3d->name, EMU3_LENGTH_FILENAME);
+	if (len != emu3_name_length(q->name, q->len))
+		return 1;
+
+	for (i = 0; i < len; i++)
+		if ((unsigned char)emu3_filename_fix_char(e3d->name[i]) !=
+		    q->name[i])
+			return 1;
+
+	return 0;
+}
+
+//The dcache applies the same name rules than the dentries on disk so that
+//names differing only in the padding resolve to the same dentry.
+static int emu3_d_hash(const struct dentry *dentry, struct qstr *q)
+{
+	if (q->len > EMU3_LENGTH_FILENAME)
+		return -ENAMETOOLONG;
+
+	q->hash = full_name_hash(dentry, q->name,
+				 emu3_name_length(q->name, q->len));
+	return 0;
 }
 
+static int emu3_d_compare(const struct dentry *dentry, unsigned int len,
+			  const char *str, const struct qstr *name)
+{
+	len = emu3_name_length(str, len);
+	if (len != emu3_name_length(name->name, name->len))
+		return 1;
+
+	return memcmp(str, name->name, len) ? 1 : 0;
+}
+
+const struct dentry_operations emu3_dentry_operations = {
+	.d_hash = emu3_d_hash,
+	.d_compare = emu3_d_compare,
+};
+
 static struct emu3_dentry *emu3_find_dentry_by_name_in_blk(struct inode *dir, struct dentry
 							   *dentry, struct buffer_head
 							   **b,
@@ -74,13 +111,13 @@ static struct emu3_dentry *emu3_find_dentry_by_name_in_blk(struct inode *dir, st
 	unsigned int i;
 	struct emu3_dentry *e3d;
 
-	*b = sb_bread(dir->i_sb, blknum);
+	*b = emu3_bread(dir->i_sb, blknum);
 	if (!*b) {
 		printk(KERN_CRIT EMU3_ERR_NOT_BLK, EMU3_MODULE_NAME, blknum);
 		return NULL;
 	}
 
-	e3d = (struct emu3_dentry *)(*b)->b_data;
+	e3d = emu3_block_data(EMU3_SB(dir->i_sb), *b, blknum);
 	for (i = 0; i < EMU3_ENTRIES_PER_BLOCK; i++, e3d++) {
 		if (!EMU3_DENTRY_IS_DIR(e3d) && !EMU3_DENTRY_IS_FILE(e3d))
 			continue;
@@ -144,7 +181,17 @@ static struct emu3_dentry *emu3_find_dentry_by_name(struct inode *dir,
 	return res;
 }
 
-static int emu3_emit(struct dir_context *ctx,
+//After the dot entries, ctx->pos is the position of the next dentry to emit,
+//calculated as block position * EMU3_ENTRIES_PER_BLOCK + offset.
+#define EMU3_DIR_POS(slot) ((slot) + 2)
+#define EMU3_POS_SLOT(pos) ((pos) - 2)
+
+//Only the buffer contents and the dentry position are used, so the inode
+//number does not depend on any state that a concurrent reader may change.
+//The inode is built from the same dentry before the name is emitted.
+//Creating an inode never takes dir_sem, so waiting for one being created
+//by a lookup can not deadlock with the dir_sem held here.
+static int emu3_emit(struct dir_context *ctx, struct inode *dir,
 		     struct emu3_dentry *e3d, unsigned int blknum,
 		     unsigned int offset, unsigned type,
 		     struct emu3_sb_info *info)
@@ -155,105 +202,133 @@ static int emu3_emit(struct dir_context *ctx,
 
 	emu3_filename_fix(e3d->name, fixed);
 	len = emu3_filename_length(fixed);
-	ino = emu3_get_or_add_i_map(info, EMU3_DNUM(blknum, offset));
-	ctx->pos++;
+	ino = EMU3_INO(EMU3_DNUM(blknum, offset), info);
+	emu3_prefill_inode(dir->i_sb, ino, e3d);
 	return dir_emit(ctx, fixed, len, ino, type);
 }
 
 static int emu3_iterate_dir(struct file *f, struct dir_context *ctx,
 			    struct inode *dir, struct emu3_sb_info *info)
 {
-	loff_t k;
 	unsigned int i, j;
 	short blknum;
 	struct buffer_head *b;
-	struct buffer_head *db;
 	struct emu3_dentry *e3d;
-	struct emu3_dentry *e3d_dir;
+	struct emu3_inode *e3i = EMU3_I(dir);
 
-	k = 2;
-	e3d_dir = emu3_find_dentry_by_inode(dir, &db);
-
-	if (!EMU3_DENTRY_IS_DIR(e3d_dir))
-		goto cleanup;
-
-	for (i = 0; i < EMU3_BLOCKS_PER_DIR; i++) {
-		blknum = le16_to_cpu(e3d_dir->data.dattrs.block_list[i]);
+	for (i = EMU3_POS_SLOT(ctx->pos) / EMU3_ENTRIES_PER_BLOCK;
+	     i < EMU3_BLOCKS_PER_DIR; i++) {
+		blknum = le16_to_cpu(e3i->data.dattrs.block_list[i]);
 		if (EMU3_IS_DIR_BLOCK_FREE(blknum))
 			break;
 
-		b = sb_bread(dir->i_sb, blknum);
+		b = emu3_bread(dir->i_sb, blknum);
 		if (!b) {
 			printk(KERN_CRIT EMU3_ERR_NOT_BLK, EMU3_MODULE_NAME,
 			       blknum);
-			goto cleanup;
+			return -EIO;
 		}
 
-		e3d = (struct emu3_dentry *)b->b_data;
-		for (j = 0; j < EMU3_ENTRIES_PER_BLOCK; j++, e3d++) {
+		j = EMU3_POS_SLOT(ctx->pos) % EMU3_ENTRIES_PER_BLOCK;
+		e3d = emu3_block_data(info, b, blknum);
+		e3d += j;
+		for (; j < EMU3_ENTRIES_PER_BLOCK; j++, e3d++) {
+			ctx->pos = EMU3_DIR_POS(i * EMU3_ENTRIES_PER_BLOCK + j);
+
 			if (!EMU3_DENTRY_IS_FILE(e3d))
 				continue;
 
-			if (ctx->pos == k) {
-				if (!emu3_emit
-				    (ctx, e3d, blknum, j, DT_REG, info)) {
-					brelse(b);
-					goto cleanup;
-				}
+			if (!emu3_emit(ctx, dir, e3d, blknum, j, DT_REG, info)) {
+				brelse(b);
+				return 0;
 			}
-			k++;
 		}
 		brelse(b);
+
+		ctx->pos = EMU3_DIR_POS((i + 1) * EMU3_ENTRIES_PER_BLOCK);
 	}
 
- cleanup:
-	brelse(db);
-	return k;
+	ctx->pos = EMU3_DIR_POS(EMU3_MAX_FILES_PER_DIR);
+	return 0;
 }
 
 static int emu3_iterate_root(struct file *f, struct dir_context *ctx,
 			     struct inode *dir, struct emu3_sb_info *info)
 {
-	loff_t k;
 	unsigned int i, j, blknum;
 	struct emu3_dentry *e3d;
 	struct buffer_head *b;
 
-	k = 2;
-	for (i = 0; i < info->root_blocks; i++) {
+	for (i = EMU3_POS_SLOT(ctx->pos) / EMU3_ENTRIES_PER_BLOCK;
+	     i < info->root_blocks; i++) {
 		blknum = info->start_root_block + i;
-		b = sb_bread(dir->i_sb, blknum);
+		b = emu3_bread(dir->i_sb, blknum);
 		if (!b) {
 			printk(KERN_CRIT EMU3_ERR_NOT_BLK, EMU3_MODULE_NAME,
 			       blknum);
-			break;
+			return -EIO;
 		}
 
-		e3d = (struct emu3_dentry *)b->b_data;
+		j = EMU3_POS_SLOT(ctx->pos) % EMU3_ENTRIES_PER_BLOCK;
+		e3d = emu3_block_data(info, b, blknum);
+		e3d += j;
+		for (; j < EMU3_ENTRIES_PER_BLOCK; j++, e3d++) {
+			ctx->pos = EMU3_DIR_POS(i * EMU3_ENTRIES_PER_BLOCK + j);
 
-		for (j = 0; j < EMU3_ENTRIES_PER_BLOCK; j++, e3d++) {
 			if (!EMU3_DENTRY_IS_DIR(e3d))
 				continue;
 
-			if (ctx->pos == k) {
-				if (!emu3_emit
-				    (ctx, e3d, blknum, j, DT_DIR, info)) {
-					brelse(b);
-					return k;
-				}
+			if (!emu3_emit(ctx, dir, e3d, blknum, j, DT_DIR, info)) {
+				brelse(b);
+				return 0;
 			}
-			k++;
 		}
 		brelse(b);
+
+		ctx->pos = EMU3_DIR_POS((i + 1) * EMU3_ENTRIES_PER_BLOCK);
+	}
+
+	ctx->pos = EMU3_DIR_POS(EMU3_ROOT_SLOTS(info));
+	return 0;
+}
+
+static int emu3_iterate_index(struct dir_context *ctx, struct inode *dir,
+			      const struct emu3_index *index,
+			      struct emu3_sb_info *info)
+{
+	unsigned int i;
+	const struct emu3_index_entry *ie;
+	const struct emu3_index_dir *d = emu3_index_dir(index, dir);
+	unsigned int type = EMU3_IS_I_ROOT_DIR(dir) ? DT_DIR : DT_REG;
+
+	for (i = 0; i < d->count; i++) {
+		ie = &index->entries[d->first + i];
+		if (ie->slot < EMU3_POS_SLOT(ctx->pos))
+			continue;
+
+		ctx->pos = EMU3_DIR_POS(ie->slot);
+		if (!dir_emit(ctx, ie->name, emu3_filename_length(ie->name),
+			      EMU3_INO(ie->dnum, info), type))
+			return 0;
 	}
 
-	return k;
+	if (EMU3_IS_I_ROOT_DIR(dir))
+		ctx->pos = EMU3_DIR_POS(EMU3_ROOT_SLOTS(info));
+	else
+		ctx->pos = EMU3_DIR_POS(EMU3_MAX_FILES_PER_DIR);
+	return 0;
 }
 
+//Called with the inode lock held shared. Readers of the same directory run
+//concurrently, while dir_sem keeps out writers changing its block list.
 static int emu3_iterate(struct file *f, struct dir_context *ctx)
 {
+	int err;
+	loff_t start = ctx->pos;
 	struct inode *dir = file_inode(f);
+	struct emu3_inode *e3i = EMU3_I(dir);
 	struct emu3_sb_info *info = EMU3_SB(dir->i_sb);
+	const struct emu3_index *index = emu3_get_index(info);
 
 	if (!EMU3_IS_I_ROOT_DIR(dir) && !EMU3_IS_I_REG_DIR(dir, info))
 		return -ENOTDIR;
@@ -270,10 +345,48 @@ static int emu3_iterate(struct file *f, struct dir_context *ctx)
 		ctx->pos++;
 	}
 
+	if (index) {
+		err = emu3_iterate_index(ctx, dir, index, info);
+		goto out;
+	}
+
+	down_read(&e3i->dir_sem);
+
 	if (EMU3_IS_I_ROOT_DIR(dir))
-		return emu3_iterate_root(f, ctx, dir, info);
+		err = emu3_iterate_root(f, ctx, dir, info);
 	else
-		return emu3_iterate_dir(f, ctx, dir, info);
+		err = emu3_iterate_dir(f, ctx, dir, info);
+
+	up_read(&e3i->dir_sem);
+
+ out:
+	trace_emu3_readdir(dir, start, ctx->pos, err);
+
+	return err;
+}
+
+//With the index, no block is read.
+static bool emu3_lookup_dnum(struct inode *dir, struct dentry *dentry,
+			     const struct emu3_index *index,
+			     unsigned int *dnum)
+{
+	struct buffer_head *b;
+	const struct emu3_index_entry *ie;
+	const struct qstr *q = &dentry->d_name;
+
+	if (index) {
+		ie = emu3_index_lookup(index, dir, q->name,
+				       emu3_name_length(q->name, q->len));
+		if (!ie)
+			return false;
+		*dnum = ie->dnum;
+		return true;
+	}
+
+	if (!emu3_find_dentry_by_name(dir, dentry, &b, dnum))
+		return false;
+	brelse(b);
+	return true;
 }
 
 static struct dentry *emu3_lookup(struct inode *dir,
@@ -281,88 +394,124 @@ static struct dentry *emu3_lookup(struct inode *dir,
 {
 	unsigned long i_ino;
 	unsigned int dnum;
-	struct buffer_head *b;
-	struct emu3_dentry *e3d;
 	struct dentry *newent;
 	struct inode *inode = NULL;
+	struct emu3_inode *e3i = EMU3_I(dir);
 	struct emu3_sb_info *info = EMU3_SB(dir->i_sb);
+	const struct emu3_index *index = emu3_get_index(info);
 
 	if (dentry->d_name.len > EMU3_LENGTH_FILENAME)
 		return ERR_PTR(-ENAMETOOLONG);
 
-	mutex_lock(&info->lock);
+	if (!index)
+		down_read(&e3i->dir_sem);
 
-	e3d = emu3_find_dentry_by_name(dir, dentry, &b, &dnum);
-	if (e3d) {
-		brelse(b);
-		i_ino = emu3_get_or_add_i_map(info, dnum);
+	if (emu3_lookup_dnum(dir, dentry, index, &dnum)) {
+		i_ino = EMU3_INO(dnum, info);
 		inode = emu3_get_inode(dir->i_sb, i_ino);
 		if (IS_ERR(inode)) {
-			mutex_unlock(&info->lock);
+			if (!index)
+				up_read(&e3i->dir_sem);
+			trace_emu3_lookup(dir, &dentry->d_name, i_ino,
+					  PTR_ERR(inode));
 			return ERR_CAST(inode);
 		}
 	}
+	trace_emu3_lookup(dir, &dentry->d_name, inode ? inode->i_ino : 0, 0);
+	emu3_stat_inc(info, EMU3_STAT_LOOKUPS);
+	if (inode)
+		emu3_stat_inc(info, EMU3_STAT_LOOKUP_HITS);
 	newent = d_splice_alias(inode, dentry);
 
-	mutex_unlock(&info->lock);
+	if (!index)
+		up_read(&e3i->dir_sem);
 
 	return newent;
 }
 
-static int emu3_get_free_file_id(struct inode *dir)
+//Builds the slot and bank id occupancy of a directory from its blocks.
+static int emu3_init_dir_maps(struct inode *dir)
 {
-	int i, j, id = -1;
-	short *block;
-	short blknum;
-	bool ids[EMU3_MAX_FILES_PER_DIR];
-	struct buffer_head *b, *db;
-	struct emu3_dentry *e3d, *e3d_dir;
+	int i, j;
+	short blknum, *block;
+	struct buffer_head *b;
+	struct emu3_dentry *e3d;
+	struct emu3_inode *e3i = EMU3_I(dir);
 	struct emu3_sb_info *info = EMU3_SB(dir->i_sb);
 
-	for (i = 0; i < EMU3_MAX_FILES_PER_DIR; i++)
-		ids[i] = 0;
-
-	e3d_dir = emu3_find_dentry_by_inode(dir, &db);
-
-	if (!e3d_dir)
-		return -1;
+	if (e3i->maps_ready)
+		return 0;
 
-	if (!EMU3_DENTRY_IS_DIR(e3d_dir))
-		goto cleanup;
-
-	block = e3d_dir->data.dattrs.block_list;
+	bitmap_zero(e3i->used_slots, EMU3_MAX_FILES_PER_DIR);
+	bitmap_zero(e3i->used_ids, EMU3_MAX_FILES_PER_DIR);
 
+	block = e3i->data.dattrs.block_list;
 	for (i = 0; i < EMU3_BLOCKS_PER_DIR; i++, block++) {
 		blknum = le16_to_cpu(*block);
 		if (!EMU3_DIR_BLOCK_OK(blknum, info))
 			break;
 
-		b = sb_bread(dir->i_sb, blknum);
+		b = emu3_bread(dir->i_sb, blknum);
 		if (!b) {
 			printk(KERN_CRIT EMU3_ERR_NOT_BLK, EMU3_MODULE_NAME,
 			       blknum);
-			goto cleanup;
+			return -EIO;
 		}
 
-		e3d = (struct emu3_dentry *)b->b_data;
-
+		e3d = emu3_block_data(info, b, blknum);
 		for (j = 0; j < EMU3_ENTRIES_PER_BLOCK; j++, e3d++) {
-			if (EMU3_DENTRY_IS_FILE(e3d))
-				ids[e3d->data.id] = 1;
+			if (!EMU3_DENTRY_IS_FILE(e3d))
+				continue;
+
+			set_bit(i * EMU3_ENTRIES_PER_BLOCK + j,
+				e3i->used_slots);
+			set_bit(e3d->data.id, e3i->used_ids);
 		}
 
 		brelse(b);
 	}
 
-	for (i = 0; i < EMU3_MAX_FILES_PER_DIR; i++)
-		if (!ids[i]) {
-			id = i;
-			break;
-		}
+	e3i->maps_ready = 1;
+	return 0;
+}
 
- cleanup:
-	brelse(db);
-	return id;
+void emu3_invalidate_dir_maps(struct inode *dir)
+{
+	EMU3_I(dir)->maps_ready = 0;
+}
+
+int emu3_get_dir_slot(struct inode *dir, unsigned int dnum)
+{
+	int i;
+	struct emu3_inode *e3i = EMU3_I(dir);
+
+	for (i = 0; i < EMU3_BLOCKS_PER_DIR; i++)
+		if (le16_to_cpu(e3i->data.dattrs.block_list[i]) ==
+		    EMU3_DNUM_BLKNUM(dnum))
+			return i * EMU3_ENTRIES_PER_BLOCK +
+			    EMU3_DNUM_OFFSET(dnum);
+
+	return -1;
+}
+
+static void emu3_release_file_slot(struct inode *dir, unsigned int dnum,
+				   unsigned char id)
+{
+	int slot;
+	struct emu3_inode *e3i = EMU3_I(dir);
+
+	if (!e3i->maps_ready)
+		return;
+
+	slot = emu3_get_dir_slot(dir, dnum);
+	if (slot < 0) {
+		emu3_invalidate_dir_maps(dir);
+		return;
+	}
+
+	clear_bit(slot, e3i->used_slots);
+	if (id < EMU3_MAX_FILES_PER_DIR)
+		clear_bit(id, e3i->used_ids);
 }
 
 static int emu3_find_empty_file_dentry(struct inode *dir,
@@ -370,75 +519,71 @@ static int emu3_find_empty_file_dentry(struct inode *dir,
 				       struct buffer_head **b,
 				       unsigned int *dnum)
 {
-	int i, j, id, err = 0;
-	short *block, blknum;
+	int i, slot, id, err;
+	short blknum;
 	struct buffer_head *db;
 	struct emu3_dentry *e3d_dir;
+	struct emu3_inode *e3i = EMU3_I(dir);
 	struct emu3_sb_info *info = EMU3_SB(dir->i_sb);
 
-	e3d_dir = emu3_find_dentry_by_inode(dir, &db);
+	lockdep_assert_held_write(&e3i->dir_sem);
 
-	if (!e3d_dir) {
-		return -ENOENT;
-	}
+	//Files are not allowed at root
+	if (EMU3_IS_I_ROOT_DIR(dir))
+		return -EPERM;
 
-	if (!EMU3_DENTRY_IS_DIR(e3d_dir)) {
-		err = -ENOTDIR;
-		goto cleanup;
+	err = emu3_init_dir_maps(dir);
+	if (err)
+		return err;
+
+	slot = find_first_zero_bit(e3i->used_slots, EMU3_MAX_FILES_PER_DIR);
+	if (slot >= EMU3_MAX_FILES_PER_DIR)
+		return -EFBIG;
+
+	id = find_first_zero_bit(e3i->used_ids, EMU3_MAX_FILES_PER_DIR);
+	if (id >= EMU3_MAX_FILES_PER_DIR) {
+		printk(KERN_CRIT
+		       "%s: No ID available for a newly created dentry\n",
+		       EMU3_MODULE_NAME);
+		return -EIO;
 	}
 
-	block = e3d_dir->data.dattrs.block_list;
-	for (i = 0; i < EMU3_BLOCKS_PER_DIR; i++, block++) {
-		blknum = le16_to_cpu(*block);
-		if (!EMU3_DIR_BLOCK_OK(blknum, info))
-			break;
+	i = slot / EMU3_ENTRIES_PER_BLOCK;
+	blknum = le16_to_cpu(e3i->data.dattrs.block_list[i]);
 
-		*b = sb_bread(dir->i_sb, blknum);
+	if (EMU3_DIR_BLOCK_OK(blknum, info)) {
+		*b = emu3_bread(dir->i_sb, blknum);
 		if (!*b) {
 			printk(KERN_CRIT EMU3_ERR_NOT_BLK, EMU3_MODULE_NAME,
 			       blknum);
-			err = -EIO;
-			goto cleanup;
-		}
-
-		*e3d = (struct emu3_dentry *)(*b)->b_data;
-		for (j = 0; j < EMU3_ENTRIES_PER_BLOCK; j++, (*e3d)++) {
-			if (!EMU3_DENTRY_IS_FILE(*e3d)) {
-				*dnum = EMU3_DNUM(blknum, j);
-				goto add_id;
-			}
+			return -EIO;
 		}
-
-		brelse(*b);
+		goto add_id;
 	}
 
-	if (i == EMU3_BLOCKS_PER_DIR) {
-		err = -EFBIG;
-		goto cleanup;
+	//Every used block is full so a new one is appended.
+	blknum = emu3_alloc_dir_content_block(info);
+	if (blknum < 0)
+		return -ENOSPC;
+
+	*b = emu3_bread(dir->i_sb, blknum);
+	if (!*b) {
+		printk(KERN_CRIT EMU3_ERR_NOT_BLK, EMU3_MODULE_NAME, blknum);
+		emu3_free_dir_content_block(info, blknum);
+		return -EIO;
 	}
 
-	blknum = emu3_get_free_dir_content_blknum(info);
-	if (blknum < 0) {
-		err = -ENOSPC;
-		goto cleanup;
+	e3d_dir = emu3_find_dentry_by_inode(dir, &db);
+	if (!e3d_dir) {
+		brelse(*b);
+		emu3_free_dir_content_block(info, blknum);
+		return -ENOENT;
 	}
 
 	e3d_dir->data.dattrs.block_list[i] = cpu_to_le16(blknum);
 	emu3_set_emu3_inode_data(dir, e3d_dir);
 	mark_buffer_dirty_inode(db, dir);
-
-	*b = sb_bread(dir->i_sb, blknum);
-	if (!*b) {
-		printk(KERN_CRIT EMU3_ERR_NOT_BLK, EMU3_MODULE_NAME, blknum);
-		err = -EIO;
-		goto cleanup;
-	}
-
-	emu3_use_dir_content_block(info, blknum);
-
-	*dnum = EMU3_DNUM(blknum, 0);
-
-	*e3d = (struct emu3_dentry *)(*b)->b_data;
+	brelse(db);
 
 	dir->i_blocks++;
 	dir->i_size = dir->i_blocks * EMU3_BSIZE;
@@ -446,20 +591,16 @@ static int emu3_find_empty_file_dentry(struct inode *dir,
 	mark_inode_dirty(dir);
 
  add_id:
+	slot %= EMU3_ENTRIES_PER_BLOCK;
+	*dnum = EMU3_DNUM(blknum, slot);
+	*e3d = (struct emu3_dentry *)emu3_block_data(info, *b, blknum) + slot;
 	(*e3d)->data.unknown = 0;
+	(*e3d)->data.id = id;
 
-	id = emu3_get_free_file_id(dir);
-	if (id < 0) {
-		printk(KERN_CRIT
-		       "%s: No ID available for a newly created dentry\n",
-		       EMU3_MODULE_NAME);
-		err = -EIO;
-	} else
-		(*e3d)->data.id = id;
+	set_bit(i * EMU3_ENTRIES_PER_BLOCK + slot, e3i->used_slots);
+	set_bit(id, e3i->used_ids);
 
- cleanup:
-	brelse(db);
-	return err;
+	return 0;
 }
 
 static int emu3_add_file_dentry(struct inode *dir, struct dentry *dentry,
@@ -477,13 +618,17 @@ static int emu3_add_file_dentry(struct inode *dir, struct dentry *dentry,
 	if (dentry->d_name.len > EMU3_LENGTH_FILENAME)
 		return -ENAMETOOLONG;
 
+	emu3_alloc_lock(info);
 	start_cluster = emu3_next_free_cluster(info);
+	emu3_alloc_unlock(info);
 	if (start_cluster < 0)
 		return -ENOSPC;
 
 	err = emu3_find_empty_file_dentry(dir, e3d, b, dnum);
-	if (err)
+	if (err) {
+		emu3_free_cluster(info, start_cluster);
 		return err;
+	}
 
 	emu3_set_dentry_name(*e3d, &dentry->d_name);
 	//The id is set in emu3_find_empty_file_dentry
@@ -503,9 +648,11 @@ static int emu3_create(struct mnt_idmap *idmap, struct inode *dir,
 	struct buffer_head *b;
 	struct emu3_dentry *e3d;
 	struct super_block *sb = dir->i_sb;
+	struct emu3_inode *e3i = EMU3_I(dir);
 	struct emu3_sb_info *info = EMU3_SB(sb);
+	u64 start = ktime_get_ns();
 
-	mutex_lock(&info->lock);
+	down_write(&e3i->dir_sem);
 
 	//Files are not allowed at root
 	if (EMU3_IS_I_ROOT_DIR(dir)) {
@@ -533,21 +680,21 @@ static int emu3_create(struct mnt_idmap *idmap, struct inode *dir,
 	inode->i_fop = &emu3_file_operations_file;
 	inode->i_opflags |= IOP_XATTR;
 	inode->i_mapping->a_ops = &emu3_aops;
-	inode->i_ino = emu3_get_or_add_i_map(info, dnum);
+	inode->i_ino = EMU3_INO(dnum, info);
 	inode->i_size = 0;
 
 	emu3_set_emu3_inode_data(inode, e3d);
 	brelse(b);
 
-	emu3_init_cluster_list(inode);
-
 	insert_inode_hash(inode);
 	mark_inode_dirty(inode);
 
 	d_instantiate(dentry, inode);
 
  end:
-	mutex_unlock(&info->lock);
+	up_write(&e3i->dir_sem);
+	trace_emu3_create(dir, &dentry->d_name, err ? 0 : inode->i_ino, err);
+	emu3_lat_record(info, EMU3_LAT_CREATE, start);
 	return err;
 }
 
@@ -576,14 +723,14 @@ static bool emu3_is_dir_empty(struct emu3_dentry *e3d_dir,
 		if (EMU3_IS_DIR_BLOCK_FREE(blknum))
 			break;
 
-		b = sb_bread(sb, blknum);
+		b = emu3_bread(sb, blknum);
 		if (!b) {
 			printk(KERN_CRIT EMU3_ERR_NOT_BLK, EMU3_MODULE_NAME,
 			       blknum);
 			return 0;
 		}
 
-		e3d = (struct emu3_dentry *)b->b_data;
+		e3d = emu3_block_data(EMU3_SB(sb), b, blknum);
 
 		if (emu3_is_dir_blk_used(e3d)) {
 			brelse(b);
@@ -600,34 +747,26 @@ static struct emu3_dentry *emu3_find_empty_dir_dentry(struct super_block *sb,
 						      struct buffer_head **b,
 						      unsigned int *dnum)
 {
-	int i, j;
-	unsigned int blknum;
-	struct emu3_dentry *e3d;
+	int slot;
+	unsigned int blknum, offset;
 	struct emu3_sb_info *info = EMU3_SB(sb);
 
-	for (i = 0; i < info->root_blocks; i++) {
-		blknum = info->start_root_block + i;
-
-		*b = sb_bread(sb, blknum);
-		if (!*b) {
-			printk(KERN_CRIT EMU3_ERR_NOT_BLK, EMU3_MODULE_NAME,
-			       blknum);
-			return NULL;
-		}
-
-		e3d = (struct emu3_dentry *)(*b)->b_data;
+	slot = find_first_zero_bit(info->root_used_slots,
+				   EMU3_ROOT_SLOTS(info));
+	if (slot >= EMU3_ROOT_SLOTS(info))
+		return NULL;
 
-		for (j = 0; j < EMU3_ENTRIES_PER_BLOCK; j++, e3d++) {
-			if (!EMU3_DENTRY_IS_DIR(e3d)) {
-				*dnum = EMU3_DNUM(blknum, j);
-				return e3d;
-			}
-		}
+	blknum = info->start_root_block + slot / EMU3_ENTRIES_PER_BLOCK;
+	offset = slot % EMU3_ENTRIES_PER_BLOCK;
 
-		brelse(*b);
+	*b = emu3_bread(sb, blknum);
+	if (!*b) {
+		printk(KERN_CRIT EMU3_ERR_NOT_BLK, EMU3_MODULE_NAME, blknum);
+		return NULL;
 	}
 
-	return NULL;
+	*dnum = EMU3_DNUM(blknum, offset);
+	return (struct emu3_dentry *)emu3_block_data(info, *b, blknum) + offset;
 }
 
 static int emu3_add_dir_dentry(struct inode *dir, struct qstr *q,
@@ -650,14 +789,12 @@ static int emu3_add_dir_dentry(struct inode *dir, struct qstr *q,
 	if (!*e3d)
 		return -ENOSPC;
 
-	blknum = emu3_get_free_dir_content_blknum(info);
+	blknum = emu3_alloc_dir_content_block(info);
 	if (blknum < 0) {
 		brelse(*b);
 		return -ENOSPC;
 	}
 
-	emu3_use_dir_content_block(info, blknum);
-
 	emu3_set_dentry_name(*e3d, q);
 	(*e3d)->data.unknown = 0;
 	(*e3d)->data.id = EMU3_DTYPE_1;
@@ -669,35 +806,138 @@ static int emu3_add_dir_dentry(struct inode *dir, struct qstr *q,
 	inode_set_mtime_to_ts(dir, current_time(dir));
 	mark_buffer_dirty_inode(*b, dir);
 
+	set_bit(EMU3_ROOT_SLOT(*dnum, info), info->root_used_slots);
+
 	return 0;
 }
 
-static int emu3_unlink(struct inode *dir, struct dentry *dentry)
+//The caller holds the data_sem of inode, so it is not written back to its
+//dentry once unlinked.
+static void emu3_unlink_file(struct inode *dir, struct inode *inode)
 {
 	struct timespec64 tv;
+
+	//The dentry, and thus the inode ID, can be reused from now on.
+	remove_inode_hash(inode);
+
+	tv = inode_set_ctime_current(dir);
+	inode_set_mtime_to_ts(dir, tv);
+	mark_inode_dirty(dir);
+	inode_set_ctime_to_ts(inode, tv);
+	inode_dec_link_count(inode);
+}
+
+//Marks a file dentry as deleted. The caller holds the dir_sem of dir.
+static int emu3_remove_file(struct inode *dir, struct inode *inode)
+{
 	struct buffer_head *b;
 	struct emu3_dentry *e3d;
-	struct inode *inode = dentry->d_inode;
+	struct emu3_inode *e3i = EMU3_I(inode);
 	struct emu3_sb_info *info = EMU3_SB(inode->i_sb);
 
+	lockdep_assert_held_write(&EMU3_I(dir)->dir_sem);
+
+	down_write(&e3i->data_sem);
+
 	e3d = emu3_find_dentry_by_inode(inode, &b);
+	if (!e3d) {
+		up_write(&e3i->data_sem);
+		return -ENOENT;
+	}
+
+	e3d->data.fattrs.type = EMU3_FTYPE_DEL;
+	mark_buffer_dirty_inode(b, dir);
+	emu3_release_file_slot(dir, EMU3_I_DNUM(inode, info), e3d->data.id);
+	brelse(b);
+
+	emu3_unlink_file(dir, inode);
+
+	up_write(&e3i->data_sem);
+
+	return 0;
+}
 
-	if (e3d == NULL)
+//Deletes an empty directory dentry. The caller holds the dir_sem of the root.
+static int emu3_remove_dir(struct inode *dir, struct inode *inode)
+{
+	int i, ret = 0;
+	short *block, blknum;
+	struct buffer_head *b;
+	struct emu3_dentry *e3d;
+	struct emu3_sb_info *info = EMU3_SB(inode->i_sb);
+
+	lockdep_assert_held_write(&EMU3_I(dir)->dir_sem);
+
+	e3d = emu3_find_dentry_by_inode(inode, &b);
+	if (!e3d)
 		return -ENOENT;
 
-	mutex_lock(&info->lock);
+	if (!EMU3_DENTRY_IS_DIR(e3d)) {
+		ret = -ENOTDIR;
+		goto cleanup;
+	}
+
+	if (!emu3_is_dir_empty(e3d, inode->i_sb)) {
+		ret = -ENOTEMPTY;
+		goto cleanup;
+	}
 
-	e3d->data.fattrs.type = EMU3_FTYPE_DEL;
+	block = e3d->data.dattrs.block_list;
+	for (i = 0; i < EMU3_BLOCKS_PER_DIR; i++, block++) {
+		blknum = le16_to_cpu(*block);
+		if (EMU3_IS_DIR_BLOCK_FREE(blknum))
+			break;
+
+		emu3_free_dir_content_block(info, blknum);
+	}
+
+	memset(e3d, 0, sizeof(struct emu3_dentry));
 	mark_buffer_dirty_inode(b, dir);
-	tv = inode_set_ctime_current(dir);
-	mark_inode_dirty(dir);
-	inode_set_ctime_to_ts(inode, tv);
+	clear_bit(EMU3_ROOT_SLOT(EMU3_I_DNUM(inode, info), info),
+		  info->root_used_slots);
+	remove_inode_hash(inode);
 	inode_dec_link_count(inode);
+	inode_dec_link_count(inode);
+	inode_dec_link_count(dir);
+ cleanup:
 	brelse(b);
+	return ret;
+}
 
-	mutex_unlock(&info->lock);
+static int emu3_unlink(struct inode *dir, struct dentry *dentry)
+{
+	int err;
+	struct emu3_inode *e3i = EMU3_I(dir);
 
-	return 0;
+	down_write(&e3i->dir_sem);
+	err = emu3_remove_file(dir, d_inode(dentry));
+	up_write(&e3i->dir_sem);
+
+	trace_emu3_unlink(dir, &dentry->d_name, d_inode(dentry)->i_ino, err);
+
+	return err;
+}
+
+//Both directories are locked in inode number order.
+static void emu3_lock_dirs(struct inode *dir1, struct inode *dir2)
+{
+	if (dir1 == dir2) {
+		down_write(&EMU3_I(dir1)->dir_sem);
+		return;
+	}
+
+	if (dir1->i_ino > dir2->i_ino)
+		swap(dir1, dir2);
+
+	down_write(&EMU3_I(dir1)->dir_sem);
+	down_write_nested(&EMU3_I(dir2)->dir_sem, SINGLE_DEPTH_NESTING);
+}
+
+static void emu3_unlock_dirs(struct inode *dir1, struct inode *dir2)
+{
+	up_write(&EMU3_I(dir1)->dir_sem);
+	if (dir1 != dir2)
+		up_write(&EMU3_I(dir2)->dir_sem);
 }
 
 static int emu3_rename(struct mnt_idmap *idmap, struct inode *old_dir,
@@ -706,93 +946,107 @@ static int emu3_rename(struct mnt_idmap *idmap, struct inode *old_dir,
 {
 	int err = 0;
 	unsigned char id;
-	unsigned int dnum = 0;
-	struct super_block *sb = old_dentry->d_inode->i_sb;
-	struct emu3_sb_info *info = EMU3_SB(sb);
+	unsigned int old_dnum, dnum;
+	unsigned long old_ino;
+	struct inode *inode = d_inode(old_dentry);
+	struct inode *target = d_inode(new_dentry);
+	struct emu3_inode *e3i = EMU3_I(inode);
+	struct emu3_sb_info *info = EMU3_SB(inode->i_sb);
 	struct buffer_head *old_b, *new_b;
 	struct emu3_dentry *old_e3d, *new_e3d;
 
 	if (flags & ~RENAME_NOREPLACE)
 		return -EINVAL;
 
-	mutex_lock(&info->lock);
-
-	if (EMU3_IS_I_ROOT_DIR(old_dir) && !EMU3_IS_I_ROOT_DIR(new_dir)) {
-		//The emu3 filesystem does not allow directories in directories.
-		err = -EPERM;
-		goto end;
-	}
+	old_ino = inode->i_ino;
 
-	if (new_dentry->d_inode) {
-		if (flags & RENAME_NOREPLACE) {
-			err = -EEXIST;
-			goto cleanup;
-		}
+	//The emu3 filesystem does not allow directories in directories nor files at root.
+	if (EMU3_IS_I_ROOT_DIR(old_dir) != EMU3_IS_I_ROOT_DIR(new_dir))
+		return -EPERM;
 
-		new_e3d =
-		    emu3_find_dentry_by_inode(new_dentry->d_inode, &new_b);
-		if (new_e3d) {
-			if (old_dir == new_dir) {
-				new_e3d->data.fattrs.type = EMU3_FTYPE_DEL;
-				mark_buffer_dirty_inode(new_b, new_dir);
-				inode_set_mtime_to_ts(new_dir,
-						      current_time(new_dir));
-				mark_inode_dirty(new_dir);
-			}
-		} else
-			printk(KERN_WARNING
-			       "%s: No entry found. As it was meant to be deleted, we can continue safely.\n",
-			       EMU3_MODULE_NAME);
+	emu3_lock_dirs(old_dir, new_dir);
 
-		brelse(new_b);
-
-		dnum = emu3_get_i_map(info, new_dentry->d_inode);
-		inode_dec_link_count(new_dentry->d_inode);
-		d_delete(new_dentry);
+	if (target && (flags & RENAME_NOREPLACE)) {
+		err = -EEXIST;
+		goto end;
 	}
 
-	old_e3d = emu3_find_dentry_by_inode(old_dentry->d_inode, &old_b);
+	//Everything that can fail is done before the target is removed, so a
+	//failed rename leaves it in place.
+	old_dnum = EMU3_I_DNUM(inode, info);
+	old_e3d = emu3_find_dentry_by_inode(inode, &old_b);
 	if (!old_e3d) {
-		err = -ENOENT;
+		err = -EIO;
 		goto end;
 	}
 
-	if (old_dir == new_dir) {
-		emu3_set_dentry_name(old_e3d, &new_dentry->d_name);
-		mark_buffer_dirty_inode(old_b, old_dir);
-		inode_set_mtime_to_ts(old_dir, current_time(old_dir));
-		mark_inode_dirty(old_dir);
-	} else {
-		if (dnum)
-			emu3_set_i_map(info, old_dentry->d_inode, dnum);
-		else {
+	if (old_dir != new_dir) {
+		//A replaced file hands its dentry, and its ID, to the moved one.
+		if (target) {
+			dnum = EMU3_I_DNUM(target, info);
+			new_e3d = emu3_find_dentry_by_inode(target, &new_b);
+			if (!new_e3d)
+				err = -EIO;
+		} else
 			err = emu3_find_empty_file_dentry(new_dir, &new_e3d,
 							  &new_b, &dnum);
-			if (err)
-				goto cleanup;
+		if (err)
+			goto release;
+	}
 
-			id = new_e3d->data.id;
-			memcpy(new_e3d, old_e3d, sizeof(struct emu3_dentry));
-			new_e3d->data.id = id;
+	//Directories only live in the root folder, so they never reach the reuse.
+	if (target) {
+		if (S_ISDIR(target->i_mode))
+			err = emu3_remove_dir(new_dir, target);
+		else if (old_dir == new_dir)
+			err = emu3_remove_file(new_dir, target);
+		else {
+			down_write(&EMU3_I(target)->data_sem);
+			emu3_unlink_file(new_dir, target);
+			up_write(&EMU3_I(target)->data_sem);
+		}
+		if (err)
+			goto release;
+	}
 
-			emu3_set_emu3_inode_data(old_dentry->d_inode, new_e3d);
+	//Directories never change their dentry so only files need data_sem.
+	if (!S_ISDIR(inode->i_mode))
+		down_write(&e3i->data_sem);
 
-			inode_set_mtime_to_ts(new_dir, current_time(old_dir));
-			mark_buffer_dirty_inode(new_b, new_dir);
+	if (old_dir == new_dir) {
+		emu3_set_dentry_name(old_e3d, &new_dentry->d_name);
+		mark_buffer_dirty_inode(old_b, old_dir);
+	} else {
+		id = new_e3d->data.id;
+		memcpy(new_e3d, old_e3d, sizeof(struct emu3_dentry));
+		new_e3d->data.id = id;
+		emu3_set_dentry_name(new_e3d, &new_dentry->d_name);
+		mark_buffer_dirty_inode(new_b, new_dir);
 
-			emu3_set_i_map(info, old_dentry->d_inode, dnum);
-		}
+		emu3_set_emu3_inode_data(inode, new_e3d);
+		brelse(new_b);
 
 		old_e3d->data.fattrs.type = EMU3_FTYPE_DEL;
 		mark_buffer_dirty_inode(old_b, old_dir);
-		inode_set_mtime_to_ts(old_dir, current_time(old_dir));
-		mark_inode_dirty(old_dir);
+		emu3_release_file_slot(old_dir, old_dnum, old_e3d->data.id);
+
+		emu3_move_inode(inode, dnum);
+
+		inode_set_mtime_to_ts(new_dir, current_time(new_dir));
+		mark_inode_dirty(new_dir);
 	}
 
- cleanup:
+	inode_set_mtime_to_ts(old_dir, current_time(old_dir));
+	mark_inode_dirty(old_dir);
+
+	if (!S_ISDIR(inode->i_mode))
+		up_write(&e3i->data_sem);
+ release:
 	brelse(old_b);
  end:
-	mutex_unlock(&info->lock);
+	emu3_unlock_dirs(old_dir, new_dir);
+	trace_emu3_rename(old_dir, new_dir, &new_dentry->d_name, old_ino,
+			  inode->i_ino, err);
 	return err;
 }
 
@@ -806,6 +1060,7 @@ static int emu3_mkdir(struct mnt_idmap *idmap, struct inode *dir,
 	struct buffer_head *b;
 	struct emu3_dentry *e3d;
 	struct super_block *sb = dir->i_sb;
+	struct emu3_inode *e3i = EMU3_I(dir);
 	struct emu3_sb_info *info = EMU3_SB(sb);
 
 	if (!EMU3_IS_I_ROOT_DIR(dir))
@@ -815,11 +1070,11 @@ static int emu3_mkdir(struct mnt_idmap *idmap, struct inode *dir,
 	if (!inode)
 		return -ENOSPC;
 
-	mutex_lock(&info->lock);
+	down_write(&e3i->dir_sem);
 
 	err = emu3_add_dir_dentry(dir, &dentry->d_name, &dnum, &e3d, &b);
 	if (err) {
-		mutex_unlock(&info->lock);
+		up_write(&e3i->dir_sem);
 		iput(inode);
 		return err;
 	}
@@ -829,7 +1084,7 @@ static int emu3_mkdir(struct mnt_idmap *idmap, struct inode *dir,
 	inode->i_op = &emu3_inode_operations_dir;
 	inode->i_fop = &emu3_file_operations_dir;
 	inode->i_opflags &= ~IOP_XATTR;
-	inode->i_ino = emu3_get_or_add_i_map(info, dnum);
+	inode->i_ino = EMU3_INO(dnum, info);
 	inode->i_size = EMU3_BSIZE;
 	tv = inode_set_ctime_current(inode);
 	inode_set_mtime_to_ts(inode, tv);
@@ -843,7 +1098,7 @@ static int emu3_mkdir(struct mnt_idmap *idmap, struct inode *dir,
 
 	insert_inode_hash(inode);
 	mark_inode_dirty(inode);
-	mutex_unlock(&info->lock);
+	up_write(&e3i->dir_sem);
 
 	d_instantiate(dentry, inode);
 
@@ -852,59 +1107,23 @@ static int emu3_mkdir(struct mnt_idmap *idmap, struct inode *dir,
 
 static int emu3_rmdir(struct inode *dir, struct dentry *dentry)
 {
-	int i, ret = 0;
-	short *block, blknum;
-	struct buffer_head *b;
-	struct emu3_dentry *e3d;
-	struct inode *inode = d_inode(dentry);
-	struct emu3_sb_info *info = EMU3_SB(inode->i_sb);
-
-	mutex_lock(&info->lock);
-
-	e3d = emu3_find_dentry_by_inode(inode, &b);
-	if (!e3d) {
-		ret = -ENOENT;
-		goto end;
-	}
-
-	if (!EMU3_DENTRY_IS_DIR(e3d)) {
-		ret = -ENOTDIR;
-		goto cleanup;
-	}
-
-	if (!emu3_is_dir_empty(e3d, inode->i_sb)) {
-		ret = -ENOTEMPTY;
-		goto cleanup;
-	}
-
-	block = e3d->data.dattrs.block_list;
-	for (i = 0; i < EMU3_BLOCKS_PER_DIR; i++, block++) {
-		blknum = le16_to_cpu(*block);
-		if (EMU3_IS_DIR_BLOCK_FREE(blknum))
-			break;
+	int err;
+	struct emu3_inode *e3i = EMU3_I(dir);
 
-		emu3_free_dir_content_block(info, blknum);
-	}
+	down_write(&e3i->dir_sem);
+	err = emu3_remove_dir(dir, d_inode(dentry));
+	up_write(&e3i->dir_sem);
 
-	memset(e3d, 0, sizeof(struct emu3_dentry));
-	mark_buffer_dirty_inode(b, dir);
-	emu3_clear_i_map(info, inode);
-	inode_dec_link_count(inode);
-	inode_dec_link_count(inode);
-	inode_dec_link_count(dir);
- cleanup:
-	brelse(b);
- end:
-	mutex_unlock(&info->lock);
-	return ret;
+	return err;
 }
 
-WRAP_DIR_ITER(emu3_iterate)	// FIXME!
 const struct file_operations emu3_file_operations_dir = {
 	.read = generic_read_dir,
-	.iterate_shared = shared_emu3_iterate,
-	.fsync = generic_file_fsync,
+	.iterate_shared = emu3_iterate,
+	.fsync = emu3_fsync,
 	.llseek = generic_file_llseek,
+	.unlocked_ioctl = emu3_ioctl,
+	.compat_ioctl = compat_ptr_ioctl,
 };
 
 const struct inode_operations emu3_inode_operations_dir = {
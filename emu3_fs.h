@@ -25,6 +25,13 @@
 #include <linux/vfs.h>
 #include <linux/writeback.h>
 #include <linux/version.h>
+#include <linux/bitmap.h>
+#include <linux/workqueue.h>
+#include <linux/kobject.h>
+#include <linux/completion.h>
+#include <linux/percpu.h>
+#include <linux/ktime.h>
+#include "emu3_ioctl.h"
 
 #define EMU3_MODULE_NAME "emu3fs"
 
@@ -36,7 +43,7 @@
 #define EMU3_CLUSTER_ENTRIES_PER_BLOCK  (EMU3_BSIZE >> 1)
 
 #define EMU3_I_ID_ROOT_DIR 1	//Any value is valid as long as is lower than the first inode ID.
-#define EMU3_I_ID_MAP_OFFSET (EMU3_I_ID_ROOT_DIR + 1)	//As inodes are mapped to emu3 dentries in an array, we need to add an offset greater than EMU3_ROOT_DIR_I_ID.
+#define EMU3_I_ID_OFFSET (EMU3_I_ID_ROOT_DIR + 1)	//As inode IDs are the position of the emu3 dentries from the first root block, we need to add an offset greater than EMU3_ROOT_DIR_I_ID.
 
 #define EMU3_SB(sb) ((struct emu3_sb_info *)(sb)->s_fs_info)
 
@@ -57,7 +64,16 @@
 
 #define EMU3_ENTRIES_PER_BLOCK (EMU3_BSIZE / (sizeof(struct emu3_dentry)))
 
-#define EMU3_TOTAL_ENTRIES(info) (((info)->root_blocks + (info)->dir_content_blocks) * EMU3_ENTRIES_PER_BLOCK)
+#define EMU3_ROOT_SLOTS(info) ((info)->root_blocks * EMU3_ENTRIES_PER_BLOCK)
+
+#define EMU3_ROOT_SLOT(dnum, info) ((EMU3_DNUM_BLKNUM(dnum) - (info)->start_root_block) * EMU3_ENTRIES_PER_BLOCK + \
+				    EMU3_DNUM_OFFSET(dnum))
+
+//Inode IDs and dnums map to each other in both directions without any table.
+#define EMU3_INO(dnum, info) (((EMU3_DNUM_BLKNUM(dnum) - (info)->start_root_block) * EMU3_ENTRIES_PER_BLOCK) + \
+			      EMU3_DNUM_OFFSET(dnum) + EMU3_I_ID_OFFSET)
+#define EMU3_I_DNUM(inode, info) EMU3_DNUM((info)->start_root_block + ((inode)->i_ino - EMU3_I_ID_OFFSET) / EMU3_ENTRIES_PER_BLOCK, \
+					   ((inode)->i_ino - EMU3_I_ID_OFFSET) % EMU3_ENTRIES_PER_BLOCK)
 
 //For devices, this should be 102, 100 regular banks + 2 special rom files with fixed ids at 0x6b and 0x6d.
 //We use the maximum physically allowed.
@@ -74,8 +90,8 @@
 
 #define EMU3_IS_I_ROOT_DIR(inode) ((inode)->i_ino == EMU3_I_ID_ROOT_DIR)
 
-#define EMU3_IS_I_REG_DIR(dir, info) (((emu3_get_i_map(info, dir)) >= EMU3_DNUM((info)->start_root_block, 0)) && \
- 		                     ((emu3_get_i_map(info, dir)) <  EMU3_DNUM((info)->start_dir_content_block, 0)))
+#define EMU3_IS_I_REG_DIR(dir, info) (((dir)->i_ino >= EMU3_I_ID_OFFSET) && \
+				      ((dir)->i_ino < EMU3_I_ID_OFFSET + EMU3_ROOT_SLOTS(info)))
 
 #define EMU3_DENTRY_IS_FILE(e3d) (((e3d)->data.id >= 0) &&                      \
                                   ((e3d)->data.id < EMU3_MAX_FILES_PER_DIR) &&  \
@@ -106,6 +122,61 @@
 
 #define EMU3_ERR_NOT_BLK "%s: block %d not available\n"
 
+#define EMU3_ALLOC_FIRST 0	//Lowest free cluster
+#define EMU3_ALLOC_NEXT 1	//First free cluster after the last allocated one
+
+#define EMU3_MAX_RA_CLUSTERS 64
+
+struct emu3_mount_opts {
+	unsigned int alloc;
+	unsigned int ra_clusters;	//0 leaves the readahead window to the VFS
+	unsigned int flush_interval;	//Seconds, 0 disables the background flush
+	bool metacache;
+	bool discard;
+	bool lazy;		//Read-only mounts only. Implies nometacache.
+};
+
+enum emu3_stat {
+	EMU3_STAT_BLOCK_MAPS,
+	EMU3_STAT_CHAIN_STEPS,
+	EMU3_STAT_CLUSTERS_ALLOCATED,
+	EMU3_STAT_CLUSTERS_FREED,
+	EMU3_STAT_META_READS,
+	EMU3_STAT_META_CACHE_HITS,
+	EMU3_STAT_META_WRITES,
+	EMU3_STAT_LOOKUPS,
+	EMU3_STAT_LOOKUP_HITS,
+	EMU3_STAT_INODES_PREFILLED,
+	EMU3_STAT_ALLOC_WAIT_NS,
+	EMU3_STAT_MAX
+};
+
+enum emu3_lat {
+	EMU3_LAT_CREATE,
+	EMU3_LAT_FSYNC,
+	EMU3_LAT_MAX
+};
+
+//Bucket n counts latencies in [2^(n-1), 2^n) us. Bucket 0 is below 1 us and the last one is open.
+#define EMU3_LAT_BUCKETS 24
+
+struct emu3_stats {
+	u64 count[EMU3_STAT_MAX];
+	u64 lat[EMU3_LAT_MAX][EMU3_LAT_BUCKETS];
+};
+
+//Locks, outermost first:
+//emu3_inode.dir_sem protects the dentries, the block list and the occupancy maps of a directory.
+//It is taken exclusively by namespace operations and shared by lookups and readdir.
+//emu3_inode.data_sem protects the dentry data, the dnum and the cluster chain of a file.
+//emu3_sb_info.alloc_lock protects the cluster list and the dir content block list.
+//Chain entries are only written by their owner under both data_sem and alloc_lock so
+//they can be walked under data_sem alone.
+//On read-only mounts, lookups, readdir, statfs and the block mapping of files
+//use an index built at mount instead, which is never modified and needs no lock.
+//Lazy mounts have no index and load the cluster list by chunks, which are
+//read under RCU. See lazy.c.
+
 struct emu3_sb_info {
 	unsigned int blocks;
 	unsigned int start_root_block;
@@ -118,13 +189,74 @@ struct emu3_sb_info {
 	unsigned int blocks_per_cluster;
 	unsigned int clusters;
 	unsigned char cluster_size_shift;	//Cluster size always a power of 2
-	short *cluster_list;
+	unsigned char sub_block_bits;	//EMU3 blocks per device block as a power of 2
+	short *cluster_list;	//NULL on lazy mounts. See emu3_cluster_list_get.
+	struct emu3_lazy *lazy;
 	bool *dir_content_block_list;
-	unsigned int *i_maps;
-	struct mutex lock;
+	struct buffer_head **meta_bh;	//Pinned metadata blocks with metacache. Set at mount.
+	struct emu3_index *index;	//Read-only mounts only. See emu3_get_index.
+	struct emu3_index *retired_index;	//Dropped by a remount rw. Freed on unmount.
+	unsigned long *root_used_slots;	//One bit per root dentry. Protected by the root dir_sem.
+	struct mutex alloc_lock;
+	unsigned int next_cluster;	//Allocation hint for EMU3_ALLOC_NEXT. Protected by alloc_lock.
+	struct emu3_mount_opts opts;
+	struct delayed_work flush_work;
+	struct super_block *sb;
+	struct emu3_stats __percpu *stats;
+	struct kobject kobj;
+	struct completion kobj_unregister;
 	bool emu4;
 };
 
+#define emu3_stat_add(info, stat, n) this_cpu_add((info)->stats->count[stat], n)
+#define emu3_stat_inc(info, stat) emu3_stat_add(info, stat, 1)
+
+//Only contended acquisitions are timed.
+static inline void emu3_alloc_lock(struct emu3_sb_info *info)
+{
+	u64 start;
+
+	if (mutex_trylock(&info->alloc_lock))
+		return;
+
+	start = ktime_get_ns();
+	mutex_lock(&info->alloc_lock);
+	emu3_stat_add(info, EMU3_STAT_ALLOC_WAIT_NS, ktime_get_ns() - start);
+}
+
+static inline void emu3_alloc_unlock(struct emu3_sb_info *info)
+{
+	mutex_unlock(&info->alloc_lock);
+}
+
+//The index is only dropped by a remount rw. Operations already using it end
+//with the old contents, as if they had run before the remount.
+static inline const struct emu3_index *emu3_get_index(struct emu3_sb_info *info)
+{
+	return READ_ONCE(info->index);
+}
+
+int emu3_lazy_get(struct emu3_sb_info *, unsigned int);
+
+//Next cluster of a chain for readers that might run on lazy mounts, which
+//might need to read the block first. Negative on errors.
+static inline int emu3_cluster_list_get(struct emu3_sb_info *info,
+					unsigned int cluster)
+{
+	if (likely(info->cluster_list))
+		return le16_to_cpu(info->cluster_list[cluster]);
+	return emu3_lazy_get(info, cluster);
+}
+
+//Devices with bigger logical blocks are read in their own block size so a
+//buffer returned by emu3_bread might hold several EMU3 blocks.
+static inline void *emu3_block_data(struct emu3_sb_info *info,
+				    struct buffer_head *bh, sector_t blknum)
+{
+	return bh->b_data + ((blknum & ((1 << info->sub_block_bits) - 1)) <<
+			     EMU3_BSIZE_BITS);
+}
+
 struct emu3_file_attrs {
 	unsigned short start_cluster;
 	unsigned short clusters;
@@ -152,9 +284,48 @@ struct emu3_dentry {
 	struct emu3_dentry_data data;
 };
 
+//Copy of a dentry with its name as shown by readdir and, for files, its cluster chain.
+struct emu3_index_entry {
+	struct emu3_dentry e3d;
+	unsigned int dnum;
+	unsigned int slot;	//Position in the directory, as used by readdir.
+	const unsigned short *clusters;	//Part of emu3_index.clusters.
+	unsigned int nclusters;
+	unsigned int nfragments;
+	unsigned int len;
+	char name[EMU3_LENGTH_FILENAME];
+};
+
+//Entries of a directory, in entries and by_name.
+struct emu3_index_dir {
+	unsigned int first;
+	unsigned int count;
+};
+
+struct emu3_index {
+	struct emu3_index_entry *entries;	//Grouped by directory in slot order.
+	struct emu3_index_entry **by_name;	//Same groups sorted by name and slot.
+	struct emu3_index_entry **by_dnum;
+	unsigned int nentries;
+	unsigned int max;	//Size of the three arrays above.
+	struct emu3_index_dir *dirs;	//Indexed by root slot. The root directory goes last.
+	unsigned short *clusters;
+	unsigned int nclusters;
+	u64 free_blocks;
+	u64 free_inodes;
+};
+
 struct emu3_inode {
 	struct inode vfs_inode;
 	struct emu3_dentry_data data;
+	//Directory occupancy, built the first time it is needed.
+	//Slots are indexed as block list position * EMU3_ENTRIES_PER_BLOCK + offset.
+	bool maps_ready;
+	const struct emu3_index_entry *ientry;	//Files only, while the index is used.
+	DECLARE_BITMAP(used_slots, EMU3_MAX_FILES_PER_DIR);
+	DECLARE_BITMAP(used_ids, EMU3_MAX_FILES_PER_DIR);
+	struct rw_semaphore dir_sem;
+	struct rw_semaphore data_sem;
 };
 
 extern const struct file_operations emu3_file_operations_dir;
@@ -169,36 +340,83 @@ extern const struct address_space_operations emu3_aops;
 
 extern const struct xattr_handler *emu3_xattr_handlers[];
 
+extern const struct dentry_operations emu3_dentry_operations;
+
 struct inode *emu3_get_inode(struct super_block *, unsigned long);
 
+struct buffer_head *emu3_bread(struct super_block *, sector_t);
+
+void emu3_lat_record(struct emu3_sb_info *, enum emu3_lat, u64);
+
+int emu3_register_sysfs(struct super_block *);
+
+void emu3_unregister_sysfs(struct super_block *);
+
+void emu3_record_unmount(u64);
+
+int emu3_sysfs_init(void);
+
+void emu3_sysfs_exit(void);
+
+int emu3_fsync(struct file *, loff_t, loff_t, int);
+
 int emu3_next_free_cluster(struct emu3_sb_info *);
 
-void emu3_init_cluster_list(struct inode *);
+void emu3_free_cluster(struct emu3_sb_info *, short);
+
+void emu3_discard_chain(struct super_block *, short);
 
 int emu3_get_cluster(struct inode *, int);
 
+unsigned int emu3_get_fragments(struct emu3_sb_info *, short);
+
 sector_t emu3_get_phys_block(struct inode *, sector_t);
 
 struct emu3_dentry *emu3_find_dentry_by_inode(struct inode *,
 					      struct buffer_head **);
 
-unsigned long emu3_get_or_add_i_map(struct emu3_sb_info *, unsigned int);
+void emu3_move_inode(struct inode *, unsigned int);
 
-unsigned int emu3_get_i_map(struct emu3_sb_info *, struct inode *);
+void emu3_set_emu3_inode_data(struct inode *, const struct emu3_dentry *);
 
-void emu3_clear_i_map(struct emu3_sb_info *, struct inode *);
+void emu3_prefill_inode(struct super_block *, unsigned long,
+			const struct emu3_dentry *);
 
-void emu3_set_i_map(struct emu3_sb_info *, struct inode *, unsigned int);
+ssize_t emu3_listxattr(struct dentry *, char *, size_t);
 
-void emu3_set_emu3_inode_data(struct inode *, struct emu3_dentry *);
+void emu3_filename_fix(char *, char *);
 
-ssize_t emu3_listxattr(struct dentry *, char *, size_t);
+unsigned int emu3_name_length(const char *, unsigned int);
 
-void emu3_free_dir_content_block(struct emu3_sb_info *, short);
+struct emu3_index *emu3_build_index(struct super_block *);
+
+void emu3_free_index(struct emu3_index *);
+
+struct emu3_lazy *emu3_alloc_lazy(struct super_block *);
+
+void emu3_free_lazy(struct emu3_lazy *);
+
+int emu3_lazy_free_clusters(struct emu3_sb_info *);
+
+void emu3_lazy_free_runs(struct emu3_sb_info *, unsigned int *,
+			 unsigned int *);
+
+const struct emu3_index_entry *emu3_index_lookup(const struct emu3_index *,
+						 struct inode *, const char *,
+						 unsigned int);
 
-void emu3_use_dir_content_block(struct emu3_sb_info *, short);
+const struct emu3_index_entry *emu3_index_find(const struct emu3_index *,
+					       unsigned int);
 
-short emu3_get_free_dir_content_blknum(struct emu3_sb_info *);
+const struct emu3_index_dir *emu3_index_dir(const struct emu3_index *,
+					    struct inode *);
+
+sector_t emu3_index_get_phys_block(struct emu3_sb_info *,
+				   const struct emu3_index_entry *, sector_t);
+
+void emu3_free_dir_content_block(struct emu3_sb_info *, short);
+
+short emu3_alloc_dir_content_block(struct emu3_sb_info *);
 
 void emu3_set_fattrs(struct emu3_sb_info *, struct emu3_file_attrs *, loff_t);
 
@@ -206,4 +424,30 @@ void emu3_init_fattrs(struct emu3_sb_info *, struct emu3_file_attrs *, short);
 
 void emu3_set_inode_blocks(struct inode *, struct emu3_file_attrs *);
 
+loff_t emu3_get_fattrs_size(struct emu3_sb_info *,
+			    const struct emu3_file_attrs *);
+
+long emu3_ioctl(struct file *, unsigned int, unsigned long);
+
+int emu3_get_dir_slot(struct inode *, unsigned int);
+
 void emu3_prune_cluster_list(struct inode *);
+
+void emu3_invalidate_dir_maps(struct inode *);
+
+void emu3_readahead_blocks(struct super_block *, unsigned int, unsigned int);
+
+//Helpers that are only exported to the KUnit suite in emu3_test.c.
+#ifdef EMU3_KUNIT
+#define EMU3_VISIBLE_IF_KUNIT
+
+void emu3_set_inode_size_file(struct inode *);
+
+int emu3_expand_cluster_list(struct inode *, sector_t);
+
+int emu3_filename_length(const char *);
+
+int emu3_strncmp(struct dentry *, struct emu3_dentry *);
+#else
+#define EMU3_VISIBLE_IF_KUNIT static
+#endif
@@ -0,0 +1,75 @@
+/*
+ *   emu3_ioctl.h
+ *   Copyright (C) 2018 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of emu3fs.
+ *
+ *   emu3fs is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   emu3fs is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with emu3fs. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+//ioctls on the directories of a mounted volume. Shared with userspace.
+
+#ifndef EMU3_IOCTL_H
+#define EMU3_IOCTL_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#define EMU3_IOCTL_NAME_LEN 16
+
+#define EMU3_CATALOG_FOLDER 0x01
+
+//Names are the ones shown by readdir, padded with NULs and not terminated
+//when they are 16 characters long. Folder records have an empty folder name.
+struct emu3_catalog_entry {
+	char name[EMU3_IOCTL_NAME_LEN];
+	char folder[EMU3_IOCTL_NAME_LEN];
+	__u64 ino;
+	__u64 size;
+	__u32 clusters;
+	__u32 fragments;	//Contiguous runs of clusters
+	__u8 id;		//Bank number
+	__u8 type;		//File type byte. 0 for folders.
+	__u8 flags;
+	__u8 props[5];
+};
+
+//On the root directory, the folders go first and then the banks of each
+//folder. On a folder, only its banks are returned.
+struct emu3_catalog {
+	__u64 entries;		//User pointer to an array of count records
+	__u32 count;		//In: records that fit. Out: records written.
+	__u32 total;		//Out: records available
+};
+
+//Banks are given by inode as names can be repeated in a folder.
+struct emu3_renumber_entry {
+	__u64 ino;
+	__u32 id;		//New bank number
+	__u32 pad;
+};
+
+//On a folder. Either every bank gets its new number or none does.
+struct emu3_renumber {
+	__u64 entries;		//User pointer to an array of count entries
+	__u32 count;
+	__u32 pad;
+};
+
+#define EMU3_IOCTL_MAGIC 0xe3
+
+#define EMU3_IOC_CATALOG _IOWR(EMU3_IOCTL_MAGIC, 1, struct emu3_catalog)
+#define EMU3_IOC_RENUMBER _IOW(EMU3_IOCTL_MAGIC, 2, struct emu3_renumber)
+
+#endif
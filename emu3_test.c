@@ -0,0 +1,375 @@
+/*
+ *   emu3_test.c
+ *   Copyright (C) 2018 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of emu3fs.
+ *
+ *   emu3fs is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   emu3fs is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with emu3fs. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+//KUnit suite for the helpers that do not need a block device.
+//Everything runs against an in-memory emu3_sb_info and the timings of the
+//hot helpers are reported for different chain lengths and fill levels.
+
+#include <kunit/test.h>
+#include <linux/random.h>
+#include "emu3_fs.h"
+
+#define EMU3_TEST_CLUSTERS 0x7ffe
+#define EMU3_TEST_SHIFT 19
+
+struct emu3_test_fs {
+	struct super_block sb;
+	struct emu3_sb_info info;
+};
+
+static int emu3_test_init(struct kunit *test)
+{
+	struct emu3_test_fs *fs;
+	struct emu3_sb_info *info;
+
+	fs = kunit_kzalloc(test, sizeof(*fs), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, fs);
+
+	info = &fs->info;
+	info->clusters = EMU3_TEST_CLUSTERS;
+	info->cluster_size_shift = EMU3_TEST_SHIFT;
+	info->blocks_per_cluster = 1 << (EMU3_TEST_SHIFT - EMU3_BSIZE_BITS);
+	info->start_data_block = 1024;
+	info->cluster_list = kunit_kcalloc(test, info->clusters, sizeof(short),
+					   GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, info->cluster_list);
+	info->stats = alloc_percpu(struct emu3_stats);
+	KUNIT_ASSERT_NOT_NULL(test, info->stats);
+	mutex_init(&info->alloc_lock);
+	info->sb = &fs->sb;
+	fs->sb.s_fs_info = info;
+
+	test->priv = fs;
+	return 0;
+}
+
+static void emu3_test_exit(struct kunit *test)
+{
+	struct emu3_test_fs *fs = test->priv;
+
+	free_percpu(fs->info.stats);
+}
+
+static struct inode *emu3_test_inode(struct kunit *test)
+{
+	struct emu3_test_fs *fs = test->priv;
+	struct emu3_inode *e3i;
+
+	e3i = kunit_kzalloc(test, sizeof(*e3i), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, e3i);
+	e3i->vfs_inode.i_sb = &fs->sb;
+	init_rwsem(&e3i->data_sem);
+	init_rwsem(&e3i->dir_sem);
+
+	return &e3i->vfs_inode;
+}
+
+//Writes a chain of len clusters starting at first and separated by stride.
+static void emu3_test_chain(struct inode *inode, short first, int len,
+			    int stride)
+{
+	struct emu3_sb_info *info = EMU3_SB(inode->i_sb);
+	struct emu3_inode *e3i = EMU3_I(inode);
+	int i;
+
+	for (i = 0; i < len - 1; i++)
+		info->cluster_list[first + i * stride] =
+		    cpu_to_le16(first + (i + 1) * stride);
+	info->cluster_list[first + i * stride] =
+	    cpu_to_le16(EMU_LAST_FILE_CLUSTER);
+
+	e3i->data.fattrs.start_cluster = cpu_to_le16(first);
+	e3i->data.fattrs.clusters = cpu_to_le16(len);
+}
+
+static int emu3_test_chain_len(struct inode *inode)
+{
+	struct emu3_sb_info *info = EMU3_SB(inode->i_sb);
+	short next = EMU3_I_START_CLUSTER(inode);
+	int len = 1;
+
+	while (le16_to_cpu(info->cluster_list[next]) != EMU_LAST_FILE_CLUSTER) {
+		next = le16_to_cpu(info->cluster_list[next]);
+		len++;
+	}
+
+	return len;
+}
+
+//Marks a pseudo random fill percentage of the clusters as used.
+static void emu3_test_fill(struct emu3_sb_info *info, int percent)
+{
+	int i;
+
+	for (i = 1; i < info->clusters; i++)
+		if (get_random_u32_below(100) < percent)
+			info->cluster_list[i] = cpu_to_le16(EMU_LAST_FILE_CLUSTER);
+}
+
+static void emu3_test_fattrs(struct kunit *test)
+{
+	struct emu3_test_fs *fs = test->priv;
+	struct emu3_sb_info *info = &fs->info;
+	struct emu3_file_attrs fattrs;
+	loff_t cs = 1 << EMU3_TEST_SHIFT;
+
+	emu3_set_fattrs(info, &fattrs, 0);
+	KUNIT_EXPECT_EQ(test, le16_to_cpu(fattrs.clusters), 1);
+	KUNIT_EXPECT_EQ(test, le16_to_cpu(fattrs.blocks), 1);
+	KUNIT_EXPECT_EQ(test, le16_to_cpu(fattrs.bytes), 0);
+
+	emu3_set_fattrs(info, &fattrs, 1);
+	KUNIT_EXPECT_EQ(test, le16_to_cpu(fattrs.clusters), 1);
+	KUNIT_EXPECT_EQ(test, le16_to_cpu(fattrs.blocks), 1);
+	KUNIT_EXPECT_EQ(test, le16_to_cpu(fattrs.bytes), 1);
+
+	//A single block must not look like an empty file.
+	emu3_set_fattrs(info, &fattrs, EMU3_BSIZE);
+	KUNIT_EXPECT_EQ(test, le16_to_cpu(fattrs.clusters), 1);
+	KUNIT_EXPECT_EQ(test, le16_to_cpu(fattrs.blocks), 1);
+	KUNIT_EXPECT_EQ(test, le16_to_cpu(fattrs.bytes), EMU3_BSIZE);
+
+	emu3_set_fattrs(info, &fattrs, 2 * cs);
+	KUNIT_EXPECT_EQ(test, le16_to_cpu(fattrs.clusters), 2);
+	KUNIT_EXPECT_EQ(test, le16_to_cpu(fattrs.blocks), 0);
+	KUNIT_EXPECT_EQ(test, le16_to_cpu(fattrs.bytes), 0);
+
+	emu3_set_fattrs(info, &fattrs, 2 * cs + 3 * EMU3_BSIZE + 7);
+	KUNIT_EXPECT_EQ(test, le16_to_cpu(fattrs.clusters), 3);
+	KUNIT_EXPECT_EQ(test, le16_to_cpu(fattrs.blocks), 4);
+	KUNIT_EXPECT_EQ(test, le16_to_cpu(fattrs.bytes), 7);
+
+	//Beyond 2 GiB the cluster count must not overflow.
+	emu3_set_fattrs(info, &fattrs, 0x1000 * cs + EMU3_BSIZE);
+	KUNIT_EXPECT_EQ(test, le16_to_cpu(fattrs.clusters), 0x1001);
+	KUNIT_EXPECT_EQ(test, le16_to_cpu(fattrs.blocks), 1);
+	KUNIT_EXPECT_EQ(test, le16_to_cpu(fattrs.bytes), 0);
+}
+
+//The size read from the dentry must be the one written.
+static void emu3_test_size_roundtrip(struct kunit *test)
+{
+	struct emu3_test_fs *fs = test->priv;
+	struct emu3_sb_info *info = &fs->info;
+	struct inode *inode = emu3_test_inode(test);
+	struct emu3_inode *e3i = EMU3_I(inode);
+	loff_t cs = 1 << EMU3_TEST_SHIFT;
+	loff_t sizes[] = { 0, 1, EMU3_BSIZE - 1, EMU3_BSIZE, EMU3_BSIZE + 1,
+		cs - 1, cs, cs + 1, cs + EMU3_BSIZE, 5 * cs + 1234,
+		0x7000 * cs + EMU3_BSIZE
+	};
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+		emu3_set_fattrs(info, &e3i->data.fattrs, sizes[i]);
+		emu3_set_inode_size_file(inode);
+		KUNIT_EXPECT_EQ_MSG(test, inode->i_size, sizes[i],
+				    "size %lld", sizes[i]);
+		KUNIT_EXPECT_EQ(test, inode->i_blocks,
+				(blkcnt_t)
+				le16_to_cpu(e3i->data.fattrs.clusters) *
+				info->blocks_per_cluster);
+	}
+}
+
+static void emu3_test_get_cluster(struct kunit *test)
+{
+	struct inode *inode = emu3_test_inode(test);
+	int lens[] = { 1, 16, 256, 4096, 16000 };
+	int i, n, rounds;
+	u64 start;
+
+	for (i = 0; i < ARRAY_SIZE(lens); i++) {
+		//Scattered chains are walked the same way, so only the length matters.
+		emu3_test_chain(inode, 1, lens[i], 2);
+
+		KUNIT_EXPECT_EQ(test, emu3_get_cluster(inode, 0), 1);
+		KUNIT_EXPECT_EQ(test, emu3_get_cluster(inode, lens[i] - 1),
+				1 + (lens[i] - 1) * 2);
+		KUNIT_EXPECT_EQ(test, emu3_get_cluster(inode, lens[i]), -1);
+
+		rounds = 0;
+		start = ktime_get_ns();
+		for (n = 0; n < lens[i]; n += 1 + lens[i] / 64, rounds++)
+			emu3_get_cluster(inode, n);
+		kunit_info(test, "get_cluster chain %d: %llu ns/lookup\n",
+			   lens[i], div_u64(ktime_get_ns() - start, rounds));
+
+		memset(EMU3_SB(inode->i_sb)->cluster_list, 0,
+		       EMU3_TEST_CLUSTERS * sizeof(short));
+	}
+}
+
+static void emu3_test_expand(struct kunit *test)
+{
+	struct emu3_test_fs *fs = test->priv;
+	struct emu3_sb_info *info = &fs->info;
+	struct inode *inode;
+	int fills[] = { 0, 50, 90, 99 };
+	int i, err, len = 64;
+	u64 start;
+
+	for (i = 0; i < ARRAY_SIZE(fills); i++) {
+		memset(info->cluster_list, 0, info->clusters * sizeof(short));
+		emu3_test_fill(info, fills[i]);
+		info->cluster_list[1] = cpu_to_le16(EMU_LAST_FILE_CLUSTER);
+
+		inode = emu3_test_inode(test);
+		emu3_test_chain(inode, 1, 1, 1);
+
+		down_write(&EMU3_I(inode)->data_sem);
+		start = ktime_get_ns();
+		err = emu3_expand_cluster_list(inode, (sector_t) (len - 1) *
+					       info->blocks_per_cluster);
+		start = ktime_get_ns() - start;
+		up_write(&EMU3_I(inode)->data_sem);
+
+		KUNIT_EXPECT_EQ(test, err, 0);
+		KUNIT_EXPECT_EQ(test, emu3_test_chain_len(inode), len);
+		kunit_info(test, "expand %d clusters at %d%% fill: %llu ns\n",
+			   len, fills[i], start);
+	}
+
+	//A full list can not be expanded.
+	for (i = 1; i < info->clusters; i++)
+		if (!info->cluster_list[i])
+			info->cluster_list[i] =
+			    cpu_to_le16(EMU_LAST_FILE_CLUSTER);
+	down_write(&EMU3_I(inode)->data_sem);
+	err = emu3_expand_cluster_list(inode, (sector_t) len *
+				       info->blocks_per_cluster);
+	up_write(&EMU3_I(inode)->data_sem);
+	KUNIT_EXPECT_EQ(test, err, -ENOSPC);
+}
+
+static void emu3_test_prune(struct kunit *test)
+{
+	struct emu3_test_fs *fs = test->priv;
+	struct emu3_sb_info *info = &fs->info;
+	struct inode *inode = emu3_test_inode(test);
+	int i, used = 0;
+
+	emu3_test_chain(inode, 10, 100, 3);
+	EMU3_I(inode)->data.fattrs.clusters = cpu_to_le16(40);
+
+	down_write(&EMU3_I(inode)->data_sem);
+	emu3_prune_cluster_list(inode);
+	up_write(&EMU3_I(inode)->data_sem);
+
+	KUNIT_EXPECT_EQ(test, emu3_test_chain_len(inode), 40);
+	for (i = 1; i < info->clusters; i++)
+		if (info->cluster_list[i])
+			used++;
+	KUNIT_EXPECT_EQ(test, used, 40);
+}
+
+static void emu3_test_next_free_cluster(struct kunit *test)
+{
+	struct emu3_test_fs *fs = test->priv;
+	struct emu3_sb_info *info = &fs->info;
+	int fills[] = { 0, 50, 90, 99 };
+	int i, n, c, allocs = 16;
+	u64 start;
+
+	for (i = 0; i < ARRAY_SIZE(fills); i++) {
+		memset(info->cluster_list, 0, info->clusters * sizeof(short));
+		emu3_test_fill(info, fills[i]);
+
+		mutex_lock(&info->alloc_lock);
+		start = ktime_get_ns();
+		for (n = 0; n < allocs; n++) {
+			c = emu3_next_free_cluster(info);
+			KUNIT_ASSERT_GT(test, c, 0);
+			KUNIT_EXPECT_EQ(test,
+					le16_to_cpu(info->cluster_list[c]),
+					EMU_LAST_FILE_CLUSTER);
+		}
+		start = ktime_get_ns() - start;
+		mutex_unlock(&info->alloc_lock);
+
+		kunit_info(test, "next_free_cluster at %d%% fill: %llu ns\n",
+			   fills[i], div_u64(start, allocs));
+	}
+}
+
+static void emu3_test_dir_slot(struct kunit *test)
+{
+	struct inode *dir = emu3_test_inode(test);
+	short *block_list = EMU3_I(dir)->data.dattrs.block_list;
+	int i;
+
+	for (i = 0; i < EMU3_BLOCKS_PER_DIR; i++)
+		block_list[i] = cpu_to_le16(EMU3_FREE_DIR_BLOCK);
+	block_list[0] = cpu_to_le16(200);
+	block_list[1] = cpu_to_le16(150);
+
+	KUNIT_EXPECT_EQ(test, emu3_get_dir_slot(dir, EMU3_DNUM(200, 0)), 0);
+	KUNIT_EXPECT_EQ(test, emu3_get_dir_slot(dir, EMU3_DNUM(200, 15)), 15);
+	KUNIT_EXPECT_EQ(test, emu3_get_dir_slot(dir, EMU3_DNUM(150, 3)),
+			EMU3_ENTRIES_PER_BLOCK + 3);
+	KUNIT_EXPECT_EQ(test, emu3_get_dir_slot(dir, EMU3_DNUM(151, 3)), -1);
+}
+
+static void emu3_test_filenames(struct kunit *test)
+{
+	struct emu3_dentry e3d;
+	struct dentry dentry;
+	char fixed[EMU3_LENGTH_FILENAME];
+
+	memcpy(e3d.name, "Bank 1/2        ", EMU3_LENGTH_FILENAME);
+	KUNIT_EXPECT_EQ(test, emu3_name_length(e3d.name, EMU3_LENGTH_FILENAME),
+			8);
+	KUNIT_EXPECT_EQ(test, emu3_name_length("Bank\0\0  ", 8), 4);
+	KUNIT_EXPECT_EQ(test, emu3_filename_length("                "), -1);
+
+	emu3_filename_fix(e3d.name, fixed);
+	KUNIT_EXPECT_EQ(test, emu3_filename_length(fixed), 8);
+	KUNIT_EXPECT_EQ(test, memcmp(fixed, "Bank 1?2", 8), 0);
+
+	dentry.d_name = (struct qstr)QSTR_INIT("Bank 1?2", 8);
+	KUNIT_EXPECT_EQ(test, emu3_strncmp(&dentry, &e3d), 0);
+	dentry.d_name = (struct qstr)QSTR_INIT("Bank 1?2  ", 10);
+	KUNIT_EXPECT_EQ(test, emu3_strncmp(&dentry, &e3d), 0);
+	dentry.d_name = (struct qstr)QSTR_INIT("Bank 1/2", 8);
+	KUNIT_EXPECT_NE(test, emu3_strncmp(&dentry, &e3d), 0);
+	dentry.d_name = (struct qstr)QSTR_INIT("Bank 1?", 7);
+	KUNIT_EXPECT_NE(test, emu3_strncmp(&dentry, &e3d), 0);
+}
+
+static struct kunit_case emu3_test_cases[] = {
+	KUNIT_CASE(emu3_test_fattrs),
+	KUNIT_CASE(emu3_test_size_roundtrip),
+	KUNIT_CASE(emu3_test_get_cluster),
+	KUNIT_CASE(emu3_test_expand),
+	KUNIT_CASE(emu3_test_prune),
+	KUNIT_CASE(emu3_test_next_free_cluster),
+	KUNIT_CASE(emu3_test_dir_slot),
+	KUNIT_CASE(emu3_test_filenames),
+	{ }
+};
+
+static struct kunit_suite emu3_test_suite = {
+	.name = "emu3fs",
+	.init = emu3_test_init,
+	.exit = emu3_test_exit,
+	.test_cases = emu3_test_cases,
+};
+
+kunit_test_suite(emu3_test_suite);
@@ -0,0 +1,218 @@
+/*
+ *   emu3_trace.h
+ *   Copyright (C) 2018 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of emu3fs.
+ *
+ *   emu3fs is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   emu3fs is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with emu3fs. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM emu3
+
+#if !defined(_EMU3_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _EMU3_TRACE_H
+
+#include <linux/tracepoint.h>
+
+DECLARE_EVENT_CLASS(emu3_inode_class,
+		    TP_PROTO(struct inode *inode, int err),
+		    TP_ARGS(inode, err),
+		    TP_STRUCT__entry(__field(dev_t, dev)
+				     __field(unsigned long, ino)
+				     __field(int, err)),
+		    TP_fast_assign(__entry->dev = inode->i_sb->s_dev;
+				   __entry->ino = inode->i_ino;
+				   __entry->err = err;),
+		    TP_printk("dev %d:%d ino %lu err %d",
+			      MAJOR(__entry->dev), MINOR(__entry->dev),
+			      __entry->ino, __entry->err)
+    );
+
+DECLARE_EVENT_CLASS(emu3_name_class,
+		    TP_PROTO(struct inode *dir, const struct qstr *name,
+			     unsigned long ino, int err),
+		    TP_ARGS(dir, name, ino, err),
+		    TP_STRUCT__entry(__field(dev_t, dev)
+				     __field(unsigned long, dir)
+				     __field(unsigned long, ino)
+				     __field(int, err)
+				     __string(name, name->name)),
+		    TP_fast_assign(__entry->dev = dir->i_sb->s_dev;
+				   __entry->dir = dir->i_ino;
+				   __entry->ino = ino;
+				   __entry->err = err;
+				   __assign_str(name);),
+		    TP_printk("dev %d:%d dir %lu name '%s' ino %lu err %d",
+			      MAJOR(__entry->dev), MINOR(__entry->dev),
+			      __entry->dir, __get_str(name), __entry->ino,
+			      __entry->err)
+    );
+
+DEFINE_EVENT(emu3_name_class, emu3_lookup,
+	     TP_PROTO(struct inode *dir, const struct qstr *name,
+		      unsigned long ino, int err),
+	     TP_ARGS(dir, name, ino, err)
+    );
+
+DEFINE_EVENT(emu3_name_class, emu3_create,
+	     TP_PROTO(struct inode *dir, const struct qstr *name,
+		      unsigned long ino, int err),
+	     TP_ARGS(dir, name, ino, err)
+    );
+
+DEFINE_EVENT(emu3_name_class, emu3_unlink,
+	     TP_PROTO(struct inode *dir, const struct qstr *name,
+		      unsigned long ino, int err),
+	     TP_ARGS(dir, name, ino, err)
+    );
+
+TRACE_EVENT(emu3_rename,
+	    TP_PROTO(struct inode *old_dir, struct inode *new_dir,
+		     const struct qstr *name, unsigned long old_ino,
+		     unsigned long new_ino, int err),
+	    TP_ARGS(old_dir, new_dir, name, old_ino, new_ino, err),
+	    TP_STRUCT__entry(__field(dev_t, dev)
+			     __field(unsigned long, old_dir)
+			     __field(unsigned long, new_dir)
+			     __field(unsigned long, old_ino)
+			     __field(unsigned long, new_ino)
+			     __field(int, err)
+			     __string(name, name->name)),
+	    TP_fast_assign(__entry->dev = old_dir->i_sb->s_dev;
+			   __entry->old_dir = old_dir->i_ino;
+			   __entry->new_dir = new_dir->i_ino;
+			   __entry->old_ino = old_ino;
+			   __entry->new_ino = new_ino;
+			   __entry->err = err;
+			   __assign_str(name);),
+	    TP_printk
+	    ("dev %d:%d dir %lu -> %lu name '%s' ino %lu -> %lu err %d",
+	     MAJOR(__entry->dev), MINOR(__entry->dev), __entry->old_dir,
+	     __entry->new_dir, __get_str(name), __entry->old_ino,
+	     __entry->new_ino, __entry->err)
+    );
+
+TRACE_EVENT(emu3_readdir,
+	    TP_PROTO(struct inode *dir, loff_t start, loff_t end, int err),
+	    TP_ARGS(dir, start, end, err),
+	    TP_STRUCT__entry(__field(dev_t, dev)
+			     __field(unsigned long, ino)
+			     __field(loff_t, start)
+			     __field(loff_t, end)
+			     __field(int, err)),
+	    TP_fast_assign(__entry->dev = dir->i_sb->s_dev;
+			   __entry->ino = dir->i_ino;
+			   __entry->start = start;
+			   __entry->end = end;
+			   __entry->err = err;),
+	    TP_printk("dev %d:%d ino %lu pos %lld -> %lld err %d",
+		      MAJOR(__entry->dev), MINOR(__entry->dev),
+		      __entry->ino, __entry->start, __entry->end,
+		      __entry->err)
+    );
+
+TRACE_EVENT(emu3_get_block,
+	    TP_PROTO(struct inode *inode, sector_t block, sector_t phys,
+		     unsigned int steps, int create),
+	    TP_ARGS(inode, block, phys, steps, create),
+	    TP_STRUCT__entry(__field(dev_t, dev)
+			     __field(unsigned long, ino)
+			     __field(sector_t, block)
+			     __field(sector_t, phys)
+			     __field(unsigned int, steps)
+			     __field(int, create)),
+	    TP_fast_assign(__entry->dev = inode->i_sb->s_dev;
+			   __entry->ino = inode->i_ino;
+			   __entry->block = block;
+			   __entry->phys = phys;
+			   __entry->steps = steps;
+			   __entry->create = create;),
+	    TP_printk("dev %d:%d ino %lu block %llu phys %lld steps %u create %d",
+		      MAJOR(__entry->dev), MINOR(__entry->dev),
+		      __entry->ino, (unsigned long long)__entry->block,
+		      (long long)__entry->phys, __entry->steps,
+		      __entry->create)
+    );
+
+DECLARE_EVENT_CLASS(emu3_clusters_class,
+		    TP_PROTO(struct super_block *sb, unsigned int cluster,
+			     unsigned int count),
+		    TP_ARGS(sb, cluster, count),
+		    TP_STRUCT__entry(__field(dev_t, dev)
+				     __field(unsigned int, cluster)
+				     __field(unsigned int, count)),
+		    TP_fast_assign(__entry->dev = sb->s_dev;
+				   __entry->cluster = cluster;
+				   __entry->count = count;),
+		    TP_printk("dev %d:%d cluster %u count %u",
+			      MAJOR(__entry->dev), MINOR(__entry->dev),
+			      __entry->cluster, __entry->count)
+    );
+
+DEFINE_EVENT(emu3_clusters_class, emu3_alloc_cluster,
+	     TP_PROTO(struct super_block *sb, unsigned int cluster,
+		      unsigned int count),
+	     TP_ARGS(sb, cluster, count)
+    );
+
+//The cluster is the first one of the freed chain.
+DEFINE_EVENT(emu3_clusters_class, emu3_free_clusters,
+	     TP_PROTO(struct super_block *sb, unsigned int cluster,
+		      unsigned int count),
+	     TP_ARGS(sb, cluster, count)
+    );
+
+DEFINE_EVENT(emu3_inode_class, emu3_write_inode,
+	     TP_PROTO(struct inode *inode, int err),
+	     TP_ARGS(inode, err)
+    );
+
+TRACE_EVENT(emu3_write_cluster_list,
+	    TP_PROTO(struct super_block *sb, unsigned int dirty, int err),
+	    TP_ARGS(sb, dirty, err),
+	    TP_STRUCT__entry(__field(dev_t, dev)
+			     __field(unsigned int, dirty)
+			     __field(int, err)),
+	    TP_fast_assign(__entry->dev = sb->s_dev;
+			   __entry->dirty = dirty;
+			   __entry->err = err;),
+	    TP_printk("dev %d:%d dirty blocks %u err %d",
+		      MAJOR(__entry->dev), MINOR(__entry->dev),
+		      __entry->dirty, __entry->err)
+    );
+
+TRACE_EVENT(emu3_bread,
+	    TP_PROTO(struct super_block *sb, sector_t blknum, bool cached),
+	    TP_ARGS(sb, blknum, cached),
+	    TP_STRUCT__entry(__field(dev_t, dev)
+			     __field(sector_t, blknum)
+			     __field(bool, cached)),
+	    TP_fast_assign(__entry->dev = sb->s_dev;
+			   __entry->blknum = blknum;
+			   __entry->cached = cached;),
+	    TP_printk("dev %d:%d block %llu %s",
+		      MAJOR(__entry->dev), MINOR(__entry->dev),
+		      (unsigned long long)__entry->blknum,
+		      __entry->cached ? "cached" : "read")
+    );
+
+#endif
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE emu3_trace
+
+#include <trace/define_trace.h>
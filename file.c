@@ -21,29 +21,37 @@
 #include <linux/fs.h>
 #include <linux/mpage.h>
 #include "emu3_fs.h"
+#include "emu3_trace.h"
 
 //Base 0 search
-static int emu3_expand_cluster_list(struct inode *inode, sector_t block)
+EMU3_VISIBLE_IF_KUNIT int emu3_expand_cluster_list(struct inode *inode, sector_t block)
 {
 	struct emu3_sb_info *info = EMU3_SB(inode->i_sb);
 	int cluster = ((int)block) / info->blocks_per_cluster;
 	short next = EMU3_I_START_CLUSTER(inode);
-	int new, i = 0;
+	int new, i = 0, err = 0;
+
+	lockdep_assert_held_write(&EMU3_I(inode)->data_sem);
 
 	while (le16_to_cpu(info->cluster_list[next]) != EMU_LAST_FILE_CLUSTER) {
 		next = le16_to_cpu(info->cluster_list[next]);
 		i++;
 	}
+
+	emu3_alloc_lock(info);
 	while (i < cluster) {
 		new = emu3_next_free_cluster(info);
-		if (new < 0)
-			return -ENOSPC;
+		if (new < 0) {
+			err = -ENOSPC;
+			break;
+		}
 		info->cluster_list[next] = cpu_to_le16(new);
 		next = new;
 		i++;
 	}
-	info->cluster_list[next] = cpu_to_le16(EMU_LAST_FILE_CLUSTER);
-	return 0;
+	emu3_alloc_unlock(info);
+
+	return err;
 }
 
 static int
@@ -54,30 +62,55 @@ emu3_get_block(struct inode *inode, sector_t block,
 	struct super_block *sb = inode->i_sb;
 	struct emu3_inode *e3i = EMU3_I(inode);
 	struct emu3_sb_info *info = EMU3_SB(sb);
+	unsigned int steps = 0;
 	int err;
 
-	phys = emu3_get_phys_block(inode, block);
+	//The block is in device blocks, which might hold several EMU3 blocks.
+	block <<= info->sub_block_bits;
+
+	//Each cluster before the one containing the block is a step in the chain.
+	//The index has the whole chain of the file so it takes none.
+	if (e3i->ientry && emu3_get_index(info))
+		phys = emu3_index_get_phys_block(info, e3i->ientry, block);
+	else {
+		down_read(&e3i->data_sem);
+		phys = emu3_get_phys_block(inode, block);
+		up_read(&e3i->data_sem);
+		steps = block / info->blocks_per_cluster;
+	}
+
+	trace_emu3_get_block(inode, block, phys, steps, create);
+	emu3_stat_inc(info, EMU3_STAT_BLOCK_MAPS);
+	emu3_stat_add(info, EMU3_STAT_CHAIN_STEPS, steps);
+
 	if (phys != -1) {
-		map_bh(bh_result, sb, phys);
+		map_bh(bh_result, sb, phys >> info->sub_block_bits);
 		return 0;
 	}
 
 	if (!create)
 		return 0;
 
-	mutex_lock(&info->lock);
-	err = emu3_expand_cluster_list(inode, block);
-	mutex_unlock(&info->lock);
+	down_write(&e3i->data_sem);
+
+	//Another writer might have expanded the chain in the meantime.
+	phys = emu3_get_phys_block(inode, block);
+	if (phys == -1) {
+		err = emu3_expand_cluster_list(inode, block);
+		if (err) {
+			up_write(&e3i->data_sem);
+			return err;
+		}
 
-	if (err)
-		return err;
-	else {
 		phys = emu3_get_phys_block(inode, block);
-		map_bh(bh_result, sb, phys);
 		inode->i_blocks += info->blocks_per_cluster;
 		e3i->data.fattrs.clusters++;
 	}
 
+	up_write(&e3i->data_sem);
+
+	map_bh(bh_result, sb, phys >> info->sub_block_bits);
+
 	return 0;
 }
 
@@ -86,6 +119,28 @@ static int emu3_read_folio(struct file *file, struct folio *folio)
 	return block_read_full_folio(folio, emu3_get_block);
 }
 
+//Clusters are contiguous on disk, so the window is widened to whole clusters
+//when the ra_clusters option is set.
+static void emu3_readahead(struct readahead_control *rac)
+{
+	struct inode *inode = rac->mapping->host;
+	struct emu3_sb_info *info = EMU3_SB(inode->i_sb);
+	unsigned int ra_clusters = info->opts.ra_clusters;
+	loff_t start, size = i_size_read(inode);
+
+	if (ra_clusters) {
+		start = round_down(readahead_pos(rac),
+				   1 << info->cluster_size_shift);
+		if (start < size)
+			readahead_expand(rac, start,
+					 min_t(loff_t, size - start,
+					       (loff_t)ra_clusters <<
+					       info->cluster_size_shift));
+	}
+
+	mpage_readahead(rac, emu3_get_block);
+}
+
 static int emu3_writepages(struct address_space *mapping,
 			   struct writeback_control *wbc)
 {
@@ -104,6 +159,18 @@ static sector_t emu3_bmap(struct address_space *mapping, sector_t block)
 	return generic_block_bmap(mapping, block, emu3_get_block);
 }
 
+int emu3_fsync(struct file *file, loff_t start, loff_t end, int datasync)
+{
+	int err;
+	u64 t = ktime_get_ns();
+	struct inode *inode = file_inode(file);
+
+	err = generic_file_fsync(file, start, end, datasync);
+	emu3_lat_record(EMU3_SB(inode->i_sb), EMU3_LAT_FSYNC, t);
+
+	return err;
+}
+
 static int emu3_setattr(struct mnt_idmap *idmap, struct dentry *dentry,
 			struct iattr *attr)
 {
@@ -123,11 +190,11 @@ static int emu3_setattr(struct mnt_idmap *idmap, struct dentry *dentry,
 			return err;
 
 		truncate_setsize(inode, attr->ia_size);
-		mutex_lock(&info->lock);
+		down_write(&e3i->data_sem);
 		emu3_set_fattrs(info, &e3i->data.fattrs, attr->ia_size);
 		emu3_prune_cluster_list(inode);
 		blocks = e3i->data.fattrs.clusters * info->blocks_per_cluster;
-		mutex_unlock(&info->lock);
+		up_write(&e3i->data_sem);
 
 		inode->i_blocks = blocks;
 	}
@@ -139,6 +206,7 @@ static int emu3_setattr(struct mnt_idmap *idmap, struct dentry *dentry,
 
 const struct address_space_operations emu3_aops = {
 	.read_folio = emu3_read_folio,
+	.readahead = emu3_readahead,
 	.writepages = emu3_writepages,
 	.write_begin = emu3_write_begin,
 	.write_end = generic_write_end,
@@ -151,7 +219,7 @@ const struct file_operations emu3_file_operations_file = {
 	.write_iter = generic_file_write_iter,
 	.mmap = generic_file_mmap,
 	.splice_read = filemap_splice_read,
-	.fsync = generic_file_fsync
+	.fsync = emu3_fsync
 };
 
 const struct inode_operations emu3_inode_operations_file = {
@@ -0,0 +1,316 @@
+/*
+ *   index.c
+ *   Copyright (C) 2018 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of emu3fs.
+ *
+ *   emu3fs is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   emu3fs is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with emu3fs. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+//Read-only mounts can not change the metadata so every folder, bank and
+//cluster chain is copied at mount into arrays that are never modified.
+//Readers use them without taking any lock or reading any block.
+
+#include <linux/sort.h>
+#include "emu3_fs.h"
+
+static int emu3_index_name_cmp(const struct emu3_index_entry *ie,
+			       const char *name, unsigned int len)
+{
+	if (ie->len != len)
+		return ie->len < len ? -1 : 1;
+	return memcmp(ie->name, name, len);
+}
+
+//Repeated names are sorted by slot so a lookup finds the first one on disk.
+static int emu3_index_cmp_by_name(const void *a, const void *b)
+{
+	const struct emu3_index_entry *x = *(struct emu3_index_entry **)a;
+	const struct emu3_index_entry *y = *(struct emu3_index_entry **)b;
+	int ret = emu3_index_name_cmp(x, y->name, y->len);
+
+	if (ret)
+		return ret;
+	return x->slot < y->slot ? -1 : x->slot > y->slot;
+}
+
+static int emu3_index_cmp_by_dnum(const void *a, const void *b)
+{
+	const struct emu3_index_entry *x = *(struct emu3_index_entry **)a;
+	const struct emu3_index_entry *y = *(struct emu3_index_entry **)b;
+
+	return x->dnum < y->dnum ? -1 : x->dnum > y->dnum;
+}
+
+//NULL once the entries are full, which only a corrupt image can cause.
+static struct emu3_index_entry *emu3_index_add(struct emu3_index *index,
+					       struct emu3_dentry *e3d,
+					       unsigned int dnum,
+					       unsigned int slot)
+{
+	struct emu3_index_entry *ie;
+
+	if (index->nentries == index->max)
+		return NULL;
+
+	ie = &index->entries[index->nentries];
+
+	ie->e3d = *e3d;
+	ie->dnum = dnum;
+	ie->slot = slot;
+	emu3_filename_fix(e3d->name, ie->name);
+	ie->len = emu3_name_length(ie->name, EMU3_LENGTH_FILENAME);
+	index->by_name[index->nentries] = ie;
+	index->by_dnum[index->nentries] = ie;
+	index->nentries++;
+
+	return ie;
+}
+
+//Same chain emu3_get_cluster walks. Every cluster can only be in a single
+//chain, so more clusters than in the volume means a loop or a cross-link.
+static int emu3_index_add_chain(struct emu3_sb_info *info,
+				struct emu3_index *index,
+				struct emu3_index_entry *ie)
+{
+	short cluster = le16_to_cpu(ie->e3d.data.fattrs.start_cluster);
+	short prev = -1;
+
+	ie->clusters = &index->clusters[index->nclusters];
+	ie->nfragments = 0;
+	while (1) {
+		if (cluster < 1 || cluster >= info->clusters ||
+		    index->nclusters == info->clusters)
+			return -EIO;
+		if (cluster != prev + 1)
+			ie->nfragments++;
+		index->clusters[index->nclusters++] = cluster;
+		prev = cluster;
+		cluster = le16_to_cpu(info->cluster_list[cluster]);
+		if (cluster == EMU_LAST_FILE_CLUSTER)
+			break;
+	}
+	ie->nclusters = &index->clusters[index->nclusters] - ie->clusters;
+
+	return 0;
+}
+
+static int emu3_index_add_blocks(struct super_block *sb,
+				 struct emu3_index *index,
+				 struct emu3_index_entry *folder)
+{
+	int i, j, err;
+	short blknum;
+	struct buffer_head *b;
+	struct emu3_dentry *e3d;
+	struct emu3_index_entry *ie;
+	struct emu3_sb_info *info = EMU3_SB(sb);
+
+	for (i = 0; i < EMU3_BLOCKS_PER_DIR; i++) {
+		blknum = le16_to_cpu(folder->e3d.data.dattrs.block_list[i]);
+		//Same range emu3_fill_super accepts.
+		if (blknum < info->start_dir_content_block ||
+		    blknum >= info->start_dir_content_block +
+		    info->dir_content_blocks)
+			break;
+
+		b = emu3_bread(sb, blknum);
+		if (!b) {
+			printk(KERN_CRIT EMU3_ERR_NOT_BLK, EMU3_MODULE_NAME,
+			       blknum);
+			return -EIO;
+		}
+
+		e3d = emu3_block_data(info, b, blknum);
+		for (j = 0; j < EMU3_ENTRIES_PER_BLOCK; j++, e3d++) {
+			if (!EMU3_DENTRY_IS_FILE(e3d))
+				continue;
+
+			ie = emu3_index_add(index, e3d, EMU3_DNUM(blknum, j),
+					    i * EMU3_ENTRIES_PER_BLOCK + j);
+			err = ie ? emu3_index_add_chain(info, index, ie) : -EIO;
+			if (err) {
+				brelse(b);
+				return err;
+			}
+		}
+		brelse(b);
+	}
+
+	return 0;
+}
+
+void emu3_free_index(struct emu3_index *index)
+{
+	if (!index)
+		return;
+
+	kvfree(index->entries);
+	kvfree(index->by_name);
+	kvfree(index->by_dnum);
+	kvfree(index->dirs);
+	kvfree(index->clusters);
+	kfree(index);
+}
+
+//Every file is in a dir content block, which gives the upper bound of the entries.
+struct emu3_index *emu3_build_index(struct super_block *sb)
+{
+	int i, j, err = 0;
+	unsigned int blknum, folders;
+	struct buffer_head *b;
+	struct emu3_dentry *e3d;
+	struct emu3_index *index;
+	struct emu3_index_dir *d;
+	struct emu3_sb_info *info = EMU3_SB(sb);
+	unsigned int max = EMU3_ROOT_SLOTS(info) +
+	    info->dir_content_blocks * EMU3_ENTRIES_PER_BLOCK;
+
+	index = kzalloc(sizeof(struct emu3_index), GFP_KERNEL);
+	if (!index)
+		return ERR_PTR(-ENOMEM);
+
+	index->max = max;
+	index->entries = kvcalloc(max, sizeof(struct emu3_index_entry),
+				  GFP_KERNEL);
+	index->by_name = kvcalloc(max, sizeof(struct emu3_index_entry *),
+				  GFP_KERNEL);
+	index->by_dnum = kvcalloc(max, sizeof(struct emu3_index_entry *),
+				  GFP_KERNEL);
+	index->dirs = kvcalloc(EMU3_ROOT_SLOTS(info) + 1,
+			       sizeof(struct emu3_index_dir), GFP_KERNEL);
+	index->clusters = kvcalloc(info->clusters, sizeof(unsigned short),
+				   GFP_KERNEL);
+	if (!index->entries || !index->by_name || !index->by_dnum ||
+	    !index->dirs || !index->clusters) {
+		err = -ENOMEM;
+		goto err;
+	}
+
+	for (i = 0; i < info->root_blocks; i++) {
+		blknum = info->start_root_block + i;
+		b = emu3_bread(sb, blknum);
+		if (!b) {
+			printk(KERN_CRIT EMU3_ERR_NOT_BLK, EMU3_MODULE_NAME,
+			       blknum);
+			err = -EIO;
+			goto err;
+		}
+
+		e3d = emu3_block_data(info, b, blknum);
+		for (j = 0; j < EMU3_ENTRIES_PER_BLOCK; j++, e3d++)
+			if (EMU3_DENTRY_IS_DIR(e3d) &&
+			    !emu3_index_add(index, e3d, EMU3_DNUM(blknum, j),
+					    i * EMU3_ENTRIES_PER_BLOCK + j)) {
+				err = -EIO;
+				break;
+			}
+		brelse(b);
+		if (err)
+			goto err;
+	}
+
+	folders = index->nentries;
+	index->dirs[EMU3_ROOT_SLOTS(info)].count = folders;
+
+	for (i = 0; i < folders; i++) {
+		d = &index->dirs[index->entries[i].slot];
+		d->first = index->nentries;
+		err = emu3_index_add_blocks(sb, index, &index->entries[i]);
+		if (err)
+			goto err;
+		d->count = index->nentries - d->first;
+	}
+
+	for (i = 0; i <= EMU3_ROOT_SLOTS(info); i++) {
+		d = &index->dirs[i];
+		sort(&index->by_name[d->first], d->count,
+		     sizeof(struct emu3_index_entry *), emu3_index_cmp_by_name,
+		     NULL);
+	}
+	sort(index->by_dnum, index->nentries,
+	     sizeof(struct emu3_index_entry *), emu3_index_cmp_by_dnum, NULL);
+
+	return index;
+
+ err:
+	emu3_free_index(index);
+	return ERR_PTR(err);
+}
+
+const struct emu3_index_dir *emu3_index_dir(const struct emu3_index *index,
+					    struct inode *dir)
+{
+	struct emu3_sb_info *info = EMU3_SB(dir->i_sb);
+
+	if (EMU3_IS_I_ROOT_DIR(dir))
+		return &index->dirs[EMU3_ROOT_SLOTS(info)];
+	return &index->dirs[dir->i_ino - EMU3_I_ID_OFFSET];
+}
+
+//name is the one given by the VFS without the padding.
+const struct emu3_index_entry *emu3_index_lookup(const struct emu3_index
+						 *index, struct inode *dir,
+						 const char *name,
+						 unsigned int len)
+{
+	const struct emu3_index_dir *d = emu3_index_dir(index, dir);
+	struct emu3_index_entry **by_name = &index->by_name[d->first];
+	unsigned int lo = 0, hi = d->count, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (emu3_index_name_cmp(by_name[mid], name, len) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (lo < d->count && !emu3_index_name_cmp(by_name[lo], name, len))
+		return by_name[lo];
+	return NULL;
+}
+
+const struct emu3_index_entry *emu3_index_find(const struct emu3_index *index,
+					       unsigned int dnum)
+{
+	unsigned int lo = 0, hi = index->nentries, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (index->by_dnum[mid]->dnum < dnum)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (lo < index->nentries && index->by_dnum[lo]->dnum == dnum)
+		return index->by_dnum[lo];
+	return NULL;
+}
+
+//Same result than emu3_get_phys_block.
+sector_t emu3_index_get_phys_block(struct emu3_sb_info *info,
+				   const struct emu3_index_entry *ie,
+				   sector_t block)
+{
+	unsigned int cluster = ((unsigned int)block) / info->blocks_per_cluster;
+	unsigned int offset = ((unsigned int)block) % info->blocks_per_cluster;
+
+	if (cluster >= ie->nclusters)
+		return -1;
+	cluster = ie->clusters[cluster];
+	return info->start_data_block +
+	    ((cluster - 1) * info->blocks_per_cluster) + offset;
+}
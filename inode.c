@@ -24,56 +24,18 @@
 #include "emu3_fs.h"
 
 inline void emu3_set_emu3_inode_data(struct inode *inode,
-				     struct emu3_dentry *e3d)
+				     const struct emu3_dentry *e3d)
 {
 	struct emu3_inode *e3i = EMU3_I(inode);
 	memcpy(&e3i->data, &e3d->data, sizeof(struct emu3_dentry_data));
 }
 
-inline void emu3_set_i_map(struct emu3_sb_info *info,
-			   struct inode *inode, unsigned int dnum)
+//The inode ID follows the dentry so it changes when a file is moved to another directory.
+void emu3_move_inode(struct inode *inode, unsigned int dnum)
 {
-	info->i_maps[inode->i_ino - EMU3_I_ID_MAP_OFFSET] = dnum;
-}
-
-inline unsigned int emu3_get_i_map(struct emu3_sb_info *info,
-				   struct inode *inode)
-{
-	return info->i_maps[inode->i_ino - EMU3_I_ID_MAP_OFFSET];
-}
-
-inline void emu3_clear_i_map(struct emu3_sb_info *info, struct inode *inode)
-{
-	info->i_maps[inode->i_ino - EMU3_I_ID_MAP_OFFSET] = 0;
-}
-
-unsigned long emu3_get_or_add_i_map(struct emu3_sb_info *info,
-				    unsigned int dnum)
-{
-	int i, pos;
-	bool found;
-	unsigned int *empty;
-	unsigned int *v;
-
-	empty = NULL;
-	found = 0;
-	v = info->i_maps;
-	for (i = 0; i < EMU3_TOTAL_ENTRIES(info); i++, v++) {
-		if ((*v) == dnum) {
-			found = 1;
-			break;
-		}
-
-		if (!(*v) && !empty) {
-			empty = v;
-			pos = i;
-		}
-	}
-
-	if (!found)
-		*empty = dnum;
-
-	return (found ? i : pos) + EMU3_I_ID_MAP_OFFSET;
+	remove_inode_hash(inode);
+	inode->i_ino = EMU3_INO(dnum, EMU3_SB(inode->i_sb));
+	insert_inode_hash(inode);
 }
 
 struct emu3_dentry *emu3_find_dentry_by_inode(struct inode *inode,
@@ -81,13 +43,17 @@ struct emu3_dentry *emu3_find_dentry_by_inode(struct inode *inode,
 {
 	struct emu3_dentry *e3d;
 	struct emu3_sb_info *info = EMU3_SB(inode->i_sb);
-	unsigned int dnum = emu3_get_i_map(info, inode);
+	unsigned int dnum = EMU3_I_DNUM(inode, info);
 	unsigned int blknum = EMU3_DNUM_BLKNUM(dnum);
 	unsigned int offset = EMU3_DNUM_OFFSET(dnum);
 
-	*b = sb_bread(inode->i_sb, blknum);
+	*b = emu3_bread(inode->i_sb, blknum);
+	if (!*b) {
+		printk(KERN_CRIT EMU3_ERR_NOT_BLK, EMU3_MODULE_NAME, blknum);
+		return NULL;
+	}
 
-	e3d = (struct emu3_dentry *)(*b)->b_data;
+	e3d = emu3_block_data(info, *b, blknum);
 	e3d += offset;
 
 	return e3d;
@@ -108,44 +74,54 @@ static void emu3_set_inode_size_dir(struct inode *inode)
 	inode->i_size = inode->i_blocks * EMU3_BSIZE;
 }
 
-static void emu3_set_inode_size_file(struct inode *inode)
+loff_t emu3_get_fattrs_size(struct emu3_sb_info *info,
+			    const struct emu3_file_attrs *fattrs)
+{
+	short clusters = le16_to_cpu(fattrs->clusters);
+	short blocks = le16_to_cpu(fattrs->blocks);
+	short bytes = le16_to_cpu(fattrs->bytes);
+
+	if (clusters == 1 && blocks == 1 && bytes == 0)
+		return 0;
+
+	//A partial last cluster is included in the cluster count.
+	if (blocks)
+		clusters--;
+	if (bytes)
+		blocks--;
+	return ((loff_t) clusters * info->blocks_per_cluster +
+		blocks) * EMU3_BSIZE + bytes;
+}
+
+EMU3_VISIBLE_IF_KUNIT void emu3_set_inode_size_file(struct inode *inode)
 {
 	struct emu3_sb_info *info = EMU3_SB(inode->i_sb);
 	struct emu3_inode *e3i = EMU3_I(inode);
 	short clusters = cpu_to_le16(e3i->data.fattrs.clusters);
 	short blocks = cpu_to_le16(e3i->data.fattrs.blocks);
-	short bytes = cpu_to_le16(e3i->data.fattrs.bytes);
 
 	if (blocks > info->blocks_per_cluster) {
 		printk(KERN_CRIT "%s: Bad data in inode %ld\n",
 		       EMU3_MODULE_NAME, inode->i_ino);
 	}
 	inode->i_blocks = clusters * info->blocks_per_cluster;
-
-	if (clusters == 1 && blocks == 1 && bytes == 0)
-		inode->i_size = 0;
-	else {
-		if (blocks > 1)
-			clusters--;
-		if (bytes)
-			blocks--;
-		inode->i_size =
-		    (clusters * info->blocks_per_cluster +
-		     blocks) * EMU3_BSIZE + bytes;
-	}
+	inode->i_size = emu3_get_fattrs_size(info, &e3i->data.fattrs);
 }
 
-struct inode *emu3_get_inode(struct super_block *sb, unsigned long ino)
+//e3d, if given, is the dentry of ino from a block the caller already holds.
+static struct inode *emu3_iget(struct super_block *sb, unsigned long ino,
+			       const struct emu3_dentry *e3d)
 {
 	umode_t mode;
 	unsigned int links;
 	struct inode *inode;
 	struct timespec64 tv;
-	struct emu3_dentry *e3d;
-	struct buffer_head *b;
+	struct buffer_head *b = NULL;
 	const struct inode_operations *iops;
 	const struct file_operations *fops;
+	const struct emu3_index_entry *ie = NULL;
 	struct emu3_sb_info *info = EMU3_SB(sb);
+	const struct emu3_index *index = emu3_get_index(info);
 
 	inode = iget_locked(sb, ino);
 
@@ -163,15 +139,24 @@ struct inode *emu3_get_inode(struct super_block *sb, unsigned long ino)
 		links = 2;
 		mode = EMU3_ROOT_DIR_MODE;
 	} else {
-		e3d = emu3_find_dentry_by_inode(inode, &b);
+		if (index)
+			ie = emu3_index_find(index, EMU3_I_DNUM(inode, info));
+
+		if (ie)
+			e3d = &ie->e3d;
+		else if (!e3d)
+			e3d = emu3_find_dentry_by_inode(inode, &b);
 
-		if (!e3d)
+		if (!e3d) {
+			iget_failed(inode);
 			return ERR_PTR(-EIO);
+		}
 
 		emu3_set_emu3_inode_data(inode, e3d);
 		brelse(b);
 
 		if (EMU3_DENTRY_IS_FILE(e3d)) {
+			EMU3_I(inode)->ientry = ie;
 			emu3_set_inode_size_file(inode);
 			iops = &emu3_inode_operations_file;
 			fops = &emu3_file_operations_file;
@@ -188,7 +173,7 @@ struct inode *emu3_get_inode(struct super_block *sb, unsigned long ino)
 			printk(KERN_ERR
 			       "%s: entry is neither a file nor a directory\n",
 			       EMU3_MODULE_NAME);
-			brelse(b);
+			iget_failed(inode);
 			return ERR_PTR(-EIO);
 		}
 	}
@@ -212,3 +197,28 @@ struct inode *emu3_get_inode(struct super_block *sb, unsigned long ino)
 
 	return inode;
 }
+
+struct inode *emu3_get_inode(struct super_block *sb, unsigned long ino)
+{
+	return emu3_iget(sb, ino, NULL);
+}
+
+//Called by readdir so that the lookups after it find the inode in the cache.
+//Cached inodes are left alone as they might have newer data than the dentry.
+void emu3_prefill_inode(struct super_block *sb, unsigned long ino,
+			const struct emu3_dentry *e3d)
+{
+	struct inode *inode = ilookup(sb, ino);
+
+	if (inode) {
+		iput(inode);
+		return;
+	}
+
+	inode = emu3_iget(sb, ino, e3d);
+	if (IS_ERR(inode))
+		return;
+
+	emu3_stat_inc(EMU3_SB(sb), EMU3_STAT_INODES_PREFILLED);
+	iput(inode);
+}
@@ -0,0 +1,452 @@
+/*
+ *   ioctl.c
+ *   Copyright (C) 2018 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of emu3fs.
+ *
+ *   emu3fs is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   emu3fs is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with emu3fs. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <linux/uaccess.h>
+#include <linux/mount.h>
+#include "emu3_fs.h"
+
+//Records are built in a kernel buffer and copied once all the locks are
+//released, as faulting in the user buffer might need them.
+struct emu3_catalog_ctx {
+	struct emu3_catalog_entry *entries;
+	unsigned int count;
+	unsigned int total;
+};
+
+static struct emu3_catalog_entry *emu3_catalog_next(struct emu3_catalog_ctx
+						    *ctx)
+{
+	ctx->total++;
+	return ctx->total <= ctx->count ? &ctx->entries[ctx->total - 1] : NULL;
+}
+
+static void emu3_catalog_name(char *dst, char *name)
+{
+	char fixed[EMU3_LENGTH_FILENAME];
+	unsigned int len;
+
+	emu3_filename_fix(name, fixed);
+	len = emu3_name_length(fixed, EMU3_LENGTH_FILENAME);
+	memset(dst, 0, EMU3_IOCTL_NAME_LEN);
+	memcpy(dst, fixed, len);
+}
+
+//Banks being written have newer attributes in their inodes than on disk.
+static void emu3_catalog_file(struct super_block *sb,
+			      struct emu3_catalog_ctx *ctx,
+			      struct emu3_dentry *e3d, unsigned int dnum,
+			      const char *folder)
+{
+	struct inode *inode;
+	struct emu3_sb_info *info = EMU3_SB(sb);
+	struct emu3_catalog_entry *ce = emu3_catalog_next(ctx);
+	struct emu3_dentry_data data = e3d->data;
+	unsigned long ino = EMU3_INO(dnum, info);
+	loff_t size;
+
+	if (!ce)
+		return;
+
+	inode = ilookup(sb, ino);
+	if (inode) {
+		down_read(&EMU3_I(inode)->data_sem);
+		data = EMU3_I(inode)->data;
+		size = i_size_read(inode);
+		up_read(&EMU3_I(inode)->data_sem);
+		iput(inode);
+	} else
+		size = emu3_get_fattrs_size(info, &data.fattrs);
+
+	emu3_catalog_name(ce->name, e3d->name);
+	memcpy(ce->folder, folder, EMU3_IOCTL_NAME_LEN);
+	ce->ino = ino;
+	ce->size = size;
+	ce->clusters = le16_to_cpu(data.fattrs.clusters);
+	ce->fragments = emu3_get_fragments(info,
+					   le16_to_cpu(data.fattrs.start_cluster));
+	ce->id = data.id;
+	ce->type = data.fattrs.type;
+	memcpy(ce->props, data.fattrs.props, EMU3_FILE_PROPS_LEN);
+}
+
+static int emu3_catalog_folder(struct inode *dir, const char *folder,
+			       struct emu3_catalog_ctx *ctx)
+{
+	int i, j, err = 0;
+	short blknum;
+	struct buffer_head *b;
+	struct emu3_dentry *e3d;
+	struct emu3_inode *e3i = EMU3_I(dir);
+	struct emu3_sb_info *info = EMU3_SB(dir->i_sb);
+
+	down_read(&e3i->dir_sem);
+	for (i = 0; i < EMU3_BLOCKS_PER_DIR; i++) {
+		blknum = le16_to_cpu(e3i->data.dattrs.block_list[i]);
+		if (EMU3_IS_DIR_BLOCK_FREE(blknum))
+			break;
+
+		b = emu3_bread(dir->i_sb, blknum);
+		if (!b) {
+			printk(KERN_CRIT EMU3_ERR_NOT_BLK, EMU3_MODULE_NAME,
+			       blknum);
+			err = -EIO;
+			break;
+		}
+
+		e3d = emu3_block_data(info, b, blknum);
+		for (j = 0; j < EMU3_ENTRIES_PER_BLOCK; j++, e3d++)
+			if (EMU3_DENTRY_IS_FILE(e3d))
+				emu3_catalog_file(dir->i_sb, ctx, e3d,
+						  EMU3_DNUM(blknum, j), folder);
+		brelse(b);
+	}
+	up_read(&e3i->dir_sem);
+
+	return err;
+}
+
+static void emu3_catalog_dir(struct emu3_catalog_ctx *ctx,
+			     struct emu3_dentry *e3d, unsigned int dnum,
+			     struct emu3_sb_info *info)
+{
+	struct emu3_catalog_entry *ce = emu3_catalog_next(ctx);
+	int i;
+
+	if (!ce)
+		return;
+
+	for (i = 0; i < EMU3_BLOCKS_PER_DIR; i++)
+		if (EMU3_IS_DIR_BLOCK_FREE
+		    (le16_to_cpu(e3d->data.dattrs.block_list[i])))
+			break;
+
+	emu3_catalog_name(ce->name, e3d->name);
+	ce->ino = EMU3_INO(dnum, info);
+	ce->size = i * EMU3_BSIZE;
+	ce->id = e3d->data.id;
+	ce->flags = EMU3_CATALOG_FOLDER;
+}
+
+//The folders are listed under the root dir_sem and then each one is listed
+//under its own, as the folder locks are never taken inside the root one.
+static int emu3_catalog_root(struct inode *root, struct emu3_catalog_ctx *ctx)
+{
+	int i, j, n = 0, err = 0;
+	unsigned int blknum;
+	unsigned long *inos;
+	struct inode *dir;
+	struct buffer_head *b;
+	struct emu3_dentry *e3d;
+	char (*names)[EMU3_IOCTL_NAME_LEN];
+	struct emu3_sb_info *info = EMU3_SB(root->i_sb);
+
+	inos = kvcalloc(EMU3_ROOT_SLOTS(info), sizeof(unsigned long),
+			GFP_KERNEL);
+	names = kvcalloc(EMU3_ROOT_SLOTS(info), EMU3_IOCTL_NAME_LEN,
+			 GFP_KERNEL);
+	if (!inos || !names) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	down_read(&EMU3_I(root)->dir_sem);
+	for (i = 0; i < info->root_blocks; i++) {
+		blknum = info->start_root_block + i;
+		b = emu3_bread(root->i_sb, blknum);
+		if (!b) {
+			printk(KERN_CRIT EMU3_ERR_NOT_BLK, EMU3_MODULE_NAME,
+			       blknum);
+			err = -EIO;
+			break;
+		}
+
+		e3d = emu3_block_data(info, b, blknum);
+		for (j = 0; j < EMU3_ENTRIES_PER_BLOCK; j++, e3d++) {
+			if (!EMU3_DENTRY_IS_DIR(e3d))
+				continue;
+
+			emu3_catalog_dir(ctx, e3d, EMU3_DNUM(blknum, j), info);
+			emu3_catalog_name(names[n], e3d->name);
+			inos[n++] = EMU3_INO(EMU3_DNUM(blknum, j), info);
+		}
+		brelse(b);
+	}
+	up_read(&EMU3_I(root)->dir_sem);
+
+	for (i = 0; i < n && !err; i++) {
+		dir = emu3_get_inode(root->i_sb, inos[i]);
+		//Removed meanwhile.
+		if (IS_ERR(dir))
+			continue;
+		err = emu3_catalog_folder(dir, names[i], ctx);
+		iput(dir);
+	}
+
+ out:
+	kvfree(inos);
+	kvfree(names);
+	return err;
+}
+
+static long emu3_ioctl_catalog(struct inode *dir,
+			       struct emu3_catalog __user *uarg)
+{
+	int err;
+	struct buffer_head *b;
+	struct emu3_dentry *e3d;
+	struct emu3_catalog cat;
+	struct emu3_catalog_ctx ctx = { 0 };
+	struct emu3_sb_info *info = EMU3_SB(dir->i_sb);
+	char folder[EMU3_IOCTL_NAME_LEN];
+
+	if (copy_from_user(&cat, uarg, sizeof(cat)))
+		return -EFAULT;
+
+	//There can not be more entries than dentries in the metadata.
+	ctx.count = min_t(unsigned int, cat.count, EMU3_ROOT_SLOTS(info) +
+			  info->dir_content_blocks * EMU3_ENTRIES_PER_BLOCK);
+	if (ctx.count) {
+		ctx.entries = kvcalloc(ctx.count,
+				       sizeof(struct emu3_catalog_entry),
+				       GFP_KERNEL);
+		if (!ctx.entries)
+			return -ENOMEM;
+	}
+
+	if (EMU3_IS_I_ROOT_DIR(dir))
+		err = emu3_catalog_root(dir, &ctx);
+	else {
+		e3d = emu3_find_dentry_by_inode(dir, &b);
+		if (!e3d) {
+			err = -EIO;
+			goto out;
+		}
+		emu3_catalog_name(folder, e3d->name);
+		brelse(b);
+		err = emu3_catalog_folder(dir, folder, &ctx);
+	}
+	if (err)
+		goto out;
+
+	cat.count = min(ctx.total, ctx.count);
+	cat.total = ctx.total;
+	if (copy_to_user(u64_to_user_ptr(cat.entries), ctx.entries,
+			 cat.count * sizeof(struct emu3_catalog_entry)) ||
+	    copy_to_user(uarg, &cat, sizeof(cat)))
+		err = -EFAULT;
+
+ out:
+	kvfree(ctx.entries);
+	return err;
+}
+
+//The whole folder is read once into bhs and slots gets the folder slot of each entry.
+//A new number can not be used by another bank of the folder after the changes.
+static int emu3_renumber_check(struct inode *dir,
+			       struct emu3_renumber_entry *entries,
+			       unsigned int count, int *slots,
+			       struct buffer_head **bhs)
+{
+	int i, j, slot;
+	short blknum;
+	unsigned long ino;
+	unsigned int dnum;
+	struct emu3_dentry *e3d;
+	unsigned char ids[EMU3_MAX_FILES_PER_DIR];
+	DECLARE_BITMAP(files, EMU3_MAX_FILES_PER_DIR);
+	DECLARE_BITMAP(changed, EMU3_MAX_FILES_PER_DIR);
+	unsigned char users[EMU3_MAX_FILES_PER_DIR] = { 0 };
+	struct emu3_inode *e3i = EMU3_I(dir);
+	struct emu3_sb_info *info = EMU3_SB(dir->i_sb);
+
+	bitmap_zero(files, EMU3_MAX_FILES_PER_DIR);
+	bitmap_zero(changed, EMU3_MAX_FILES_PER_DIR);
+
+	for (i = 0; i < EMU3_BLOCKS_PER_DIR; i++) {
+		blknum = le16_to_cpu(e3i->data.dattrs.block_list[i]);
+		if (EMU3_IS_DIR_BLOCK_FREE(blknum))
+			break;
+
+		bhs[i] = emu3_bread(dir->i_sb, blknum);
+		if (!bhs[i]) {
+			printk(KERN_CRIT EMU3_ERR_NOT_BLK, EMU3_MODULE_NAME,
+			       blknum);
+			return -EIO;
+		}
+
+		e3d = emu3_block_data(info, bhs[i], blknum);
+		for (j = 0; j < EMU3_ENTRIES_PER_BLOCK; j++, e3d++)
+			if (EMU3_DENTRY_IS_FILE(e3d)) {
+				slot = i * EMU3_ENTRIES_PER_BLOCK + j;
+				set_bit(slot, files);
+				ids[slot] = e3d->data.id;
+			}
+	}
+
+	for (i = 0; i < count; i++) {
+		ino = entries[i].ino;
+		if (entries[i].id >= EMU3_MAX_FILES_PER_DIR)
+			return -EINVAL;
+		if (ino < EMU3_I_ID_OFFSET || ino >= EMU3_I_ID_OFFSET +
+		    (info->root_blocks + info->dir_content_blocks) *
+		    EMU3_ENTRIES_PER_BLOCK)
+			return -ENOENT;
+
+		ino -= EMU3_I_ID_OFFSET;
+		dnum = EMU3_DNUM(info->start_root_block +
+				 ino / EMU3_ENTRIES_PER_BLOCK,
+				 ino % EMU3_ENTRIES_PER_BLOCK);
+		slot = emu3_get_dir_slot(dir, dnum);
+		if (slot < 0 || !test_bit(slot, files))
+			return -ENOENT;
+		if (test_and_set_bit(slot, changed))
+			return -EINVAL;
+
+		ids[slot] = entries[i].id;
+		slots[i] = slot;
+	}
+
+	for_each_set_bit(slot, files, EMU3_MAX_FILES_PER_DIR)
+		users[ids[slot]]++;
+	for_each_set_bit(slot, changed, EMU3_MAX_FILES_PER_DIR)
+		if (users[ids[slot]] > 1)
+			return -EEXIST;
+
+	return 0;
+}
+
+//Cached inodes keep a copy of the number, updated under their data_sem as
+//emu3_write_inode rewrites the dentry.
+static void emu3_renumber_apply(struct inode *dir,
+				struct emu3_renumber_entry *entries,
+				unsigned int count, int *slots,
+				struct buffer_head **bhs)
+{
+	int i, dirty = 0;
+	unsigned int slot, blknum;
+	struct inode *inode;
+	struct emu3_dentry *e3d;
+	unsigned long dirty_blocks = 0;
+	struct emu3_inode *e3i = EMU3_I(dir);
+	struct emu3_sb_info *info = EMU3_SB(dir->i_sb);
+
+	for (i = 0; i < count; i++) {
+		slot = slots[i];
+		blknum = le16_to_cpu(e3i->data.dattrs.block_list
+				     [slot / EMU3_ENTRIES_PER_BLOCK]);
+		e3d = emu3_block_data(info, bhs[slot / EMU3_ENTRIES_PER_BLOCK],
+				      blknum);
+		e3d += slot % EMU3_ENTRIES_PER_BLOCK;
+		if (e3d->data.id == entries[i].id)
+			continue;
+
+		inode = ilookup(dir->i_sb, entries[i].ino);
+		if (inode)
+			down_write(&EMU3_I(inode)->data_sem);
+		e3d->data.id = entries[i].id;
+		if (inode) {
+			WRITE_ONCE(EMU3_I(inode)->data.id, entries[i].id);
+			up_write(&EMU3_I(inode)->data_sem);
+			iput(inode);
+		}
+		__set_bit(slot / EMU3_ENTRIES_PER_BLOCK, &dirty_blocks);
+	}
+
+	for (i = 0; i < EMU3_BLOCKS_PER_DIR; i++)
+		if (test_bit(i, &dirty_blocks)) {
+			mark_buffer_dirty_inode(bhs[i], dir);
+			dirty++;
+		}
+
+	emu3_stat_add(info, EMU3_STAT_META_WRITES, dirty);
+	emu3_invalidate_dir_maps(dir);
+}
+
+static long emu3_ioctl_renumber(struct file *f,
+				struct emu3_renumber __user *uarg)
+{
+	int i, err, *slots = NULL;
+	struct inode *dir = file_inode(f);
+	struct emu3_renumber ren;
+	struct emu3_renumber_entry *entries = NULL;
+	struct buffer_head *bhs[EMU3_BLOCKS_PER_DIR] = { NULL };
+
+	if (EMU3_IS_I_ROOT_DIR(dir))
+		return -EINVAL;
+
+	if (copy_from_user(&ren, uarg, sizeof(ren)))
+		return -EFAULT;
+
+	if (!ren.count)
+		return 0;
+	if (ren.count > EMU3_MAX_FILES_PER_DIR)
+		return -EINVAL;
+
+	entries = kvmalloc_array(ren.count, sizeof(*entries), GFP_KERNEL);
+	slots = kvmalloc_array(ren.count, sizeof(*slots), GFP_KERNEL);
+	if (!entries || !slots) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	if (copy_from_user(entries, u64_to_user_ptr(ren.entries),
+			   ren.count * sizeof(*entries))) {
+		err = -EFAULT;
+		goto out;
+	}
+
+	err = mnt_want_write_file(f);
+	if (err)
+		goto out;
+
+	err = inode_permission(file_mnt_idmap(f), dir, MAY_WRITE);
+	if (err)
+		goto drop;
+
+	down_write(&EMU3_I(dir)->dir_sem);
+	err = emu3_renumber_check(dir, entries, ren.count, slots, bhs);
+	if (!err)
+		emu3_renumber_apply(dir, entries, ren.count, slots, bhs);
+	up_write(&EMU3_I(dir)->dir_sem);
+
+	for (i = 0; i < EMU3_BLOCKS_PER_DIR; i++)
+		brelse(bhs[i]);
+
+ drop:
+	mnt_drop_write_file(f);
+ out:
+	kvfree(entries);
+	kvfree(slots);
+	return err;
+}
+
+long emu3_ioctl(struct file *f, unsigned int cmd, unsigned long arg)
+{
+	struct inode *inode = file_inode(f);
+
+	switch (cmd) {
+	case EMU3_IOC_CATALOG:
+		return emu3_ioctl_catalog(inode, (void __user *)arg);
+	case EMU3_IOC_RENUMBER:
+		return emu3_ioctl_renumber(f, (void __user *)arg);
+	default:
+		return -ENOTTY;
+	}
+}
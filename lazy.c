@@ -0,0 +1,323 @@
+/*
+ *   lazy.c
+ *   Copyright (C) 2018 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of emu3fs.
+ *
+ *   emu3fs is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   emu3fs is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with emu3fs. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+//Lazy mounts do not read the cluster list at mount. It is read a page worth
+//of blocks at a time the first time a chain goes through it. As the mount is
+//read-only, every chunk is clean and the shrinker can drop the ones that have
+//not been used since its last pass. Readers use them under RCU.
+
+#include <linux/shrinker.h>
+#include <linux/rcupdate.h>
+#include "emu3_fs.h"
+
+#define EMU3_LAZY_CHUNK_SIZE PAGE_SIZE
+#define EMU3_LAZY_CHUNK_BLOCKS (EMU3_LAZY_CHUNK_SIZE / EMU3_BSIZE)
+#define EMU3_LAZY_CHUNK_ENTRIES (EMU3_LAZY_CHUNK_SIZE / sizeof(short))
+
+struct emu3_lazy_chunk {
+	struct rcu_head rcu;
+	short *entries;
+};
+
+struct emu3_lazy {
+	struct emu3_lazy_chunk __rcu **chunks;
+	unsigned long *referenced;	//Used since the last shrinker pass.
+	unsigned int nchunks;
+	atomic_t loaded;
+	struct mutex free_lock;
+	bool free_ready;	//Set once the free space below is counted.
+	unsigned int free_clusters;
+	unsigned int free_runs;
+	unsigned int largest_free_run;
+	struct mutex scan_lock;
+	unsigned int scan_pos;	//Protected by scan_lock.
+	struct shrinker *shrinker;
+};
+
+static void emu3_lazy_free_chunk(struct emu3_lazy_chunk *c)
+{
+	kvfree(c->entries);
+	kfree(c);
+}
+
+static void emu3_lazy_free_chunk_rcu(struct rcu_head *rcu)
+{
+	emu3_lazy_free_chunk(container_of(rcu, struct emu3_lazy_chunk, rcu));
+}
+
+//Called from the block mapping, so no allocation can recurse into the filesystem.
+static struct emu3_lazy_chunk *emu3_lazy_read_chunk(struct emu3_sb_info *info,
+						    unsigned int n)
+{
+	int i, blknum;
+	struct buffer_head *b;
+	struct emu3_lazy_chunk *c;
+	unsigned int first = n * EMU3_LAZY_CHUNK_BLOCKS;
+	unsigned int blocks = min_t(unsigned int, EMU3_LAZY_CHUNK_BLOCKS,
+				    info->cluster_list_blocks - first);
+
+	c = kmalloc(sizeof(struct emu3_lazy_chunk), GFP_NOFS);
+	if (!c)
+		return ERR_PTR(-ENOMEM);
+
+	c->entries = kvzalloc(EMU3_LAZY_CHUNK_SIZE, GFP_NOFS);
+	if (!c->entries) {
+		kfree(c);
+		return ERR_PTR(-ENOMEM);
+	}
+
+	for (i = 0; i < blocks; i++) {
+		blknum = info->start_cluster_list_block + first + i;
+		b = emu3_bread(info->sb, blknum);
+		if (!b) {
+			printk(KERN_CRIT EMU3_ERR_NOT_BLK, EMU3_MODULE_NAME,
+			       blknum);
+			emu3_lazy_free_chunk(c);
+			return ERR_PTR(-EIO);
+		}
+
+		memcpy(&c->entries[EMU3_CLUSTER_ENTRIES_PER_BLOCK * i],
+		       emu3_block_data(info, b, blknum), EMU3_BSIZE);
+		brelse(b);
+	}
+
+	return c;
+}
+
+//The chunk is published while inside the read-side critical section, so the
+//shrinker can not free it before the entry is read.
+int emu3_lazy_get(struct emu3_sb_info *info, unsigned int cluster)
+{
+	int entry;
+	struct emu3_lazy *lazy = info->lazy;
+	unsigned int n = cluster / EMU3_LAZY_CHUNK_ENTRIES;
+	struct emu3_lazy_chunk *c, *new = NULL;
+
+	if (n >= lazy->nchunks)
+		return -EIO;
+
+	rcu_read_lock();
+	c = rcu_dereference(lazy->chunks[n]);
+	if (!c) {
+		rcu_read_unlock();
+		new = emu3_lazy_read_chunk(info, n);
+		if (IS_ERR(new))
+			return PTR_ERR(new);
+
+		rcu_read_lock();
+		c = unrcu_pointer(cmpxchg(&lazy->chunks[n], NULL,
+					  RCU_INITIALIZER(new)));
+		if (!c) {
+			c = new;
+			new = NULL;
+			atomic_inc(&lazy->loaded);
+		}
+	}
+	entry = le16_to_cpu(c->entries[cluster % EMU3_LAZY_CHUNK_ENTRIES]);
+	rcu_read_unlock();
+
+	if (!test_bit(n, lazy->referenced))
+		set_bit(n, lazy->referenced);
+
+	//Another reader loaded the same chunk in the meantime.
+	if (new)
+		emu3_lazy_free_chunk(new);
+
+	return entry;
+}
+
+//Counted from the blocks without loading the chunks. As it never changes, it
+//is only counted once for statfs and sysfs. False if the list can not be read.
+static bool emu3_lazy_count_free(struct emu3_sb_info *info)
+{
+	int i, j, blknum;
+	unsigned int cluster, run = 0;
+	bool ready;
+	struct buffer_head *b;
+	short *data;
+	struct emu3_lazy *lazy = info->lazy;
+
+	if (smp_load_acquire(&lazy->free_ready))
+		return true;
+
+	mutex_lock(&lazy->free_lock);
+	if (lazy->free_ready)
+		goto unlock;
+
+	lazy->free_clusters = 0;
+	lazy->free_runs = 0;
+	lazy->largest_free_run = 0;
+
+	for (i = 0; i < info->cluster_list_blocks; i++) {
+		blknum = info->start_cluster_list_block + i;
+		b = emu3_bread(info->sb, blknum);
+		if (!b) {
+			printk(KERN_CRIT EMU3_ERR_NOT_BLK, EMU3_MODULE_NAME,
+			       blknum);
+			goto unlock;
+		}
+
+		data = emu3_block_data(info, b, blknum);
+		for (j = 0; j < EMU3_CLUSTER_ENTRIES_PER_BLOCK; j++) {
+			cluster = i * EMU3_CLUSTER_ENTRIES_PER_BLOCK + j;
+			if (cluster < 1 || cluster >= info->clusters)
+				continue;
+
+			if (data[j]) {
+				run = 0;
+				continue;
+			}
+
+			lazy->free_clusters++;
+			if (!run)
+				lazy->free_runs++;
+			run++;
+			if (run > lazy->largest_free_run)
+				lazy->largest_free_run = run;
+		}
+		brelse(b);
+	}
+
+	smp_store_release(&lazy->free_ready, true);
+ unlock:
+	ready = lazy->free_ready;
+	mutex_unlock(&lazy->free_lock);
+	return ready;
+}
+
+int emu3_lazy_free_clusters(struct emu3_sb_info *info)
+{
+	if (!emu3_lazy_count_free(info))
+		return 0;
+	return info->lazy->free_clusters;
+}
+
+void emu3_lazy_free_runs(struct emu3_sb_info *info, unsigned int *runs,
+			 unsigned int *largest)
+{
+	struct emu3_lazy *lazy = info->lazy;
+
+	if (!emu3_lazy_count_free(info)) {
+		*runs = 0;
+		*largest = 0;
+		return;
+	}
+
+	*runs = lazy->free_runs;
+	*largest = lazy->largest_free_run;
+}
+
+static unsigned long emu3_lazy_count(struct shrinker *shrinker,
+				     struct shrink_control *sc)
+{
+	struct emu3_lazy *lazy = shrinker->private_data;
+
+	return atomic_read(&lazy->loaded);
+}
+
+//Second chance. Chunks used since the last pass are only unmarked.
+static unsigned long emu3_lazy_scan(struct shrinker *shrinker,
+				    struct shrink_control *sc)
+{
+	struct emu3_lazy *lazy = shrinker->private_data;
+	struct emu3_lazy_chunk *c;
+	unsigned long freed = 0;
+	unsigned int i, n;
+
+	if (!mutex_trylock(&lazy->scan_lock))
+		return SHRINK_STOP;
+
+	for (i = 0; i < lazy->nchunks && freed < sc->nr_to_scan; i++) {
+		n = lazy->scan_pos;
+		lazy->scan_pos = (n + 1) % lazy->nchunks;
+
+		if (!rcu_access_pointer(lazy->chunks[n]))
+			continue;
+		if (test_and_clear_bit(n, lazy->referenced))
+			continue;
+
+		c = unrcu_pointer(xchg(&lazy->chunks[n], NULL));
+		if (c) {
+			atomic_dec(&lazy->loaded);
+			call_rcu(&c->rcu, emu3_lazy_free_chunk_rcu);
+			freed++;
+		}
+	}
+
+	mutex_unlock(&lazy->scan_lock);
+	return freed;
+}
+
+struct emu3_lazy *emu3_alloc_lazy(struct super_block *sb)
+{
+	struct emu3_lazy *lazy;
+	struct emu3_sb_info *info = EMU3_SB(sb);
+
+	lazy = kzalloc(sizeof(struct emu3_lazy), GFP_KERNEL);
+	if (!lazy)
+		return ERR_PTR(-ENOMEM);
+
+	lazy->nchunks = DIV_ROUND_UP(info->cluster_list_blocks,
+				     EMU3_LAZY_CHUNK_BLOCKS);
+	atomic_set(&lazy->loaded, 0);
+	mutex_init(&lazy->scan_lock);
+	mutex_init(&lazy->free_lock);
+
+	lazy->chunks = kvcalloc(lazy->nchunks, sizeof(*lazy->chunks),
+				GFP_KERNEL);
+	lazy->referenced = bitmap_zalloc(lazy->nchunks, GFP_KERNEL);
+	lazy->shrinker = shrinker_alloc(0, "emu3-lazy:%s", sb->s_id);
+	if (!lazy->chunks || !lazy->referenced || !lazy->shrinker) {
+		emu3_free_lazy(lazy);
+		return ERR_PTR(-ENOMEM);
+	}
+
+	lazy->shrinker->count_objects = emu3_lazy_count;
+	lazy->shrinker->scan_objects = emu3_lazy_scan;
+	lazy->shrinker->private_data = lazy;
+	shrinker_register(lazy->shrinker);
+
+	return lazy;
+}
+
+//The chunks queued by the shrinker are freed before the module can go away.
+void emu3_free_lazy(struct emu3_lazy *lazy)
+{
+	unsigned int i;
+	struct emu3_lazy_chunk *c;
+
+	if (IS_ERR_OR_NULL(lazy))
+		return;
+
+	shrinker_free(lazy->shrinker);
+	rcu_barrier();
+
+	for (i = 0; lazy->chunks && i < lazy->nchunks; i++) {
+		c = rcu_dereference_protected(lazy->chunks[i], 1);
+		if (c)
+			emu3_lazy_free_chunk(c);
+	}
+
+	mutex_destroy(&lazy->scan_lock);
+	mutex_destroy(&lazy->free_lock);
+	bitmap_free(lazy->referenced);
+	kvfree(lazy->chunks);
+	kfree(lazy);
+}
@@ -21,30 +21,187 @@
 #include <linux/module.h>
 #include <linux/kernel.h>
 #include <linux/init.h>
+#include <linux/blkdev.h>
+#include <linux/fs_context.h>
+#include <linux/fs_parser.h>
+#include <linux/seq_file.h>
 #include "emu3_fs.h"
 
+#define CREATE_TRACE_POINTS
+#include "emu3_trace.h"
+
+struct emu3_fs_context {
+	struct emu3_mount_opts opts;
+	bool emu4;
+};
+
 static struct kmem_cache *emu3_inode_cachep;
 
-inline void emu3_free_dir_content_block(struct emu3_sb_info *info, short blknum)
+//Position of a root, dir content or cluster list block in the pinned metadata or -1.
+static int emu3_meta_index(struct emu3_sb_info *info, sector_t blknum)
 {
-	info->dir_content_block_list[blknum - info->start_dir_content_block] =
-	    0;
+	unsigned int offset = 0;
+
+	if (blknum >= info->start_root_block &&
+	    blknum < info->start_root_block + info->root_blocks)
+		return blknum - info->start_root_block;
+	offset += info->root_blocks;
+
+	if (blknum >= info->start_dir_content_block &&
+	    blknum < info->start_dir_content_block + info->dir_content_blocks)
+		return offset + blknum - info->start_dir_content_block;
+	offset += info->dir_content_blocks;
+
+	if (blknum >= info->start_cluster_list_block &&
+	    blknum < info->start_cluster_list_block + info->cluster_list_blocks)
+		return offset + blknum - info->start_cluster_list_block;
+
+	return -1;
+}
+
+static inline unsigned int emu3_meta_blocks(struct emu3_sb_info *info)
+{
+	return info->root_blocks + info->dir_content_blocks +
+	    info->cluster_list_blocks;
+}
+
+//sb_bread that tells apart the blocks found in the buffer cache from the ones read from the device.
+//Pinned blocks are returned without looking them up.
+//blknum is an EMU3 block, the returned buffer is the device block holding it.
+struct buffer_head *emu3_bread(struct super_block *sb, sector_t blknum)
+{
+	bool cached;
+	struct buffer_head *bh;
+	struct emu3_sb_info *info = EMU3_SB(sb);
+	int index;
+
+	if (info->meta_bh) {
+		index = emu3_meta_index(info, blknum);
+		if (index >= 0 && info->meta_bh[index]) {
+			bh = info->meta_bh[index];
+			get_bh(bh);
+			trace_emu3_bread(sb, blknum, true);
+			emu3_stat_inc(info, EMU3_STAT_META_CACHE_HITS);
+			return bh;
+		}
+	}
+
+	bh = sb_getblk(sb, blknum >> info->sub_block_bits);
+	if (!bh)
+		return NULL;
+
+	cached = buffer_uptodate(bh);
+	trace_emu3_bread(sb, blknum, cached);
+	emu3_stat_inc(info, cached ? EMU3_STAT_META_CACHE_HITS :
+		      EMU3_STAT_META_READS);
+
+	if (!cached && bh_read(bh, REQ_META | REQ_PRIO) < 0) {
+		brelse(bh);
+		return NULL;
+	}
+
+	return bh;
 }
 
-inline void emu3_use_dir_content_block(struct emu3_sb_info *info, short blknum)
+static void emu3_unpin_meta(struct emu3_sb_info *info)
 {
+	unsigned int i;
+
+	if (!info->meta_bh)
+		return;
+
+	for (i = 0; i < emu3_meta_blocks(info); i++)
+		brelse(info->meta_bh[i]);
+	kvfree(info->meta_bh);
+	info->meta_bh = NULL;
+}
+
+//Keeps a reference to every metadata block for the whole mount, so they are
+//never evicted and emu3_bread does not need to look them up. Changes are
+//tracked by the dirty bit of each buffer and written back as usual.
+static int emu3_pin_meta(struct super_block *sb)
+{
+	struct emu3_sb_info *info = EMU3_SB(sb);
+	unsigned int i, n = emu3_meta_blocks(info);
+	unsigned int starts[] = { info->start_root_block,
+		info->start_dir_content_block,
+		info->start_cluster_list_block
+	};
+	unsigned int counts[] = { info->root_blocks,
+		info->dir_content_blocks,
+		info->cluster_list_blocks
+	};
+	struct buffer_head **meta_bh;
+	sector_t blknum;
+	int j, index;
+
+	meta_bh = kvcalloc(n, sizeof(struct buffer_head *), GFP_KERNEL);
+	if (!meta_bh)
+		return -ENOMEM;
+
+	for (j = 0; j < ARRAY_SIZE(starts); j++)
+		for (i = 0; i < counts[j]; i++) {
+			blknum = starts[j] + i;
+			index = emu3_meta_index(info, blknum);
+			if (meta_bh[index])
+				continue;
+
+			meta_bh[index] = emu3_bread(sb, blknum);
+			if (!meta_bh[index]) {
+				printk(KERN_CRIT EMU3_ERR_NOT_BLK,
+				       EMU3_MODULE_NAME, (int)blknum);
+				info->meta_bh = meta_bh;
+				emu3_unpin_meta(info);
+				return -EIO;
+			}
+		}
+
+	info->meta_bh = meta_bh;
+	return 0;
+}
+
+void emu3_free_dir_content_block(struct emu3_sb_info *info, short blknum)
+{
+	emu3_alloc_lock(info);
 	info->dir_content_block_list[blknum - info->start_dir_content_block] =
-	    1;
+	    0;
+	emu3_alloc_unlock(info);
 }
 
-short emu3_get_free_dir_content_blknum(struct emu3_sb_info *info)
+//Returns a free dir content block, already marked as used.
+short emu3_alloc_dir_content_block(struct emu3_sb_info *info)
 {
 	int i;
+	short blknum = -1;
+
+	emu3_alloc_lock(info);
 	for (i = 0; i < info->dir_content_blocks; i++)
 		if (!info->dir_content_block_list[i]) {
-			return info->start_dir_content_block + i;
+			info->dir_content_block_list[i] = 1;
+			blknum = info->start_dir_content_block + i;
+			break;
 		}
-	return -1;
+	emu3_alloc_unlock(info);
+
+	return blknum;
+}
+
+//Reads are queued under a plug so that the block layer merges them into a few large requests.
+void emu3_readahead_blocks(struct super_block *sb, unsigned int start,
+			   unsigned int count)
+{
+	unsigned int i;
+	struct blk_plug plug;
+	struct emu3_sb_info *info = EMU3_SB(sb);
+
+	if (!count)
+		return;
+
+	blk_start_plug(&plug);
+	for (i = start >> info->sub_block_bits;
+	     i <= (start + count - 1) >> info->sub_block_bits; i++)
+		sb_breadahead(sb, i);
+	blk_finish_plug(&plug);
 }
 
 static struct inode *emu3_alloc_inode(struct super_block *sb)
@@ -54,6 +211,8 @@ static struct inode *emu3_alloc_inode(struct super_block *sb)
 	e3i = kmem_cache_alloc(emu3_inode_cachep, GFP_KERNEL);
 	if (!e3i)
 		return NULL;
+	e3i->maps_ready = 0;
+	e3i->ientry = NULL;
 	return &e3i->vfs_inode;
 }
 
@@ -79,13 +238,17 @@ void emu3_set_fattrs(struct emu3_sb_info *info,
 		fattrs->bytes = cpu_to_le16(0);
 	} else {
 		fattrs->clusters = size >> info->cluster_size_shift;
-		rem = size - (fattrs->clusters << info->cluster_size_shift);
+		rem = size - ((loff_t)fattrs->clusters <<
+			      info->cluster_size_shift);
 		if (rem)
 			fattrs->clusters++;
 		fattrs->blocks = rem >> EMU3_BSIZE_BITS;
 		rem = rem % EMU3_BSIZE;
 		if (rem)
 			fattrs->blocks++;
+		//1 cluster, 1 block and 0 bytes is an empty file.
+		else if (size == EMU3_BSIZE)
+			rem = EMU3_BSIZE;
 		fattrs->bytes = rem;
 		fattrs->clusters = cpu_to_le16(fattrs->clusters);
 		fattrs->blocks = cpu_to_le16(fattrs->blocks);
@@ -111,23 +274,38 @@ void emu3_prune_cluster_list(struct inode *inode)
 {
 	struct emu3_sb_info *info = EMU3_SB(inode->i_sb);
 	struct emu3_inode *e3i = EMU3_I(inode);
-	short clusters, last_cluster, next_cluster;
-	int pruning;
+	short clusters, last_cluster, next_cluster, first;
+	int pruning, freed = 0;
+
+	lockdep_assert_held_write(&e3i->data_sem);
 
 	clusters = le16_to_cpu(e3i->data.fattrs.clusters);
 	last_cluster = emu3_get_cluster(inode, clusters - 1);
 	pruning = 0;
 
+	//The tail is still owned by this inode, so it can be discarded before being freed.
 	next_cluster = le16_to_cpu(info->cluster_list[last_cluster]);
+	if (info->opts.discard && next_cluster != EMU_LAST_FILE_CLUSTER)
+		emu3_discard_chain(inode->i_sb, next_cluster);
+
+	emu3_alloc_lock(info);
+	first = next_cluster = le16_to_cpu(info->cluster_list[last_cluster]);
 	while (next_cluster != EMU_LAST_FILE_CLUSTER) {
 		info->cluster_list[last_cluster] =
 		    pruning ? 0 : cpu_to_le16(EMU_LAST_FILE_CLUSTER);
 		last_cluster = next_cluster;
 		next_cluster = le16_to_cpu(info->cluster_list[last_cluster]);
 		pruning = 1;
+		freed++;
 	}
 	if (pruning)
 		info->cluster_list[last_cluster] = 0;
+	emu3_alloc_unlock(info);
+
+	if (freed) {
+		trace_emu3_free_clusters(inode->i_sb, first, freed);
+		emu3_stat_add(info, EMU3_STAT_CLUSTERS_FREED, freed);
+	}
 }
 
 void emu3_set_inode_blocks(struct inode *inode, struct emu3_file_attrs *fattrs)
@@ -140,6 +318,7 @@ void emu3_set_inode_blocks(struct inode *inode, struct emu3_file_attrs *fattrs)
 static int emu3_write_inode(struct inode *inode, struct writeback_control *wbc)
 {
 	struct emu3_sb_info *info = EMU3_SB(inode->i_sb);
+	struct emu3_inode *e3i = EMU3_I(inode);
 	struct emu3_dentry *e3d;
 	struct buffer_head *bh;
 	int err = 0;
@@ -147,11 +326,18 @@ static int emu3_write_inode(struct inode *inode, struct writeback_control *wbc)
 	if (EMU3_IS_I_ROOT_DIR(inode) || EMU3_IS_I_REG_DIR(inode, info))
 		return 0;
 
-	mutex_lock(&info->lock);
+	down_write(&e3i->data_sem);
+
+	//Unlinked inodes no longer own their dentry, which might be reused.
+	if (!inode->i_nlink) {
+		up_write(&e3i->data_sem);
+		return 0;
+	}
 
 	e3d = emu3_find_dentry_by_inode(inode, &bh);
 	if (!e3d) {
-		mutex_unlock(&info->lock);
+		up_write(&e3i->data_sem);
+		trace_emu3_write_inode(inode, -ENOENT);
 		return -ENOENT;
 	}
 
@@ -161,14 +347,21 @@ static int emu3_write_inode(struct inode *inode, struct writeback_control *wbc)
 	emu3_prune_cluster_list(inode);
 
 	mark_buffer_dirty(bh);
-	if (wbc->sync_mode == WB_SYNC_ALL) {
+	up_write(&e3i->data_sem);
+
+	emu3_stat_inc(info, EMU3_STAT_META_WRITES);
+
+	//On sync(2) and syncfs(2) the dentry blocks, shared by up to 16 inodes,
+	//are left dirty and written once each when the block device is flushed
+	//after emu3_sync_fs. Only fsync needs to wait for the block here.
+	if (wbc->sync_mode == WB_SYNC_ALL && !wbc->for_sync) {
 		sync_dirty_buffer(bh);
 		if (buffer_req(bh) && !buffer_uptodate(bh))
 			err = -EIO;
 	}
 
 	brelse(bh);
-	mutex_unlock(&info->lock);
+	trace_emu3_write_inode(inode, err);
 	return err;
 }
 
@@ -201,6 +394,8 @@ static void emu3_init_once(void *foo)
 {
 	struct emu3_inode *e3i = foo;
 	inode_init_once(&e3i->vfs_inode);
+	init_rwsem(&e3i->dir_sem);
+	init_rwsem(&e3i->data_sem);
 }
 
 static int init_inodecache(void)
@@ -224,6 +419,9 @@ static int emu3_get_free_clusters(struct emu3_sb_info *info)
 	int free_clusters = 0;
 	int i;
 
+	if (info->lazy)
+		return emu3_lazy_free_clusters(info);
+
 	for (i = 1; i <= info->clusters; i++)
 		if (!info->cluster_list[i])
 			free_clusters++;
@@ -240,14 +438,14 @@ static int emu3_get_free_inodes(struct super_block *sb)
 
 	for (i = 0; i < info->root_blocks + info->dir_content_blocks; i++) {
 		blknum = info->start_root_block + i;
-		b = sb_bread(sb, blknum);
+		b = emu3_bread(sb, blknum);
 		if (!b) {
 			printk(KERN_CRIT EMU3_ERR_NOT_BLK, EMU3_MODULE_NAME,
 			       blknum);
 			break;
 		}
 
-		e3d = (struct emu3_dentry *)b->b_data;
+		e3d = emu3_block_data(info, b, blknum);
 		for (j = 0; j < EMU3_ENTRIES_PER_BLOCK; j++, e3d++)
 			if (i < info->root_blocks) {
 				if (!EMU3_DENTRY_IS_DIR(e3d))
@@ -286,6 +484,7 @@ static int emu3_statfs(struct dentry *dentry, struct kstatfs *buf)
 {
 	struct super_block *sb = dentry->d_sb;
 	struct emu3_sb_info *info = EMU3_SB(sb);
+	const struct emu3_index *index = emu3_get_index(info);
 	u64 id = huge_encode_dev(sb->s_bdev->bd_dev);
 
 	//For the free space and free inodes we do not consider files.
@@ -293,13 +492,20 @@ static int emu3_statfs(struct dentry *dentry, struct kstatfs *buf)
 	buf->f_bsize = EMU3_BSIZE;
 	//Total addressable blocks.
 	buf->f_blocks = emu3_get_addressable_blocks(info);
-	buf->f_bfree =
-	    emu3_get_free_clusters(info) * info->blocks_per_cluster +
-	    emu3_get_free_dir_blocks(info);
+	if (index) {
+		buf->f_bfree = index->free_blocks;
+		buf->f_ffree = index->free_inodes;
+	} else {
+		emu3_alloc_lock(info);
+		buf->f_bfree =
+		    emu3_get_free_clusters(info) * info->blocks_per_cluster +
+		    emu3_get_free_dir_blocks(info);
+		emu3_alloc_unlock(info);
+		buf->f_ffree = emu3_get_free_inodes(sb);
+	}
 	buf->f_bavail = buf->f_bfree;
 	buf->f_files = EMU3_ENTRIES_PER_BLOCK * (info->root_blocks +
 						 info->dir_content_blocks);
-	buf->f_ffree = emu3_get_free_inodes(sb);
 	buf->f_fsid.val[0] = (u32) id;
 	buf->f_fsid.val[1] = (u32) (id >> 32);
 	buf->f_namelen = EMU3_LENGTH_FILENAME;
@@ -311,24 +517,80 @@ int emu3_get_cluster(struct inode *inode, int n)
 {
 	struct emu3_sb_info *info = EMU3_SB(inode->i_sb);
 	short next = EMU3_I_START_CLUSTER(inode);
-	int i = 0;
+	int i = 0, entry;
 
 	while (i < n) {
-		if (le16_to_cpu(info->cluster_list[next]) ==
-		    EMU_LAST_FILE_CLUSTER)
+		entry = emu3_cluster_list_get(info, next);
+		if (entry == EMU_LAST_FILE_CLUSTER || entry < 0)
 			return -1;
-		next = le16_to_cpu(info->cluster_list[next]);
+		next = entry;
 		i++;
 	}
 	return next;
 }
 
-void emu3_init_cluster_list(struct inode *inode)
+//Contiguous runs of clusters in a chain. Chain entries only change under
+//alloc_lock. Bounded as the chain might loop.
+unsigned int emu3_get_fragments(struct emu3_sb_info *info, short cluster)
 {
-	struct emu3_sb_info *info = EMU3_SB(inode->i_sb);
+	unsigned int steps = 0, fragments = 1;
+	int next;
+
+	emu3_alloc_lock(info);
+	while (cluster > 0 && cluster < info->clusters &&
+	       steps++ < info->clusters) {
+		next = emu3_cluster_list_get(info, cluster);
+		if (next == EMU_LAST_FILE_CLUSTER || next < 0)
+			break;
+		if (next != cluster + 1)
+			fragments++;
+		cluster = next;
+	}
+	emu3_alloc_unlock(info);
+
+	return fragments;
+}
+
+static void emu3_discard_clusters(struct super_block *sb, short first,
+				  unsigned int count)
+{
+	struct emu3_sb_info *info = EMU3_SB(sb);
+	sector_t blknum = info->start_data_block +
+	    (first - 1) * info->blocks_per_cluster;
+
+	sb_issue_discard(sb, blknum >> info->sub_block_bits,
+			 (count * info->blocks_per_cluster) >>
+			 info->sub_block_bits, GFP_NOFS, 0);
+}
+
+//Discards a chain merging contiguous clusters in a single request.
+//The caller must own the chain and free it afterwards.
+void emu3_discard_chain(struct super_block *sb, short cluster)
+{
+	struct emu3_sb_info *info = EMU3_SB(sb);
+	unsigned int i, count = 0;
+	short first = cluster;
+
+	for (i = 0; i < info->clusters; i++) {
+		if (cluster < 1 || cluster >= info->clusters)
+			break;
+
+		if (count && cluster == first + count)
+			count++;
+		else {
+			if (count)
+				emu3_discard_clusters(sb, first, count);
+			first = cluster;
+			count = 1;
+		}
+
+		cluster = le16_to_cpu(info->cluster_list[cluster]);
+		if (cluster == EMU_LAST_FILE_CLUSTER)
+			break;
+	}
 
-	info->cluster_list[EMU3_I_START_CLUSTER(inode)] =
-	    cpu_to_le16(EMU_LAST_FILE_CLUSTER);
+	if (count)
+		emu3_discard_clusters(sb, first, count);
 }
 
 static void emu3_clear_cluster_list(struct inode *inode)
@@ -337,6 +599,7 @@ static void emu3_clear_cluster_list(struct inode *inode)
 	struct emu3_sb_info *info = EMU3_SB(inode->i_sb);
 	short prev, next = EMU3_I_START_CLUSTER(inode);
 
+	emu3_alloc_lock(info);
 	while (le16_to_cpu(info->cluster_list[next]) != EMU_LAST_FILE_CLUSTER) {
 		prev = next;
 		next = le16_to_cpu(info->cluster_list[next]);
@@ -349,18 +612,50 @@ static void emu3_clear_cluster_list(struct inode *inode)
 		}
 	}
 	info->cluster_list[next] = 0;
+	emu3_alloc_unlock(info);
+
+	trace_emu3_free_clusters(inode->i_sb, EMU3_I_START_CLUSTER(inode), i);
+	emu3_stat_add(info, EMU3_STAT_CLUSTERS_FREED, i);
 }
 
+//Returns a free cluster, already marked as the last one of a chain.
 int emu3_next_free_cluster(struct emu3_sb_info *info)
 {
-	int i;
-
-	for (i = 1; i < info->clusters; i++)
-		if (info->cluster_list[i] == 0)
+	int i, n, start;
+
+	lockdep_assert_held(&info->alloc_lock);
+
+	start = 1;
+	if (info->opts.alloc == EMU3_ALLOC_NEXT &&
+	    info->next_cluster > 1 && info->next_cluster < info->clusters)
+		start = info->next_cluster;
+
+	//Cluster 0 is never used.
+	for (n = 1, i = start; n < info->clusters; n++) {
+		if (info->cluster_list[i] == 0) {
+			info->cluster_list[i] =
+			    cpu_to_le16(EMU_LAST_FILE_CLUSTER);
+			info->next_cluster = i + 1;
+			trace_emu3_alloc_cluster(info->sb, i, 1);
+			emu3_stat_inc(info, EMU3_STAT_CLUSTERS_ALLOCATED);
 			return i;
+		}
+		if (++i == info->clusters)
+			i = 1;
+	}
 	return -ENOSPC;
 }
 
+void emu3_free_cluster(struct emu3_sb_info *info, short cluster)
+{
+	emu3_alloc_lock(info);
+	info->cluster_list[cluster] = 0;
+	emu3_alloc_unlock(info);
+
+	trace_emu3_free_clusters(info->sb, cluster, 1);
+	emu3_stat_inc(info, EMU3_STAT_CLUSTERS_FREED);
+}
+
 sector_t emu3_get_phys_block(struct inode *inode, sector_t block)
 {
 	struct emu3_sb_info *info = EMU3_SB(inode->i_sb);
@@ -376,13 +671,12 @@ sector_t emu3_get_phys_block(struct inode *inode, sector_t block)
 
 static void emu3_evict_inode(struct inode *inode)
 {
-	struct emu3_sb_info *info = EMU3_SB(inode->i_sb);
 	truncate_inode_pages(&inode->i_data, 0);
 	if (!inode->i_nlink && inode->i_mode & S_IFREG) {
-		mutex_lock(&info->lock);
-		emu3_clear_i_map(info, inode);
+		if (EMU3_SB(inode->i_sb)->opts.discard)
+			emu3_discard_chain(inode->i_sb,
+					   EMU3_I_START_CLUSTER(inode));
 		emu3_clear_cluster_list(inode);
-		mutex_unlock(&info->lock);
 		inode->i_size = 0;
 	}
 	invalidate_inode_buffers(inode);
@@ -393,27 +687,77 @@ static int emu3_write_cluster_list(struct super_block *sb)
 {
 	struct emu3_sb_info *info = EMU3_SB(sb);
 	struct buffer_head *b;
-	int i, blknum;
+	int i, blknum, dirty = 0;
+	short *data;
+	void *bdata;
 
 	for (i = 0; i < info->cluster_list_blocks; i++) {
 		blknum = info->start_cluster_list_block + i;
-		b = sb_bread(sb, blknum);
+		b = emu3_bread(sb, blknum);
 		if (!b) {
 			printk(KERN_CRIT EMU3_ERR_NOT_BLK, EMU3_MODULE_NAME,
 			       blknum);
+			trace_emu3_write_cluster_list(sb, dirty, -EIO);
 			return -EIO;
 		}
 
-		memcpy(b->b_data,
-		       &info->cluster_list[EMU3_CLUSTER_ENTRIES_PER_BLOCK * i],
-		       EMU3_BSIZE);
-		mark_buffer_dirty(b);
+		//Unchanged blocks are not rewritten.
+		data = &info->cluster_list[EMU3_CLUSTER_ENTRIES_PER_BLOCK * i];
+		bdata = emu3_block_data(info, b, blknum);
+		if (memcmp(bdata, data, EMU3_BSIZE)) {
+			memcpy(bdata, data, EMU3_BSIZE);
+			mark_buffer_dirty(b);
+			dirty++;
+		}
 		brelse(b);
 	}
 
+	trace_emu3_write_cluster_list(sb, dirty, 0);
+	emu3_stat_add(info, EMU3_STAT_META_WRITES, dirty);
 	return 0;
 }
 
+static int emu3_sync_fs(struct super_block *sb, int wait)
+{
+	int err;
+	struct emu3_sb_info *info = EMU3_SB(sb);
+
+	if (sb_rdonly(sb))
+		return 0;
+
+	emu3_alloc_lock(info);
+	err = emu3_write_cluster_list(sb);
+	emu3_alloc_unlock(info);
+
+	return err;
+}
+
+static void emu3_schedule_flush(struct emu3_sb_info *info)
+{
+	if (info->opts.flush_interval)
+		schedule_delayed_work(&info->flush_work,
+				      info->opts.flush_interval * HZ);
+}
+
+//Writes back the dirty inodes, the cluster list and the metadata blocks
+//periodically so that a crash or an unplugged card loses less work.
+static void emu3_flush_worker(struct work_struct *work)
+{
+	struct emu3_sb_info *info = container_of(to_delayed_work(work),
+						 struct emu3_sb_info,
+						 flush_work);
+	struct super_block *sb = info->sb;
+
+	if (sb_rdonly(sb))
+		return;
+
+	try_to_writeback_inodes_sb(sb, WB_REASON_PERIODIC);
+	emu3_sync_fs(sb, 0);
+	filemap_flush(sb->s_bdev->bd_mapping);
+
+	emu3_schedule_flush(info);
+}
+
 static int emu3_read_cluster_list(struct super_block *sb)
 {
 	struct emu3_sb_info *info = EMU3_SB(sb);
@@ -422,7 +766,7 @@ static int emu3_read_cluster_list(struct super_block *sb)
 
 	for (i = 0; i < info->cluster_list_blocks; i++) {
 		blknum = info->start_cluster_list_block + i;
-		b = sb_bread(sb, blknum);
+		b = emu3_bread(sb, blknum);
 		if (!b) {
 			printk(KERN_CRIT EMU3_ERR_NOT_BLK, EMU3_MODULE_NAME,
 			       blknum);
@@ -430,7 +774,7 @@ static int emu3_read_cluster_list(struct super_block *sb)
 		}
 
 		memcpy(&info->cluster_list[EMU3_CLUSTER_ENTRIES_PER_BLOCK * i],
-		       b->b_data, EMU3_BSIZE);
+		       emu3_block_data(info, b, blknum), EMU3_BSIZE);
 		brelse(b);
 	}
 
@@ -442,32 +786,94 @@ static void emu3_put_super(struct super_block *sb)
 	struct emu3_sb_info *info = EMU3_SB(sb);
 
 	if (info) {
-		mutex_lock(&info->lock);
-		emu3_write_cluster_list(sb);
-		mutex_unlock(&info->lock);
+		emu3_unregister_sysfs(sb);
+		cancel_delayed_work_sync(&info->flush_work);
 
-		mutex_destroy(&info->lock);
+		if (info->cluster_list) {
+			emu3_alloc_lock(info);
+			emu3_write_cluster_list(sb);
+			emu3_alloc_unlock(info);
+		}
+
+		emu3_unpin_meta(info);
+		emu3_free_index(info->index);
+		emu3_free_index(info->retired_index);
+		emu3_free_lazy(info->lazy);
+		mutex_destroy(&info->alloc_lock);
 
-		kfree(info->cluster_list);
+		kvfree(info->cluster_list);
 		kfree(info->dir_content_block_list);
-		kfree(info->i_maps);
+		bitmap_free(info->root_used_slots);
+		free_percpu(info->stats);
 		kfree(info);
 		sb->s_fs_info = NULL;
 	}
 }
 
+static int emu3_show_options(struct seq_file *m, struct dentry *root)
+{
+	struct emu3_mount_opts *opts = &EMU3_SB(root->d_sb)->opts;
+
+	if (opts->alloc == EMU3_ALLOC_NEXT)
+		seq_puts(m, ",alloc=next");
+	if (opts->ra_clusters)
+		seq_printf(m, ",ra_clusters=%u", opts->ra_clusters);
+	if (!opts->metacache)
+		seq_puts(m, ",nometacache");
+	if (opts->flush_interval)
+		seq_printf(m, ",flush_interval=%u", opts->flush_interval);
+	if (opts->discard)
+		seq_puts(m, ",discard");
+	if (opts->lazy)
+		seq_puts(m, ",lazy");
+	return 0;
+}
+
 static const struct super_operations emu3_super_operations = {
 	.alloc_inode = emu3_alloc_inode,
 	.destroy_inode = emu3_destroy_inode,
 	.write_inode = emu3_write_inode,
 	.evict_inode = emu3_evict_inode,
 	.put_super = emu3_put_super,
-	.statfs = emu3_statfs
+	.sync_fs = emu3_sync_fs,
+	.statfs = emu3_statfs,
+	.show_options = emu3_show_options
 };
 
-static int emu3_fill_super(struct super_block *sb, void *data,
-			   int silent, bool emu4)
+static void emu3_check_discard(struct super_block *sb,
+			       struct emu3_mount_opts *opts)
+{
+	if (opts->discard && !bdev_max_discard_sectors(sb->s_bdev)) {
+		printk(KERN_WARNING
+		       "%s: discard not supported by the device, disabling it\n",
+		       EMU3_MODULE_NAME);
+		opts->discard = 0;
+	}
+}
+
+//If the index can not be built, the mount uses the same paths than a read-write one.
+static void emu3_set_index(struct super_block *sb)
+{
+	struct emu3_sb_info *info = EMU3_SB(sb);
+	struct emu3_index *index = emu3_build_index(sb);
+
+	if (IS_ERR(index)) {
+		printk(KERN_WARNING "%s: metadata index not built (%ld)\n",
+		       EMU3_MODULE_NAME, PTR_ERR(index));
+		return;
+	}
+
+	index->free_blocks =
+	    emu3_get_free_clusters(info) * info->blocks_per_cluster +
+	    emu3_get_free_dir_blocks(info);
+	index->free_inodes = emu3_get_free_inodes(sb);
+	info->index = index;
+}
+
+static int emu3_fill_super(struct super_block *sb, struct fs_context *fc)
 {
+	struct emu3_fs_context *ctx = fc->fs_private;
+	bool emu4 = ctx->emu4;
 	struct emu3_sb_info *info;
 	struct buffer_head *sbh;
 	struct buffer_head *b;
@@ -476,12 +882,13 @@ static int emu3_fill_super(struct super_block *sb, void *data,
 	int i, j, k, blknum, size, err = 0;
 	short *block, index;
 	struct emu3_dentry *e3d;
+	struct blk_plug plug;
 	unsigned int *parameters;
 	unsigned int root_ino;
 
-	if (sb_set_blocksize(sb, EMU3_BSIZE) != EMU3_BSIZE) {
-		printk(KERN_ERR
-		       "%s: 512B block size not allowed on this device\n",
+	//CD-ROMs and 4Kn disks do not allow 512B blocks so the device block size is used instead.
+	if (!sb_min_blocksize(sb, EMU3_BSIZE)) {
+		printk(KERN_ERR "%s: block size not allowed on this device\n",
 		       EMU3_MODULE_NAME);
 		return -EINVAL;
 	}
@@ -490,9 +897,33 @@ static int emu3_fill_super(struct super_block *sb, void *data,
 	if (!info)
 		return -ENOMEM;
 
+	info->stats = alloc_percpu(struct emu3_stats);
+	if (!info->stats) {
+		kfree(info);
+		return -ENOMEM;
+	}
+
 	sb->s_fs_info = info;
+	info->sb = sb;
+	info->sub_block_bits = sb->s_blocksize_bits - EMU3_BSIZE_BITS;
+	mutex_init(&info->alloc_lock);
+	INIT_DELAYED_WORK(&info->flush_work, emu3_flush_worker);
+
+	info->opts = ctx->opts;
+	emu3_check_discard(sb, &info->opts);
+
+	//Lazy mounts can not write the cluster list they have not read.
+	if (info->opts.lazy) {
+		if (!sb_rdonly(sb)) {
+			printk(KERN_ERR "%s: lazy needs a read-only mount\n",
+			       EMU3_MODULE_NAME);
+			err = -EINVAL;
+			goto out1;
+		}
+		info->opts.metacache = 0;
+	}
 
-	sbh = sb_bread(sb, 0);
+	sbh = emu3_bread(sb, 0);
 	if (!sbh) {
 		printk(KERN_CRIT EMU3_ERR_NOT_BLK, EMU3_MODULE_NAME, 0);
 		err = -EIO;
@@ -528,16 +959,50 @@ static int emu3_fill_super(struct super_block *sb, void *data,
 	//This is not a problem on RO disks.
 	info->clusters = le32_to_cpu(parameters[9]);
 
-	//Now it's time to read the cluster list...
-	size = EMU3_BSIZE * info->cluster_list_blocks;
-	info->cluster_list = kzalloc(size, GFP_KERNEL);
-	if (!info->cluster_list) {
-		err = -ENOMEM;
+	//Clusters are mapped to whole device blocks.
+	if (info->start_data_block & ((1 << info->sub_block_bits) - 1)) {
+		printk(KERN_ERR
+		       "%s: data area not aligned to the %luB device blocks\n",
+		       EMU3_MODULE_NAME, sb->s_blocksize);
+		err = -EINVAL;
 		goto out2;
 	}
-	err = emu3_read_cluster_list(sb);
-	if (err)
-		goto out3;
+
+	//The whole metadata region is requested at once and pinned before parsing it.
+	if (info->opts.metacache) {
+		blk_start_plug(&plug);
+		emu3_readahead_blocks(sb, info->start_root_block,
+				      info->root_blocks);
+		emu3_readahead_blocks(sb, info->start_dir_content_block,
+				      info->dir_content_blocks);
+		emu3_readahead_blocks(sb, info->start_cluster_list_block,
+				      info->cluster_list_blocks);
+		blk_finish_plug(&plug);
+
+		err = emu3_pin_meta(sb);
+		if (err)
+			goto out2;
+	}
+
+	//Now it's time to read the cluster list...
+	if (info->opts.lazy) {
+		info->lazy = emu3_alloc_lazy(sb);
+		if (IS_ERR(info->lazy)) {
+			err = PTR_ERR(info->lazy);
+			info->lazy = NULL;
+			goto out2;
+		}
+	} else {
+		size = EMU3_BSIZE * info->cluster_list_blocks;
+		info->cluster_list = kvzalloc(size, GFP_KERNEL);
+		if (!info->cluster_list) {
+			err = -ENOMEM;
+			goto out2;
+		}
+		err = emu3_read_cluster_list(sb);
+		if (err)
+			goto out3;
+	}
 
 	printk(KERN_INFO
 	       "%s: %d physical blocks, %d addressable blocks, %d clusters, %d blocks/cluster\n",
@@ -563,25 +1028,22 @@ static int emu3_fill_super(struct super_block *sb, void *data,
 	}
 	memset(info->dir_content_block_list, 0, size);
 
-	size = sizeof(unsigned int) * EMU3_TOTAL_ENTRIES(info);
-	info->i_maps = kzalloc(size, GFP_KERNEL);
-	if (!info->i_maps) {
+	info->root_used_slots = bitmap_zalloc(EMU3_ROOT_SLOTS(info), GFP_KERNEL);
+	if (!info->root_used_slots) {
 		err = -ENOMEM;
 		goto out4;
 	}
-	memset(info->i_maps, 0, size);
 
 	sb->s_op = &emu3_super_operations;
 	sb->s_xattr = emu3_xattr_handlers;
+	sb->s_d_op = &emu3_dentry_operations;
 
 	info->emu4 = emu4;
 
 	if (emu4)
 		root_ino = 1;
 	else
-		root_ino =
-		    emu3_get_or_add_i_map(info, EMU3_DNUM
-					  (info->start_root_block, 0));
+		root_ino = EMU3_INO(EMU3_DNUM(info->start_root_block, 0), info);
 	inode = emu3_get_inode(sb, root_ino);
 	if (IS_ERR(inode)) {
 		err = -EIO;
@@ -599,7 +1061,7 @@ static int emu3_fill_super(struct super_block *sb, void *data,
 
 	for (i = 0; i < info->root_blocks; i++) {
 		blknum = info->start_root_block + i;
-		b = sb_bread(sb, blknum);
+		b = emu3_bread(sb, blknum);
 		if (!b) {
 			printk(KERN_CRIT EMU3_ERR_NOT_BLK, EMU3_MODULE_NAME,
 			       blknum);
@@ -607,7 +1069,7 @@ static int emu3_fill_super(struct super_block *sb, void *data,
 			goto out5;
 		}
 
-		e3d = (struct emu3_dentry *)b->b_data;
+		e3d = emu3_block_data(info, b, blknum);
 
 		if (i == 0 && emu3_fix_first_dir_blocks(e3d, info))
 			mark_buffer_dirty_inode(b, inode);
@@ -616,6 +1078,9 @@ static int emu3_fill_super(struct super_block *sb, void *data,
 			if (!EMU3_DENTRY_IS_DIR(e3d))
 				continue;
 
+			set_bit(i * EMU3_ENTRIES_PER_BLOCK + j,
+				info->root_used_slots);
+
 			block = e3d->data.dattrs.block_list;
 			for (k = 0; k < EMU3_BLOCKS_PER_DIR; k++, block++) {
 				index = le16_to_cpu(*block);
@@ -634,6 +1099,17 @@ static int emu3_fill_super(struct super_block *sb, void *data,
 					goto out5;
 				}
 
+				//A block in two folders, or twice in one, would be
+				//counted and written by each of them.
+				if (info->dir_content_block_list[index]) {
+					printk(KERN_CRIT
+					       "%s: block %d used twice by dir %.16s\n",
+					       EMU3_MODULE_NAME, *block,
+					       e3d->name);
+					err = -EIO;
+					goto out5;
+				}
+
 				info->dir_content_block_list[index] = 1;
 			}
 		}
@@ -641,61 +1117,210 @@ static int emu3_fill_super(struct super_block *sb, void *data,
 		brelse(b);
 	}
 
+	//The index needs every chain so it would read the whole cluster list.
+	if (sb_rdonly(sb) && !info->lazy)
+		emu3_set_index(sb);
+
+	if (!err)
+		err = emu3_register_sysfs(sb);
+
 	if (!err) {
-		mutex_init(&info->lock);
 		brelse(sbh);
+		if (!sb_rdonly(sb))
+			emu3_schedule_flush(info);
 		return 0;
 	}
 
  out5:
-	kfree(info->dir_content_block_list);
+	emu3_free_index(info->index);
+	bitmap_free(info->root_used_slots);
  out4:
-	kfree(info->i_maps);
+	kfree(info->dir_content_block_list);
  out3:
-	kfree(info->cluster_list);
+	kvfree(info->cluster_list);
+	emu3_free_lazy(info->lazy);
  out2:
+	emu3_unpin_meta(info);
 	brelse(sbh);
  out1:
+	free_percpu(info->stats);
 	kfree(info);
 	sb->s_fs_info = NULL;
 	return err;
 }
 
-static int emu3_fill_super_v3(struct super_block *sb, void *data, int silent)
+enum {
+	Opt_alloc,
+	Opt_ra_clusters,
+	Opt_metacache,
+	Opt_flush_interval,
+	Opt_discard,
+	Opt_lazy,
+};
+
+static const struct constant_table emu3_param_alloc[] = {
+	{"first", EMU3_ALLOC_FIRST},
+	{"next", EMU3_ALLOC_NEXT},
+	{}
+};
+
+static const struct fs_parameter_spec emu3_fs_parameters[] = {
+	fsparam_enum("alloc", Opt_alloc, emu3_param_alloc),
+	fsparam_u32("ra_clusters", Opt_ra_clusters),
+	fsparam_flag_no("metacache", Opt_metacache),
+	fsparam_u32("flush_interval", Opt_flush_interval),
+	fsparam_flag_no("discard", Opt_discard),
+	fsparam_flag("lazy", Opt_lazy),
+	{}
+};
+
+static int emu3_parse_param(struct fs_context *fc, struct fs_parameter *param)
 {
-	return emu3_fill_super(sb, data, silent, 0);
+	struct emu3_fs_context *ctx = fc->fs_private;
+	struct fs_parse_result result;
+	int opt;
+
+	opt = fs_parse(fc, emu3_fs_parameters, param, &result);
+	if (opt < 0)
+		return opt;
+
+	switch (opt) {
+	case Opt_alloc:
+		ctx->opts.alloc = result.uint_32;
+		break;
+	case Opt_ra_clusters:
+		if (result.uint_32 > EMU3_MAX_RA_CLUSTERS)
+			return invalfc(fc, "ra_clusters must be at most %d",
+				       EMU3_MAX_RA_CLUSTERS);
+		ctx->opts.ra_clusters = result.uint_32;
+		break;
+	case Opt_metacache:
+		ctx->opts.metacache = !result.negated;
+		break;
+	case Opt_flush_interval:
+		ctx->opts.flush_interval = result.uint_32;
+		break;
+	case Opt_discard:
+		ctx->opts.discard = !result.negated;
+		break;
+	case Opt_lazy:
+		ctx->opts.lazy = 1;
+		break;
+	}
+
+	return 0;
 }
 
-static int emu3_fill_super_v4(struct super_block *sb, void *data, int silent)
+static int emu3_get_tree(struct fs_context *fc)
 {
-	return emu3_fill_super(sb, data, silent, 1);
+	return get_tree_bdev(fc, emu3_fill_super);
 }
 
-static struct dentry *emu3_mount_v3(struct file_system_type *fs_type,
-				    int flags, const char *dev_name, void *data)
+static int emu3_reconfigure(struct fs_context *fc)
 {
-	return mount_bdev(fs_type, flags, dev_name, data, emu3_fill_super_v3);
+	struct emu3_fs_context *ctx = fc->fs_private;
+	struct super_block *sb = fc->root->d_sb;
+	struct emu3_sb_info *info = EMU3_SB(sb);
+
+	//The pinned metadata can not be released while it is being used.
+	if (ctx->opts.metacache != info->opts.metacache)
+		return invalfc(fc, "metacache can not be changed on remount");
+
+	if (ctx->opts.lazy != info->opts.lazy)
+		return invalfc(fc, "lazy can not be changed on remount");
+	if (info->opts.lazy && !(fc->sb_flags & SB_RDONLY))
+		return invalfc(fc, "lazy mounts can not be remounted read-write");
+
+	sync_filesystem(sb);
+	cancel_delayed_work_sync(&info->flush_work);
+
+	emu3_check_discard(sb, &ctx->opts);
+
+	//The allocation policy is read under the allocator lock.
+	emu3_alloc_lock(info);
+	info->opts = ctx->opts;
+	emu3_alloc_unlock(info);
+
+	//Writers can not use the index but lock-free readers might still be
+	//using it, so it is kept until the unmount.
+	if (!(fc->sb_flags & SB_RDONLY) && info->index) {
+		info->retired_index = info->index;
+		WRITE_ONCE(info->index, NULL);
+	}
+
+	if (!(fc->sb_flags & SB_RDONLY))
+		emu3_schedule_flush(info);
+
+	return 0;
 }
 
-static struct dentry *emu3_mount_v4(struct file_system_type *fs_type,
-				    int flags, const char *dev_name, void *data)
+static void emu3_free_fc(struct fs_context *fc)
 {
-	return mount_bdev(fs_type, flags, dev_name, data, emu3_fill_super_v4);
+	kfree(fc->fs_private);
+}
+
+static const struct fs_context_operations emu3_context_ops = {
+	.parse_param = emu3_parse_param,
+	.get_tree = emu3_get_tree,
+	.reconfigure = emu3_reconfigure,
+	.free = emu3_free_fc,
+};
+
+static int emu3_init_fs_context_common(struct fs_context *fc, bool emu4)
+{
+	struct emu3_fs_context *ctx;
+
+	ctx = kzalloc(sizeof(struct emu3_fs_context), GFP_KERNEL);
+	if (!ctx)
+		return -ENOMEM;
+
+	//On remount, the options not given keep their current value.
+	if (fc->root)
+		ctx->opts = EMU3_SB(fc->root->d_sb)->opts;
+	else {
+		ctx->opts.alloc = EMU3_ALLOC_FIRST;
+		ctx->opts.metacache = 1;
+	}
+	ctx->emu4 = emu4;
+
+	fc->fs_private = ctx;
+	fc->ops = &emu3_context_ops;
+	return 0;
+}
+
+static int emu3_init_fs_context_v3(struct fs_context *fc)
+{
+	return emu3_init_fs_context_common(fc, 0);
+}
+
+static int emu3_init_fs_context_v4(struct fs_context *fc)
+{
+	return emu3_init_fs_context_common(fc, 1);
+}
+
+static void emu3_kill_sb(struct super_block *sb)
+{
+	u64 start = ktime_get_ns();
+
+	kill_block_super(sb);
+	emu3_record_unmount(start);
 }
 
 static struct file_system_type emu3_fs_type_v3 = {
 	.owner = THIS_MODULE,
 	.name = "emu3",
-	.mount = emu3_mount_v3,
-	.kill_sb = kill_block_super,
+	.init_fs_context = emu3_init_fs_context_v3,
+	.parameters = emu3_fs_parameters,
+	.kill_sb = emu3_kill_sb,
 	.fs_flags = FS_REQUIRES_DEV,
 };
 
 static struct file_system_type emu3_fs_type_v4 = {
 	.owner = THIS_MODULE,
 	.name = "emu4",
-	.mount = emu3_mount_v4,
-	.kill_sb = kill_block_super,
+	.init_fs_context = emu3_init_fs_context_v4,
+	.parameters = emu3_fs_parameters,
+	.kill_sb = emu3_kill_sb,
 	.fs_flags = FS_REQUIRES_DEV,
 };
 
@@ -707,10 +1332,17 @@ static int __init emu3_init(void)
 	err = init_inodecache();
 	if (err)
 		return err;
+	err = emu3_sysfs_init();
+	if (err) {
+		destroy_inodecache();
+		return err;
+	}
 	err = register_filesystem(&emu3_fs_type_v3)
 	    || register_filesystem(&emu3_fs_type_v4);
-	if (err)
+	if (err) {
+		emu3_sysfs_exit();
 		destroy_inodecache();
+	}
 	return err;
 }
 
@@ -718,6 +1350,7 @@ static void __exit emu3_exit(void)
 {
 	unregister_filesystem(&emu3_fs_type_v3);
 	unregister_filesystem(&emu3_fs_type_v4);
+	emu3_sysfs_exit();
 	destroy_inodecache();
 	printk(KERN_INFO "%s: exit\n", EMU3_MODULE_NAME);
 }
@@ -0,0 +1,292 @@
+/*
+ *   sysfs.c
+ *   Copyright (C) 2018 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of emu3fs.
+ *
+ *   emu3fs is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   emu3fs is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with emu3fs. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <linux/sysfs.h>
+#include "emu3_fs.h"
+
+struct emu3_attr {
+	struct attribute attr;
+	ssize_t (*show)(struct emu3_sb_info *, struct emu3_attr *, char *);
+	int id;
+};
+
+static struct kset *emu3_kset;
+
+//The unmount latency can not live in the per device directory, which is removed at unmount.
+static atomic64_t emu3_unmount_lat[EMU3_LAT_BUCKETS];
+
+static u64 emu3_stat_sum(struct emu3_sb_info *info, enum emu3_stat stat)
+{
+	int cpu;
+	u64 sum = 0;
+
+	for_each_possible_cpu(cpu)
+	    sum += per_cpu_ptr(info->stats, cpu)->count[stat];
+
+	return sum;
+}
+
+static int emu3_lat_bucket(u64 start)
+{
+	u64 us = div_u64(ktime_get_ns() - start, NSEC_PER_USEC);
+
+	return min_t(int, fls64(us), EMU3_LAT_BUCKETS - 1);
+}
+
+void emu3_lat_record(struct emu3_sb_info *info, enum emu3_lat lat, u64 start)
+{
+	this_cpu_inc(info->stats->lat[lat][emu3_lat_bucket(start)]);
+}
+
+void emu3_record_unmount(u64 start)
+{
+	atomic64_inc(&emu3_unmount_lat[emu3_lat_bucket(start)]);
+}
+
+//Histograms are shown as the space separated counts of every bucket.
+static ssize_t emu3_hist_show(u64 *buckets, char *buf)
+{
+	int i, len = 0;
+
+	for (i = 0; i < EMU3_LAT_BUCKETS; i++)
+		len += sysfs_emit_at(buf, len, "%llu%c", buckets[i],
+				     i == EMU3_LAT_BUCKETS - 1 ? '\n' : ' ');
+
+	return len;
+}
+
+static ssize_t emu3_counter_show(struct emu3_sb_info *info,
+				 struct emu3_attr *a, char *buf)
+{
+	return sysfs_emit(buf, "%llu\n", emu3_stat_sum(info, a->id));
+}
+
+static ssize_t emu3_avg_chain_steps_show(struct emu3_sb_info *info,
+					 struct emu3_attr *a, char *buf)
+{
+	u64 maps = emu3_stat_sum(info, EMU3_STAT_BLOCK_MAPS);
+	u64 steps = emu3_stat_sum(info, EMU3_STAT_CHAIN_STEPS);
+
+	//Two decimals are enough to see a trend.
+	steps = maps ? div64_u64(steps * 100, maps) : 0;
+	return sysfs_emit(buf, "%llu.%02llu\n", div_u64(steps, 100),
+			  steps % 100);
+}
+
+static ssize_t emu3_lat_show(struct emu3_sb_info *info,
+			     struct emu3_attr *a, char *buf)
+{
+	int i, cpu;
+	u64 buckets[EMU3_LAT_BUCKETS] = { 0 };
+
+	for_each_possible_cpu(cpu)
+	    for (i = 0; i < EMU3_LAT_BUCKETS; i++)
+		buckets[i] += per_cpu_ptr(info->stats, cpu)->lat[a->id][i];
+
+	return emu3_hist_show(buckets, buf);
+}
+
+//Free runs are counted in clusters.
+static void emu3_free_runs(struct emu3_sb_info *info, unsigned int *runs,
+			   unsigned int *largest)
+{
+	unsigned int i, run = 0;
+
+	//Lazy mounts count them from the blocks instead of loading every chunk.
+	if (info->lazy) {
+		emu3_lazy_free_runs(info, runs, largest);
+		return;
+	}
+
+	*runs = 0;
+	*largest = 0;
+
+	emu3_alloc_lock(info);
+	for (i = 1; i < info->clusters; i++) {
+		if (emu3_cluster_list_get(info, i) == 0) {
+			if (!run)
+				(*runs)++;
+			run++;
+			if (run > *largest)
+				*largest = run;
+		} else
+			run = 0;
+	}
+	emu3_alloc_unlock(info);
+}
+
+static ssize_t emu3_free_extents_show(struct emu3_sb_info *info,
+				      struct emu3_attr *a, char *buf)
+{
+	unsigned int runs, largest;
+
+	emu3_free_runs(info, &runs, &largest);
+	return sysfs_emit(buf, "%u\n", runs);
+}
+
+static ssize_t emu3_largest_free_run_show(struct emu3_sb_info *info,
+					  struct emu3_attr *a, char *buf)
+{
+	unsigned int runs, largest;
+
+	emu3_free_runs(info, &runs, &largest);
+	return sysfs_emit(buf, "%u\n", largest);
+}
+
+#define EMU3_ATTR(_name, _show, _id)					\
+static struct emu3_attr emu3_attr_##_name = {				\
+	.attr = {.name = __stringify(_name), .mode = 0444 },		\
+	.show = _show,							\
+	.id = _id,							\
+}
+
+#define EMU3_COUNTER_ATTR(_name, _id) EMU3_ATTR(_name, emu3_counter_show, _id)
+
+EMU3_COUNTER_ATTR(block_maps, EMU3_STAT_BLOCK_MAPS);
+EMU3_COUNTER_ATTR(chain_steps, EMU3_STAT_CHAIN_STEPS);
+EMU3_COUNTER_ATTR(clusters_allocated, EMU3_STAT_CLUSTERS_ALLOCATED);
+EMU3_COUNTER_ATTR(clusters_freed, EMU3_STAT_CLUSTERS_FREED);
+EMU3_COUNTER_ATTR(meta_reads, EMU3_STAT_META_READS);
+EMU3_COUNTER_ATTR(meta_cache_hits, EMU3_STAT_META_CACHE_HITS);
+EMU3_COUNTER_ATTR(meta_writes, EMU3_STAT_META_WRITES);
+EMU3_COUNTER_ATTR(lookups, EMU3_STAT_LOOKUPS);
+EMU3_COUNTER_ATTR(lookup_hits, EMU3_STAT_LOOKUP_HITS);
+EMU3_COUNTER_ATTR(inodes_prefilled, EMU3_STAT_INODES_PREFILLED);
+EMU3_COUNTER_ATTR(alloc_lock_wait_ns, EMU3_STAT_ALLOC_WAIT_NS);
+EMU3_ATTR(avg_chain_steps, emu3_avg_chain_steps_show, 0);
+EMU3_ATTR(create_latency_us, emu3_lat_show, EMU3_LAT_CREATE);
+EMU3_ATTR(fsync_latency_us, emu3_lat_show, EMU3_LAT_FSYNC);
+EMU3_ATTR(free_extents, emu3_free_extents_show, 0);
+EMU3_ATTR(largest_free_run, emu3_largest_free_run_show, 0);
+
+static struct attribute *emu3_attrs[] = {
+	&emu3_attr_block_maps.attr,
+	&emu3_attr_chain_steps.attr,
+	&emu3_attr_avg_chain_steps.attr,
+	&emu3_attr_clusters_allocated.attr,
+	&emu3_attr_clusters_freed.attr,
+	&emu3_attr_meta_reads.attr,
+	&emu3_attr_meta_cache_hits.attr,
+	&emu3_attr_meta_writes.attr,
+	&emu3_attr_lookups.attr,
+	&emu3_attr_lookup_hits.attr,
+	&emu3_attr_inodes_prefilled.attr,
+	&emu3_attr_alloc_lock_wait_ns.attr,
+	&emu3_attr_create_latency_us.attr,
+	&emu3_attr_fsync_latency_us.attr,
+	&emu3_attr_free_extents.attr,
+	&emu3_attr_largest_free_run.attr,
+	NULL,
+};
+
+ATTRIBUTE_GROUPS(emu3);
+
+static ssize_t emu3_attr_show(struct kobject *kobj, struct attribute *attr,
+			      char *buf)
+{
+	struct emu3_sb_info *info = container_of(kobj, struct emu3_sb_info,
+						 kobj);
+	struct emu3_attr *a = container_of(attr, struct emu3_attr, attr);
+
+	return a->show(info, a, buf);
+}
+
+static void emu3_sb_release(struct kobject *kobj)
+{
+	struct emu3_sb_info *info = container_of(kobj, struct emu3_sb_info,
+						 kobj);
+
+	complete(&info->kobj_unregister);
+}
+
+static const struct sysfs_ops emu3_attr_ops = {
+	.show = emu3_attr_show,
+};
+
+static const struct kobj_type emu3_sb_ktype = {
+	.default_groups = emu3_groups,
+	.sysfs_ops = &emu3_attr_ops,
+	.release = emu3_sb_release,
+};
+
+static ssize_t unmount_flush_latency_us_show(struct kobject *kobj,
+					     struct kobj_attribute *attr,
+					     char *buf)
+{
+	int i;
+	u64 buckets[EMU3_LAT_BUCKETS];
+
+	for (i = 0; i < EMU3_LAT_BUCKETS; i++)
+		buckets[i] = atomic64_read(&emu3_unmount_lat[i]);
+
+	return emu3_hist_show(buckets, buf);
+}
+
+static struct kobj_attribute emu3_attr_unmount_flush_latency_us =
+__ATTR_RO(unmount_flush_latency_us);
+
+int emu3_register_sysfs(struct super_block *sb)
+{
+	int err;
+	struct emu3_sb_info *info = EMU3_SB(sb);
+
+	init_completion(&info->kobj_unregister);
+	info->kobj.kset = emu3_kset;
+	err = kobject_init_and_add(&info->kobj, &emu3_sb_ktype, NULL, "%s",
+				   sb->s_id);
+	if (err) {
+		kobject_put(&info->kobj);
+		wait_for_completion(&info->kobj_unregister);
+	}
+
+	return err;
+}
+
+void emu3_unregister_sysfs(struct super_block *sb)
+{
+	struct emu3_sb_info *info = EMU3_SB(sb);
+
+	kobject_del(&info->kobj);
+	kobject_put(&info->kobj);
+	wait_for_completion(&info->kobj_unregister);
+}
+
+int emu3_sysfs_init(void)
+{
+	int err;
+
+	emu3_kset = kset_create_and_add("emu3", NULL, fs_kobj);
+	if (!emu3_kset)
+		return -ENOMEM;
+
+	err = sysfs_create_file(&emu3_kset->kobj,
+				&emu3_attr_unmount_flush_latency_us.attr);
+	if (err)
+		kset_unregister(emu3_kset);
+
+	return err;
+}
+
+void emu3_sysfs_exit(void)
+{
+	sysfs_remove_file(&emu3_kset->kobj,
+			  &emu3_attr_unmount_flush_latency_us.attr);
+	kset_unregister(emu3_kset);
+}
@@ -0,0 +1,200 @@
+#!/usr/bin/env bash
+
+# Throughput benchmark. Every fio profile in the fio directory is run on every
+# image, for every device delay and with both emu3 and emu4 mounts. The fio
+# JSON outputs and a summary are stored in the results directory and the
+# summary is compared against the stored baseline.
+#
+# Usage: ./bench.sh [-s]
+#   -s  stores the summary as the new baseline.
+#
+# Environment:
+#   EMU3_BENCH_IMAGES     images to build and test (default: "base frag8 frag1")
+#                         frag<n> interleaves n cluster chunks of two files and
+#                         deletes one of them, leaving free runs of n clusters.
+#                         gen<shift>[-<pattern>] is a 4 GiB image created with
+#                         emu3-mkimage, with clusters of 2^shift bytes (18 or
+#                         more), 75% full and with the given cluster placement
+#                         (none, random or interleave:n). Its first folder,
+#                         the root of emu3 mounts, is left empty for the
+#                         files created by the profiles.
+#   EMU3_BENCH_DELAYS     device delays in ms emulated with dm-delay (default: "0")
+#                         5 and 15 are reasonable values for SCSI disks and Zip drives.
+#   EMU3_BENCH_THRESHOLD  regression threshold in percent (default: 10)
+
+[ -z "$EMU3_BENCH_IMAGES" ] && EMU3_BENCH_IMAGES="base frag8 frag1"
+[ -z "$EMU3_BENCH_DELAYS" ] && EMU3_BENCH_DELAYS="0"
+[ -z "$EMU3_BENCH_THRESHOLD" ] && EMU3_BENCH_THRESHOLD=10
+
+EMU3_MOUNTPOINT=bench_mountpoint
+EMU3_BENCH_RESULTS=bench_results
+EMU3_BENCH_BASELINE=bench_baseline.json
+EMU3_BENCH_DM=emu3-bench-delay
+
+LANG=C
+
+loop=
+dev=
+
+function cleanUp() {
+  echo "Cleaning up..."
+  mountpoint -q $EMU3_MOUNTPOINT && sudo umount $EMU3_MOUNTPOINT
+  [ -e /dev/mapper/$EMU3_BENCH_DM ] && sudo dmsetup remove $EMU3_BENCH_DM
+  [ -n "$loop" ] && sudo losetup -d $loop
+  loop=
+  dev=
+}
+
+function fail() {
+  echo "Error: $*"
+  cleanUp
+  rmdir $EMU3_MOUNTPOINT
+  exit 1
+}
+
+function setupDevice() {
+  loop=$(sudo losetup -f --show $1) || fail "losetup $1"
+  if [ $2 -eq 0 ]; then
+    dev=$loop
+  else
+    sectors=$(sudo blockdev --getsz $loop)
+    echo "0 $sectors delay $loop 0 $2" | sudo dmsetup create $EMU3_BENCH_DM || fail "dm-delay"
+    dev=/dev/mapper/$EMU3_BENCH_DM
+  fi
+}
+
+function clusterSize() {
+  echo $((1 << (15 + $(od -An -tu1 -j40 -N1 $1))))
+}
+
+# The base image is interleaved with chunks of $2 clusters from two files until
+# it is half full. Deleting one of the files leaves free runs of $2 clusters.
+function buildFragmentedImage() {
+  cp --sparse=always $EMU3_BENCH_RESULTS/images/base.iso $1
+  setupDevice $1 0
+  sudo mount -t emu4 $dev $EMU3_MOUNTPOINT || fail "mount $1"
+  sudo mkdir $EMU3_MOUNTPOINT/frag || fail "mkdir"
+
+  chunk=$(($(clusterSize $1) * $2))
+  free=$(($(stat -f --print "%a * %S" $EMU3_MOUNTPOINT)))
+  for i in $(seq $((free / chunk / 4))); do
+    for f in keep hole; do
+      sudo dd if=/dev/zero of=$EMU3_MOUNTPOINT/frag/$f bs=$chunk count=1 oflag=append conv=notrunc status=none || fail "dd"
+    done
+  done
+  sudo rm $EMU3_MOUNTPOINT/frag/hole
+
+  cleanUp
+}
+
+function buildImages() {
+  mkdir -p $EMU3_BENCH_RESULTS/images
+  xz -dc image.iso.xz.bak | cp --sparse=always /dev/stdin $EMU3_BENCH_RESULTS/images/base.iso
+
+  for image in $EMU3_BENCH_IMAGES; do
+    case $image in
+    base)
+      ;;
+    frag*)
+      echo "Building $image..."
+      buildFragmentedImage $EMU3_BENCH_RESULTS/images/$image.iso ${image#frag}
+      ;;
+    gen*)
+      echo "Building $image..."
+      spec=${image#gen}
+      shift=${spec%%-*}
+      pattern=none
+      [ "$spec" != "$shift" ] && pattern=${spec#*-}
+      ./emu3-mkimage -s 4G -c $shift -f 13 -e -b 100 -m 1M -M 4M -F $pattern $EMU3_BENCH_RESULTS/images/$image.iso > /dev/null || fail "emu3-mkimage $image"
+      ;;
+    *)
+      fail "unknown image $image"
+      ;;
+    esac
+  done
+}
+
+function summarize() {
+  jq --arg k "$1" '{($k): {
+    read_kib: ([.jobs[].read.bw] | add),
+    write_kib: ([.jobs[].write.bw] | add),
+    read_iops: ([.jobs[].read.iops] | add | floor),
+    write_iops: ([.jobs[].write.iops] | add | floor)
+  }}' $2
+}
+
+function runProfiles() {
+  name=$1-$2ms-$3
+  echo "Running $name..."
+
+  work=$EMU3_BENCH_RESULTS/work.iso
+  cp --sparse=always $EMU3_BENCH_RESULTS/images/$1.iso $work
+  setupDevice $work $2
+  sudo mount -t $3 $dev $EMU3_MOUNTPOINT || fail "mount $name"
+
+  # emu3 mounts expose the first folder as root while emu4 mounts need one.
+  dir=$EMU3_MOUNTPOINT
+  if [ $3 == emu4 ]; then
+    dir=$EMU3_MOUNTPOINT/bench
+    sudo mkdir $dir || fail "mkdir"
+  fi
+
+  for profile in fio/*.fio; do
+    p=$(basename $profile .fio)
+    out=$EMU3_BENCH_RESULTS/$name-$p.json
+    sudo fio --directory=$dir --output-format=json --output=$out $profile || fail "fio $p"
+    summarize $name-$p $out >> $EMU3_BENCH_RESULTS/summary.tmp
+  done
+
+  cleanUp
+  rm $work
+}
+
+function compare() {
+  jq -r --argjson t $EMU3_BENCH_THRESHOLD --slurpfile b $EMU3_BENCH_BASELINE '
+    . as $new
+    | $b[0] | to_entries[] | .key as $k
+    | .value | to_entries[] | select(.value > 0) | .key as $m
+    | ($new[$k][$m] // 0) as $v
+    | ((($v - .value) * 100 / .value) | floor) as $d
+    | "\(if $d < -$t then "REGRESSION" else "ok" end) \($k) \($m) \(.value) -> \($v) (\($d)%)"
+  ' $EMU3_BENCH_RESULTS/summary.json | tee $EMU3_BENCH_RESULTS/comparison.txt
+
+  ! grep -q ^REGRESSION $EMU3_BENCH_RESULTS/comparison.txt
+}
+
+which fio jq > /dev/null || fail "fio and jq are needed"
+
+mkdir -p $EMU3_MOUNTPOINT
+rm -rf $EMU3_BENCH_RESULTS
+mkdir -p $EMU3_BENCH_RESULTS
+
+sudo modprobe emu3_fs || fail "modprobe"
+make -s emu3-mkimage || fail "make"
+
+buildImages
+
+for image in $EMU3_BENCH_IMAGES; do
+  for delay in $EMU3_BENCH_DELAYS; do
+    for fstype in emu3 emu4; do
+      runProfiles $image $delay $fstype
+    done
+  done
+done
+
+jq -s add $EMU3_BENCH_RESULTS/summary.tmp > $EMU3_BENCH_RESULTS/summary.json
+rm $EMU3_BENCH_RESULTS/summary.tmp $EMU3_BENCH_RESULTS/images/*.iso
+rmdir $EMU3_BENCH_RESULTS/images $EMU3_MOUNTPOINT
+
+if [ "$1" == "-s" ]; then
+  cp $EMU3_BENCH_RESULTS/summary.json $EMU3_BENCH_BASELINE
+  echo "Baseline stored in $EMU3_BENCH_BASELINE"
+  exit 0
+fi
+
+if [ ! -f $EMU3_BENCH_BASELINE ]; then
+  echo "No baseline found. Run './bench.sh -s' to store one."
+  exit 0
+fi
+
+compare
@@ -0,0 +1,589 @@
+/*
+ *   emu3-mkimage.c
+ *   Copyright (C) 2018 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of emu3fs.
+ *
+ *   emu3fs is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   emu3fs is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with emu3fs. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+//Synthetic EMU3 and EMU4 image generator.
+//Only the metadata is written, so the images are sparse unless -p is given.
+
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <endian.h>
+#include <math.h>
+
+#define EMU3_BSIZE 512
+#define EMU3_CLUSTER_ENTRIES_PER_BLOCK (EMU3_BSIZE / 2)
+#define EMU3_ENTRIES_PER_BLOCK 16
+#define EMU3_BLOCKS_PER_DIR 7
+#define EMU3_MAX_FILES_PER_DIR (EMU3_ENTRIES_PER_BLOCK * EMU3_BLOCKS_PER_DIR)
+#define EMU3_MAX_BANKS 100
+#define EMU3_LENGTH_FILENAME 16
+#define EMU3_MIN_CLUSTER_SHIFT 15
+#define EMU3_MAX_CLUSTERS 0x7ffe
+#define EMU_LAST_FILE_CLUSTER 0x7fff
+#define EMU3_FREE_DIR_BLOCK 0xffff
+#define EMU3_FTYPE_DEL 0x00
+#define EMU3_FTYPE_STD 0x81
+#define EMU3_DTYPE_1 0x40
+
+//The layout of the smallest disks, which is kept as the minimum.
+#define EMU3_START_CLUSTER_LIST_BLOCK 2
+#define EMU3_MIN_ROOT_BLOCKS 3
+#define EMU3_MIN_DIR_CONTENT_BLOCKS 106
+
+enum frag {
+	FRAG_NONE,
+	FRAG_INTERLEAVE,
+	FRAG_RANDOM
+};
+
+enum dist {
+	DIST_UNIFORM,
+	DIST_EXP
+};
+
+struct __attribute__((packed)) emu3_dentry {
+	char name[EMU3_LENGTH_FILENAME];
+	uint8_t unknown;
+	uint8_t id;
+	union {
+		struct __attribute__((packed)) {
+			uint16_t start_cluster;
+			uint16_t clusters;
+			uint16_t blocks;
+			uint16_t bytes;
+			uint8_t type;
+			uint8_t props[5];
+		} fattrs;
+		uint16_t block_list[EMU3_BLOCKS_PER_DIR];
+	};
+};
+
+struct layout {
+	uint32_t blocks;
+	uint32_t start_root_block;
+	uint32_t root_blocks;
+	uint32_t start_dir_content_block;
+	uint32_t dir_content_blocks;
+	uint32_t start_cluster_list_block;
+	uint32_t cluster_list_blocks;
+	uint32_t start_data_block;
+	uint32_t clusters;
+	uint32_t cluster_shift;
+};
+
+struct bank {
+	uint64_t size;
+	uint32_t clusters;
+	uint32_t allocated;
+	uint16_t start;
+	uint16_t last;
+	struct emu3_dentry *dentry;
+};
+
+static struct layout l;
+static uint16_t *cluster_list;
+static uint8_t *meta;		//Blocks from 0 to the start of the data
+static struct bank *banks;
+static unsigned int nbanks;
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [options] image\n"
+		"  -s size      image size with optional K, M or G suffix (default: 512M)\n"
+		"  -c shift     cluster size as a power of 2, from 15 (default: smallest possible)\n"
+		"  -f folders   number of folders (default: 1)\n"
+		"  -b banks     banks per folder, up to %d (default: 10)\n"
+		"  -e           leave the first folder empty, as emu3 mounts use it as root\n"
+		"  -m size      minimum bank size (default: 64K)\n"
+		"  -M size      maximum bank size (default: 8M)\n"
+		"  -d dist      bank size distribution: uniform or exp (default: uniform)\n"
+		"  -F pattern   cluster placement: none, interleave:n or random (default: none)\n"
+		"  -x percent   banks deleted after writing to fragment the free space (default: 0)\n"
+		"  -r seed      random seed (default: 1)\n"
+		"  -4           EIV file properties\n"
+		"  -p           write a pattern in the banks instead of leaving holes\n",
+		prog, EMU3_MAX_BANKS);
+	exit(EXIT_FAILURE);
+}
+
+static uint64_t parse_size(const char *s)
+{
+	char *end;
+	uint64_t v = strtoull(s, &end, 0);
+
+	switch (*end) {
+	case 'G':
+	case 'g':
+		v <<= 10;
+		//fallthrough
+	case 'M':
+	case 'm':
+		v <<= 10;
+		//fallthrough
+	case 'K':
+	case 'k':
+		v <<= 10;
+		break;
+	}
+
+	return v;
+}
+
+static uint64_t rand64(void)
+{
+	return ((uint64_t) random() << 31) ^ random();
+}
+
+static uint64_t bank_size(uint64_t min, uint64_t max, enum dist dist)
+{
+	uint64_t v;
+	double u;
+
+	if (max <= min)
+		return min;
+
+	if (dist == DIST_EXP) {
+		//Exponential with the mean at a quarter of the range: many small banks, few big ones.
+		u = (random() + 1.0) / ((double)RAND_MAX + 2.0);
+		v = min - (max - min) / 4.0 * log(u);
+		return v > max ? max : v;
+	}
+
+	return min + rand64() % (max - min + 1);
+}
+
+static int compute_layout(uint64_t size, int shift, unsigned int folders)
+{
+	uint32_t bpc, prev = 0;
+
+	l.blocks = size / EMU3_BSIZE;
+	l.start_cluster_list_block = EMU3_START_CLUSTER_LIST_BLOCK;
+	l.root_blocks = (folders + EMU3_ENTRIES_PER_BLOCK - 1) /
+	    EMU3_ENTRIES_PER_BLOCK;
+	if (l.root_blocks < EMU3_MIN_ROOT_BLOCKS)
+		l.root_blocks = EMU3_MIN_ROOT_BLOCKS;
+	l.dir_content_blocks = folders * EMU3_BLOCKS_PER_DIR;
+	if (l.dir_content_blocks < EMU3_MIN_DIR_CONTENT_BLOCKS)
+		l.dir_content_blocks = EMU3_MIN_DIR_CONTENT_BLOCKS;
+
+	if (shift < 0)
+		for (shift = EMU3_MIN_CLUSTER_SHIFT;
+		     (l.blocks >> (shift - 9)) > EMU3_MAX_CLUSTERS; shift++) ;
+	l.cluster_shift = shift;
+	bpc = 1 << (shift - 9);
+
+	//The cluster list size and the data start depend on each other.
+	l.cluster_list_blocks = 1;
+	while (l.cluster_list_blocks != prev) {
+		prev = l.cluster_list_blocks;
+		l.start_root_block = l.start_cluster_list_block +
+		    l.cluster_list_blocks;
+		l.start_dir_content_block = l.start_root_block + l.root_blocks;
+		l.start_data_block = l.start_dir_content_block +
+		    l.dir_content_blocks;
+		if (l.blocks <= l.start_data_block + bpc)
+			return -1;
+		l.clusters = (l.blocks - l.start_data_block) / bpc;
+		l.cluster_list_blocks = (l.clusters * 2 + EMU3_BSIZE - 1) /
+		    EMU3_BSIZE;
+	}
+
+	if (l.clusters > EMU3_MAX_CLUSTERS)
+		return -1;
+
+	return 0;
+}
+
+static void set_name(struct emu3_dentry *e3d, const char *fmt, unsigned int n)
+{
+	char name[EMU3_LENGTH_FILENAME + 1];
+	int len = snprintf(name, sizeof(name), fmt, n);
+
+	memset(e3d->name, ' ', EMU3_LENGTH_FILENAME);
+	memcpy(e3d->name, name, len > EMU3_LENGTH_FILENAME ?
+	       EMU3_LENGTH_FILENAME : len);
+}
+
+//Same encoding as emu3_set_fattrs in the module.
+static void set_fattrs(struct emu3_dentry *e3d, uint64_t size)
+{
+	uint32_t clusters, blocks, bytes, rem;
+
+	if (size == 0) {
+		clusters = 1;
+		blocks = 1;
+		bytes = 0;
+	} else {
+		clusters = size >> l.cluster_shift;
+		rem = size - ((uint64_t) clusters << l.cluster_shift);
+		if (rem)
+			clusters++;
+		blocks = rem / EMU3_BSIZE;
+		bytes = rem % EMU3_BSIZE;
+		if (bytes)
+			blocks++;
+		else if (size == EMU3_BSIZE)
+			bytes = EMU3_BSIZE;
+	}
+
+	e3d->fattrs.clusters = htole16(clusters);
+	e3d->fattrs.blocks = htole16(blocks);
+	e3d->fattrs.bytes = htole16(bytes);
+}
+
+static uint16_t next_free_cluster(enum frag frag, uint16_t *cursor)
+{
+	uint32_t i, c;
+
+	if (frag == FRAG_RANDOM) {
+		c = 1 + random() % (l.clusters - 1);
+		for (i = 1; i < l.clusters; i++) {
+			if (!cluster_list[c])
+				return c;
+			if (++c == l.clusters)
+				c = 1;
+		}
+		return 0;
+	}
+
+	for (c = *cursor; c < l.clusters; c++)
+		if (!cluster_list[c]) {
+			*cursor = c + 1;
+			return c;
+		}
+
+	return 0;
+}
+
+static int alloc_clusters(struct bank *b, uint32_t count, enum frag frag,
+			  uint16_t *cursor)
+{
+	uint16_t c;
+
+	for (; count && b->allocated < b->clusters; count--) {
+		c = next_free_cluster(frag, cursor);
+		if (!c)
+			return -1;
+
+		cluster_list[c] = htole16(EMU_LAST_FILE_CLUSTER);
+		if (b->allocated)
+			cluster_list[b->last] = htole16(c);
+		else
+			b->start = c;
+		b->last = c;
+		b->allocated++;
+	}
+
+	return 0;
+}
+
+static int allocate(enum frag frag, uint32_t chunk)
+{
+	unsigned int i, pending;
+	uint16_t cursor = 1;
+
+	if (frag != FRAG_INTERLEAVE) {
+		for (i = 0; i < nbanks; i++)
+			if (alloc_clusters(&banks[i], banks[i].clusters, frag,
+					   &cursor))
+				return -1;
+		return 0;
+	}
+
+	//Every bank gets chunk clusters in turn, like concurrent writers would do.
+	do {
+		pending = 0;
+		for (i = 0; i < nbanks; i++) {
+			if (alloc_clusters(&banks[i], chunk, frag, &cursor))
+				return -1;
+			if (banks[i].allocated < banks[i].clusters)
+				pending++;
+		}
+	} while (pending);
+
+	return 0;
+}
+
+static void delete_bank(struct bank *b)
+{
+	uint16_t next, c = b->start;
+
+	while (1) {
+		next = le16toh(cluster_list[c]);
+		cluster_list[c] = 0;
+		if (next == EMU_LAST_FILE_CLUSTER)
+			break;
+		c = next;
+	}
+
+	b->dentry->fattrs.type = EMU3_FTYPE_DEL;
+	b->allocated = 0;
+}
+
+static int write_pattern(int fd, struct bank *b, unsigned int n)
+{
+	static uint8_t *buf;
+	uint32_t cs = 1 << l.cluster_shift;
+	uint64_t off, written = 0;
+	uint16_t c = b->start;
+	uint32_t i;
+
+	if (!buf && !(buf = malloc(cs)))
+		return -1;
+
+	while (written < b->size) {
+		//Every 8 bytes hold the bank number and the offset within the bank.
+		for (i = 0; i < cs; i += 8) {
+			*(uint32_t *) & buf[i] = htole32(n);
+			*(uint32_t *) & buf[i + 4] = htole32(written + i);
+		}
+
+		off = ((uint64_t) l.start_data_block +
+		       (uint64_t) (c - 1) * (cs / EMU3_BSIZE)) * EMU3_BSIZE;
+		if (pwrite(fd, buf, cs, off) != cs)
+			return -1;
+
+		written += cs;
+		c = le16toh(cluster_list[c]);
+	}
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int opt, fd, shift = -1, emu4 = 0, pattern = 0, empty_first = 0;
+	uint64_t size = 512ULL << 20, min = 64 << 10, max = 8 << 20;
+	unsigned int folders = 1, banks_per_folder = 10, deleted = 0, seed = 1;
+	unsigned int i, j, k, n, folder_banks;
+	enum frag frag = FRAG_NONE;
+	enum dist dist = DIST_UNIFORM;
+	uint32_t chunk = 1, dcb = 0;
+	struct emu3_dentry *e3d, *folder;
+	uint32_t *params;
+
+	while ((opt = getopt(argc, argv, "s:c:f:b:em:M:d:F:x:r:4p")) != -1) {
+		switch (opt) {
+		case 's':
+			size = parse_size(optarg);
+			break;
+		case 'c':
+			shift = atoi(optarg);
+			break;
+		case 'f':
+			folders = atoi(optarg);
+			break;
+		case 'b':
+			banks_per_folder = atoi(optarg);
+			break;
+		case 'e':
+			empty_first = 1;
+			break;
+		case 'm':
+			min = parse_size(optarg);
+			break;
+		case 'M':
+			max = parse_size(optarg);
+			break;
+		case 'd':
+			if (!strcmp(optarg, "uniform"))
+				dist = DIST_UNIFORM;
+			else if (!strcmp(optarg, "exp"))
+				dist = DIST_EXP;
+			else
+				usage(argv[0]);
+			break;
+		case 'F':
+			if (!strcmp(optarg, "none"))
+				frag = FRAG_NONE;
+			else if (!strcmp(optarg, "random"))
+				frag = FRAG_RANDOM;
+			else if (!strncmp(optarg, "interleave:", 11)) {
+				frag = FRAG_INTERLEAVE;
+				chunk = atoi(optarg + 11);
+				if (!chunk)
+					usage(argv[0]);
+			} else
+				usage(argv[0]);
+			break;
+		case 'x':
+			deleted = atoi(optarg);
+			break;
+		case 'r':
+			seed = atoi(optarg);
+			break;
+		case '4':
+			emu4 = 1;
+			break;
+		case 'p':
+			pattern = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (optind != argc - 1 || banks_per_folder > EMU3_MAX_BANKS
+	    || deleted > 100 || !folders || min > max
+	    || (shift >= 0 && shift < EMU3_MIN_CLUSTER_SHIFT))
+		usage(argv[0]);
+
+	if (compute_layout(size, shift, folders)) {
+		fprintf(stderr,
+			"Invalid layout: the image is too small or has too many clusters\n");
+		return EXIT_FAILURE;
+	}
+
+	srandom(seed);
+
+	meta = calloc(l.start_data_block, EMU3_BSIZE);
+	nbanks = (folders - empty_first) * banks_per_folder;
+	banks = calloc(nbanks ? nbanks : 1, sizeof(struct bank));
+	if (!meta || !banks) {
+		perror("calloc");
+		return EXIT_FAILURE;
+	}
+	cluster_list = (uint16_t *) (meta + l.start_cluster_list_block *
+				     EMU3_BSIZE);
+
+	//Superblock. The bytes after the cluster shift are the ones found on formatted disks.
+	memcpy(meta, "EMU3", 4);
+	params = (uint32_t *) meta;
+	params[1] = htole32(l.blocks - 1);
+	params[2] = htole32(l.start_root_block);
+	params[3] = htole32(l.root_blocks);
+	params[4] = htole32(l.start_dir_content_block);
+	params[5] = htole32(l.dir_content_blocks);
+	params[6] = htole32(l.start_cluster_list_block);
+	params[7] = htole32(l.cluster_list_blocks);
+	params[8] = htole32(l.start_data_block);
+	params[9] = htole32(l.clusters);
+	meta[0x28] = l.cluster_shift - EMU3_MIN_CLUSTER_SHIFT;
+	meta[0x29] = 0x01;
+	meta[0x2d] = 0x08;
+	meta[0x32] = 0x01;
+	meta[0x33] = 0x0d;
+
+	cluster_list[0] = htole16(0x8000);
+
+	//Folders and banks
+	e3d = (struct emu3_dentry *)(meta + l.start_root_block * EMU3_BSIZE);
+	for (i = 0, n = 0; i < folders; i++) {
+		folder = e3d + i;
+		set_name(folder, "Folder %03u", i);
+		folder->id = EMU3_DTYPE_1;
+		for (j = 0; j < EMU3_BLOCKS_PER_DIR; j++)
+			folder->block_list[j] = htole16(EMU3_FREE_DIR_BLOCK);
+
+		//Empty folders get a block, as the ones made with mkdir.
+		folder_banks = i || !empty_first ? banks_per_folder : 0;
+		if (!folder_banks) {
+			if (dcb == l.dir_content_blocks) {
+				fprintf(stderr, "Not enough dir content blocks\n");
+				return EXIT_FAILURE;
+			}
+			folder->block_list[0] =
+			    htole16(l.start_dir_content_block + dcb++);
+		}
+
+		for (j = 0; j < folder_banks; j++, n++) {
+			k = j / EMU3_ENTRIES_PER_BLOCK;
+			if (j % EMU3_ENTRIES_PER_BLOCK == 0) {
+				if (dcb == l.dir_content_blocks) {
+					fprintf(stderr,
+						"Not enough dir content blocks\n");
+					return EXIT_FAILURE;
+				}
+				folder->block_list[k] =
+				    htole16(l.start_dir_content_block + dcb++);
+			}
+
+			banks[n].dentry = (struct emu3_dentry *)(meta +
+								 le16toh
+								 (folder->
+								  block_list
+								  [k]) *
+								 EMU3_BSIZE) +
+			    j % EMU3_ENTRIES_PER_BLOCK;
+			set_name(banks[n].dentry, "Bank %03u", j);
+			banks[n].dentry->id = j;
+			banks[n].dentry->fattrs.type = EMU3_FTYPE_STD;
+			if (emu4)
+				memcpy(banks[n].dentry->fattrs.props, "\0E4B0",
+				       5);
+
+			banks[n].size = bank_size(min, max, dist);
+			banks[n].clusters = banks[n].size ?
+			    (banks[n].size + (1 << l.cluster_shift) - 1) >>
+			    l.cluster_shift : 1;
+			set_fattrs(banks[n].dentry, banks[n].size);
+		}
+	}
+
+	if (allocate(frag, chunk)) {
+		fprintf(stderr, "The banks do not fit in the image\n");
+		return EXIT_FAILURE;
+	}
+
+	for (i = 0; i < nbanks; i++)
+		banks[i].dentry->fattrs.start_cluster = htole16(banks[i].start);
+
+	for (i = 0; i < nbanks * deleted / 100; i++) {
+		n = random() % nbanks;
+		while (!banks[n].allocated)
+			n = (n + 1) % nbanks;
+		delete_bank(&banks[n]);
+	}
+
+	fd = open(argv[optind], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		perror(argv[optind]);
+		return EXIT_FAILURE;
+	}
+
+	if (ftruncate(fd, (off_t) l.blocks * EMU3_BSIZE)
+	    || pwrite(fd, meta, l.start_data_block * EMU3_BSIZE, 0) !=
+	    l.start_data_block * EMU3_BSIZE) {
+		perror(argv[optind]);
+		return EXIT_FAILURE;
+	}
+
+	if (pattern)
+		for (i = 0; i < nbanks; i++)
+			if (banks[i].allocated && write_pattern(fd, &banks[i], i)) {
+				perror(argv[optind]);
+				return EXIT_FAILURE;
+			}
+
+	close(fd);
+
+	printf("%u blocks, %u clusters of %u B, data @ %u, %u banks\n",
+	       l.blocks, l.clusters, 1 << l.cluster_shift, l.start_data_block,
+	       nbanks);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,507 @@
+/*
+ *   emu3-stress.c
+ *   Copyright (C) 2018 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of emu3fs.
+ *
+ *   emu3fs is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   emu3fs is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with emu3fs. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+//Concurrent metadata stress on a mounted emu4 volume.
+//Every thread owns its banks, so it knows where they are and what they
+//contain and any unexpected result is an error of the filesystem.
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+
+#define MAX_THREADS 64
+#define MAX_FOLDERS 32
+#define BANKS_PER_THREAD 6
+#define HIST_BUCKETS 64
+#define IO_MAX (256 * 1024)
+#define BANK_MAX (2 * 1024 * 1024)
+#define XATTR_BNUM "user.bank.number"
+
+enum op {
+	OP_CREATE,
+	OP_WRITE,
+	OP_READ,
+	OP_RENAME,
+	OP_UNLINK,
+	OP_READDIR,
+	OP_SETXATTR,
+	OP_NUM
+};
+
+static const char *const op_names[OP_NUM] = {
+	[OP_CREATE] = "create",
+	[OP_WRITE] = "write",
+	[OP_READ] = "read",
+	[OP_RENAME] = "rename",
+	[OP_UNLINK] = "unlink",
+	[OP_READDIR] = "readdir",
+	[OP_SETXATTR] = "setxattr"
+};
+
+//Relative weights of the operations.
+static const unsigned int op_weights[OP_NUM] = {
+	[OP_CREATE] = 15,
+	[OP_WRITE] = 15,
+	[OP_READ] = 25,
+	[OP_RENAME] = 10,
+	[OP_UNLINK] = 10,
+	[OP_READDIR] = 15,
+	[OP_SETXATTR] = 10
+};
+
+struct bank {
+	int folder;		//-1 if it does not exist
+	off_t size;
+};
+
+struct worker {
+	pthread_t thread;
+	unsigned int id;
+	unsigned int seed;
+	struct bank banks[BANKS_PER_THREAD];
+	uint64_t hist[OP_NUM][HIST_BUCKETS];
+	uint64_t count[OP_NUM];
+	uint64_t nospc;
+	uint64_t errors;
+	unsigned char *buf;
+};
+
+static const char *root;
+static unsigned int nfolders = 4;
+static unsigned int duration = 10;
+static volatile int stop;
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [options] dir\n"
+		"  -t threads   worker threads, up to %d (default: 4)\n"
+		"  -d seconds   duration (default: 10)\n"
+		"  -f folders   folders used, up to %d (default: 4)\n"
+		"  -r seed      random seed (default: 1)\n",
+		prog, MAX_THREADS, MAX_FOLDERS);
+	exit(EXIT_FAILURE);
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+//The content of a bank only depends on its owner, its name and the offset.
+static unsigned char pattern(struct worker *w, unsigned int n, off_t off)
+{
+	return (off * 31 + w->id * 131 + n * 7) & 0xff;
+}
+
+static void path(char *dst, size_t len, unsigned int folder,
+		 struct worker *w, unsigned int n)
+{
+	snprintf(dst, len, "%s/s%02u/t%u-%u", root, folder, w->id, n);
+}
+
+static void error(struct worker *w, const char *op, const char *p, int err)
+{
+	fprintf(stderr, "Thread %u: %s %s: %s\n", w->id, op, p,
+		err ? strerror(err) : "unexpected result");
+	w->errors++;
+}
+
+static int pick_bank(struct worker *w, int present)
+{
+	unsigned int i, n = rand_r(&w->seed) % BANKS_PER_THREAD;
+
+	for (i = 0; i < BANKS_PER_THREAD; i++, n = (n + 1) % BANKS_PER_THREAD)
+		if ((w->banks[n].folder >= 0) == present)
+			return n;
+	return -1;
+}
+
+static void append(struct worker *w, unsigned int n, int fd, const char *p)
+{
+	struct bank *b = &w->banks[n];
+	size_t i, len = 1 + rand_r(&w->seed) % IO_MAX;
+	ssize_t ret;
+
+	if (b->size + len > BANK_MAX)
+		return;
+
+	for (i = 0; i < len; i++)
+		w->buf[i] = pattern(w, n, b->size + i);
+
+	ret = pwrite(fd, w->buf, len, b->size);
+	if (ret < 0 && errno == ENOSPC)
+		w->nospc++;
+	else if (ret < 0)
+		error(w, "write", p, errno);
+	else
+		b->size += ret;
+}
+
+static void op_create(struct worker *w)
+{
+	char p[PATH_MAX];
+	int fd, n = pick_bank(w, 0);
+	unsigned int folder = rand_r(&w->seed) % nfolders;
+
+	if (n < 0)
+		return;
+
+	path(p, sizeof(p), folder, w, n);
+	fd = open(p, O_WRONLY | O_CREAT | O_EXCL, 0644);
+	if (fd < 0) {
+		if (errno == ENOSPC)
+			w->nospc++;
+		else
+			error(w, "create", p, errno);
+		return;
+	}
+
+	w->banks[n].folder = folder;
+	w->banks[n].size = 0;
+	append(w, n, fd, p);
+	close(fd);
+}
+
+static void op_write(struct worker *w)
+{
+	char p[PATH_MAX];
+	int fd, n = pick_bank(w, 1);
+
+	if (n < 0)
+		return;
+
+	path(p, sizeof(p), w->banks[n].folder, w, n);
+	fd = open(p, O_WRONLY);
+	if (fd < 0) {
+		error(w, "open", p, errno);
+		return;
+	}
+	append(w, n, fd, p);
+	close(fd);
+}
+
+static void op_read(struct worker *w)
+{
+	char p[PATH_MAX];
+	struct stat st;
+	off_t off = 0;
+	ssize_t ret, i;
+	size_t len;
+	int fd, n = pick_bank(w, 1);
+
+	if (n < 0)
+		return;
+
+	path(p, sizeof(p), w->banks[n].folder, w, n);
+	fd = open(p, O_RDONLY);
+	if (fd < 0) {
+		error(w, "open", p, errno);
+		return;
+	}
+
+	if (fstat(fd, &st))
+		error(w, "stat", p, errno);
+	else if (st.st_size != w->banks[n].size)
+		error(w, "size of", p, 0);
+	else if (st.st_size) {
+		off = rand_r(&w->seed) % st.st_size;
+		len = st.st_size - off;
+		if (len > IO_MAX)
+			len = IO_MAX;
+		ret = pread(fd, w->buf, len, off);
+		if (ret != len)
+			error(w, "read", p, ret < 0 ? errno : 0);
+		for (i = 0; ret > 0 && i < ret; i++)
+			if (w->buf[i] != pattern(w, n, off + i)) {
+				error(w, "content of", p, 0);
+				break;
+			}
+	}
+	close(fd);
+}
+
+static void op_rename(struct worker *w)
+{
+	char from[PATH_MAX], to[PATH_MAX];
+	int n = pick_bank(w, 1);
+	unsigned int folder = rand_r(&w->seed) % nfolders;
+
+	if (n < 0 || folder == w->banks[n].folder)
+		return;
+
+	path(from, sizeof(from), w->banks[n].folder, w, n);
+	path(to, sizeof(to), folder, w, n);
+	if (rename(from, to)) {
+		if (errno == ENOSPC)
+			w->nospc++;
+		else
+			error(w, "rename", from, errno);
+		return;
+	}
+	w->banks[n].folder = folder;
+}
+
+static void op_unlink(struct worker *w)
+{
+	char p[PATH_MAX];
+	int n = pick_bank(w, 1);
+
+	if (n < 0)
+		return;
+
+	path(p, sizeof(p), w->banks[n].folder, w, n);
+	if (unlink(p))
+		error(w, "unlink", p, errno);
+	w->banks[n].folder = -1;
+}
+
+//Like ls -l. Banks of other threads can disappear in between.
+static void op_readdir(struct worker *w)
+{
+	char p[PATH_MAX];
+	DIR *dir;
+	struct dirent *de;
+	struct stat st;
+
+	snprintf(p, sizeof(p), "%s/s%02u", root, rand_r(&w->seed) % nfolders);
+	dir = opendir(p);
+	if (!dir) {
+		error(w, "opendir", p, errno);
+		return;
+	}
+
+	while ((de = readdir(dir)))
+		if (fstatat(dirfd(dir), de->d_name, &st, AT_SYMLINK_NOFOLLOW)
+		    && errno != ENOENT)
+			error(w, "stat", de->d_name, errno);
+	closedir(dir);
+}
+
+static void op_setxattr(struct worker *w)
+{
+	char p[PATH_MAX], value[8], read[8];
+	ssize_t len;
+	int n = pick_bank(w, 1);
+
+	if (n < 0)
+		return;
+
+	path(p, sizeof(p), w->banks[n].folder, w, n);
+	snprintf(value, sizeof(value), "%d", rand_r(&w->seed) % 100);
+	if (setxattr(p, XATTR_BNUM, value, strlen(value), 0)) {
+		error(w, "setxattr", p, errno);
+		return;
+	}
+
+	len = getxattr(p, XATTR_BNUM, read, sizeof(read) - 1);
+	if (len < 0)
+		error(w, "getxattr", p, errno);
+	else {
+		read[len] = 0;
+		if (strcmp(read, value))
+			error(w, "bank number of", p, 0);
+	}
+}
+
+static void (*const ops[OP_NUM])(struct worker *) = {
+	[OP_CREATE] = op_create,
+	[OP_WRITE] = op_write,
+	[OP_READ] = op_read,
+	[OP_RENAME] = op_rename,
+	[OP_UNLINK] = op_unlink,
+	[OP_READDIR] = op_readdir,
+	[OP_SETXATTR] = op_setxattr
+};
+
+static enum op pick_op(struct worker *w)
+{
+	unsigned int i, total = 0, r;
+
+	for (i = 0; i < OP_NUM; i++)
+		total += op_weights[i];
+	r = rand_r(&w->seed) % total;
+	for (i = 0; r >= op_weights[i]; i++)
+		r -= op_weights[i];
+	return i;
+}
+
+static void *run(void *arg)
+{
+	struct worker *w = arg;
+	uint64_t start, ns;
+	unsigned int bucket;
+	enum op op;
+
+	while (!stop) {
+		op = pick_op(w);
+		start = now_ns();
+		ops[op] (w);
+		ns = now_ns() - start;
+		bucket = ns ? 64 - __builtin_clzll(ns) : 0;
+		w->hist[op][bucket]++;
+		w->count[op]++;
+	}
+
+	return NULL;
+}
+
+//Upper bound of the bucket, as the histograms are in powers of 2.
+static double percentile(const uint64_t *hist, uint64_t count, double p)
+{
+	uint64_t sum = 0, target = count * p;
+	unsigned int i;
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		sum += hist[i];
+		if (sum > target)
+			break;
+	}
+	return (double)(1ULL << i) / 1000;
+}
+
+static void report(struct worker *workers, unsigned int nthreads,
+		   double elapsed)
+{
+	uint64_t hist[OP_NUM + 1][HIST_BUCKETS] = { 0 };
+	uint64_t count[OP_NUM + 1] = { 0 };
+	unsigned int i, j, k;
+	uint64_t nospc = 0;
+
+	for (i = 0; i < nthreads; i++) {
+		nospc += workers[i].nospc;
+		for (j = 0; j < OP_NUM; j++) {
+			count[j] += workers[i].count[j];
+			count[OP_NUM] += workers[i].count[j];
+			for (k = 0; k < HIST_BUCKETS; k++) {
+				hist[j][k] += workers[i].hist[j][k];
+				hist[OP_NUM][k] += workers[i].hist[j][k];
+			}
+		}
+	}
+
+	printf("threads %u, %.1f s, %llu ENOSPC\n", nthreads, elapsed,
+	       (unsigned long long)nospc);
+	printf("%-10s %10s %10s %10s %10s %10s\n", "op", "count", "ops/s",
+	       "p50_us", "p99_us", "p999_us");
+	for (j = 0; j <= OP_NUM; j++) {
+		if (!count[j])
+			continue;
+		printf("%-10s %10llu %10.0f %10.1f %10.1f %10.1f\n",
+		       j == OP_NUM ? "total" : op_names[j],
+		       (unsigned long long)count[j], count[j] / elapsed,
+		       percentile(hist[j], count[j], 0.5),
+		       percentile(hist[j], count[j], 0.99),
+		       percentile(hist[j], count[j], 0.999));
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	struct worker *workers;
+	unsigned int i, j, nthreads = 4, seed = 1;
+	uint64_t start, errors = 0;
+	char p[PATH_MAX];
+	int opt;
+
+	while ((opt = getopt(argc, argv, "t:d:f:r:")) != -1) {
+		switch (opt) {
+		case 't':
+			nthreads = atoi(optarg);
+			break;
+		case 'd':
+			duration = atoi(optarg);
+			break;
+		case 'f':
+			nfolders = atoi(optarg);
+			break;
+		case 'r':
+			seed = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (optind != argc - 1 || nthreads < 1 || nthreads > MAX_THREADS ||
+	    nfolders < 1 || nfolders > MAX_FOLDERS || !duration)
+		usage(argv[0]);
+	root = argv[optind];
+
+	for (i = 0; i < nfolders; i++) {
+		snprintf(p, sizeof(p), "%s/s%02u", root, i);
+		if (mkdir(p, 0755) && errno != EEXIST) {
+			fprintf(stderr, "%s: %s\n", p, strerror(errno));
+			return EXIT_FAILURE;
+		}
+	}
+
+	workers = calloc(nthreads, sizeof(*workers));
+	if (!workers)
+		return EXIT_FAILURE;
+
+	start = now_ns();
+	for (i = 0; i < nthreads; i++) {
+		workers[i].id = i;
+		workers[i].seed = seed * MAX_THREADS + i;
+		for (j = 0; j < BANKS_PER_THREAD; j++)
+			workers[i].banks[j].folder = -1;
+		workers[i].buf = malloc(IO_MAX);
+		if (!workers[i].buf ||
+		    pthread_create(&workers[i].thread, NULL, run, &workers[i])) {
+			fprintf(stderr, "Error while starting the threads\n");
+			return EXIT_FAILURE;
+		}
+	}
+
+	sleep(duration);
+	stop = 1;
+
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(workers[i].thread, NULL);
+		errors += workers[i].errors;
+	}
+
+	report(workers, nthreads, (now_ns() - start) / 1e9);
+
+	for (i = 0; i < nthreads; i++)
+		free(workers[i].buf);
+	free(workers);
+
+	if (errors) {
+		fprintf(stderr, "%llu errors\n", (unsigned long long)errors);
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,97 @@
+#!/usr/bin/env bash
+
+# Concurrency stress and scalability benchmark. For every thread count, a clean
+# image is mounted and emu3-stress runs a mix of create, write, read, rename,
+# unlink, readdir and setxattr on several folders. Banks are checked for size
+# and content on every read. The image is then checked with fsck.emu3 and the
+# kernel log is searched for lockdep, KCSAN and other reports, so it is worth
+# running it on a kernel with CONFIG_PROVE_LOCKING and CONFIG_KCSAN.
+# The outputs and a summary of ops/s and tail latencies per thread count are
+# stored in the results directory.
+#
+# Usage: ./stress.sh
+#
+# Environment:
+#   EMU3_STRESS_THREADS   thread counts to run (default: "1 2 4 8 16")
+#   EMU3_STRESS_DURATION  seconds per thread count (default: 10)
+#   EMU3_STRESS_FOLDERS   folders used by the threads (default: 4)
+#   EMU3_STRESS_IMAGE     emu3-mkimage options for the image, or empty to use
+#                         the test image (default: empty)
+
+[ -z "$EMU3_STRESS_THREADS" ] && EMU3_STRESS_THREADS="1 2 4 8 16"
+[ -z "$EMU3_STRESS_DURATION" ] && EMU3_STRESS_DURATION=10
+[ -z "$EMU3_STRESS_FOLDERS" ] && EMU3_STRESS_FOLDERS=4
+
+EMU3_MOUNTPOINT=stress_mountpoint
+EMU3_STRESS_RESULTS=stress_results
+
+LANG=C
+
+loop=
+
+function cleanUp() {
+  echo "Cleaning up..."
+  mountpoint -q $EMU3_MOUNTPOINT && sudo umount $EMU3_MOUNTPOINT
+  [ -n "$loop" ] && sudo losetup -d $loop
+  loop=
+}
+
+function fail() {
+  echo "Error: $*"
+  cleanUp
+  rmdir $EMU3_MOUNTPOINT
+  exit 1
+}
+
+function buildImage() {
+  if [ -n "$EMU3_STRESS_IMAGE" ]; then
+    ./emu3-mkimage $EMU3_STRESS_IMAGE $1 > /dev/null || fail "emu3-mkimage"
+  else
+    xz -dc image.iso.xz.bak | cp --sparse=always /dev/stdin $1
+  fi
+}
+
+# Lockdep disables itself after its first report.
+function checkKernel() {
+  sudo dmesg | sed -n "/emu3fs: stress $1 start/,\$p" > $2
+  grep -E "BUG:|WARNING:|INFO: task .* blocked|possible circular locking|possible recursive locking|KCSAN|emu3fs: .*(Loop|Bad)" $2 && return 1
+  [ -f /proc/lockdep_stats ] && sudo grep -q "debug_locks: *0" /proc/lockdep_stats && return 1
+  return 0
+}
+
+function runThreads() {
+  name=threads-$1
+  echo "Running $name..."
+
+  image=$EMU3_STRESS_RESULTS/work.iso
+  buildImage $image
+  loop=$(sudo losetup -f --show $image) || fail "losetup"
+  sudo mount -t emu4 $loop $EMU3_MOUNTPOINT || fail "mount"
+  echo "emu3fs: stress $name start" | sudo tee /dev/kmsg > /dev/null
+
+  sudo ./emu3-stress -t $1 -d $EMU3_STRESS_DURATION -f $EMU3_STRESS_FOLDERS $EMU3_MOUNTPOINT | tee $EMU3_STRESS_RESULTS/$name.txt
+  [ ${PIPESTATUS[0]} -eq 0 ] || fail "emu3-stress $name"
+
+  cleanUp
+  ../tools/fsck.emu3 $image > $EMU3_STRESS_RESULTS/$name-fsck.txt || fail "fsck.emu3 $name"
+  checkKernel $name $EMU3_STRESS_RESULTS/$name-dmesg.txt || fail "kernel report during $name"
+  rm $image
+
+  awk -v t=$1 '$1 == "total" { print t, $3, $4, $5, $6 }' $EMU3_STRESS_RESULTS/$name.txt >> $EMU3_STRESS_RESULTS/summary.txt
+}
+
+mkdir -p $EMU3_MOUNTPOINT
+rm -rf $EMU3_STRESS_RESULTS
+mkdir -p $EMU3_STRESS_RESULTS
+
+sudo modprobe emu3_fs || fail "modprobe"
+make -s emu3-mkimage emu3-stress || fail "make"
+make -s -C ../tools fsck.emu3 || fail "make"
+
+echo "threads ops/s p50_us p99_us p999_us" > $EMU3_STRESS_RESULTS/summary.txt
+for threads in $EMU3_STRESS_THREADS; do
+  runThreads $threads
+done
+
+rmdir $EMU3_MOUNTPOINT
+column -t $EMU3_STRESS_RESULTS/summary.txt
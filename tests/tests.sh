@@ -153,6 +153,13 @@ test
 logAndRun '[ "$(< $EMU3_MOUNTPOINT/foo/t1)" == "$(< $EMU3_MOUNTPOINT/foo/t2)" ]'
 test
 
+printTest "Name padding"
+
+logAndRun 'cat "$EMU3_MOUNTPOINT/foo/t1 "'
+test
+logAndRun '[ 123$'\''\n'\''4567 == "$out" ]'
+test
+
 printTest "cp with big files"
 
 logAndRun 'head -c 32M </dev/urandom > t3'
@@ -240,6 +247,10 @@ logAndRun 'head -c 1234567 </dev/urandom > t6'
 logAndRun cp t6 $EMU3_MOUNTPOINT/foo
 test foo/t6
 
+logAndRun 'head -c 512 </dev/urandom > t7'
+logAndRun cp t7 $EMU3_MOUNTPOINT/foo
+test foo/t7
+
 logAndRun '[ $(stat --print "%s" t5) -eq $(stat --print "%s" $EMU3_MOUNTPOINT/foo/t5) ]'
 test
 logAndRun '[ $(stat --print "%s" t6) -eq $(stat --print "%s" $EMU3_MOUNTPOINT/foo/t6) ]'
@@ -274,13 +285,17 @@ logAndRun '[ 1024 -eq $(stat --print "%b" $EMU3_MOUNTPOINT/foo/t5) ]'
 test
 logAndRun '[ 3072 -eq $(stat --print "%b" $EMU3_MOUNTPOINT/foo/t6) ]'
 test
+logAndRun '[ $(stat --print "%s" t7) -eq $(stat --print "%s" $EMU3_MOUNTPOINT/foo/t7) ]'
+test
 
 logAndRun diff t5 $EMU3_MOUNTPOINT/foo/t5
 test
 logAndRun diff t6 $EMU3_MOUNTPOINT/foo/t6
 test
+logAndRun diff t7 $EMU3_MOUNTPOINT/foo/t7
+test
 
-logAndRun rm t5 t6
+logAndRun rm t5 t6 t7
 
 printTest "Directory expansion"
 
@@ -377,6 +392,18 @@ testError d1
 logAndRun mv $EMU3_MOUNTPOINT/d1 $EMU3_MOUNTPOINT/d2
 testError
 
+logAndRun 'echo "abc" > $EMU3_MOUNTPOINT/d1/t3'
+logAndRun mv $EMU3_MOUNTPOINT/d1/t3 $EMU3_MOUNTPOINT/full/error
+testError full
+logAndRun cat $EMU3_MOUNTPOINT/d1/t3
+test d1
+logAndRun mv $EMU3_MOUNTPOINT/d1/t3 $EMU3_MOUNTPOINT/full/f-1
+test full
+logAndRun '[ "$(cat $EMU3_MOUNTPOINT/full/f-1)" = "abc" ]'
+test
+logAndRun ls -li $EMU3_MOUNTPOINT/d1/t3
+testError d1
+
 printTest "Extended attributes (bank number)"
 
 logAndRun 'getfattr -n "user.bank.number" $EMU3_MOUNTPOINT/d2/t2 2> /dev/null | awk -F\" '\''{print $2}'\'''
@@ -416,6 +443,134 @@ testError
 logAndRun setfattr -n "user.bank.number" -v foo $EMU3_MOUNTPOINT/d2/t2
 testError
 
+logAndRun 'getfattr -n "user.emu3.fragments" $EMU3_MOUNTPOINT/d2/t2 2> /dev/null | awk -F\" '\''{print $2}'\'''
+test
+logAndRun '[ $out -ge 1 ]'
+test
+logAndRun getfattr -n "user.emu3.type" $EMU3_MOUNTPOINT/d2/t2
+test
+logAndRun setfattr -n "user.emu3.type" -v 0x80 $EMU3_MOUNTPOINT/d2/t2
+testError
+logAndRun getfattr -n "user.emu3.props" $EMU3_MOUNTPOINT/d2
+testError
+logAndRun "python3 -c 'import ctypes, sys; libc = ctypes.CDLL(None, use_errno=True); buf = ctypes.create_string_buffer(4); sys.exit(0 if libc.getxattr(sys.argv[1].encode(), b\"user.emu3.props\", buf, 4) == -1 and ctypes.get_errno() == 34 else 1)' $EMU3_MOUNTPOINT/d2/t2"
+test
+
+printTest "Mount options"
+
+logAndRun sudo mount -o remount,alloc=next,ra_clusters=4,flush_interval=5 $EMU3_MOUNTPOINT
+test
+logAndRun 'grep "$EMU3_MOUNTPOINT" /proc/mounts | grep -c "alloc=next,ra_clusters=4,flush_interval=5"'
+test
+logAndRun 'cp $EMU3_MOUNTPOINT/d2/t2 $EMU3_MOUNTPOINT/d2/t4 && cmp $EMU3_MOUNTPOINT/d2/t2 $EMU3_MOUNTPOINT/d2/t4'
+test
+logAndRun sudo mount -o remount,ra_clusters=1000 $EMU3_MOUNTPOINT
+testError
+logAndRun sudo mount -o remount,alloc=foo $EMU3_MOUNTPOINT
+testError
+logAndRun sudo mount -o remount,nometacache $EMU3_MOUNTPOINT
+testError
+
+printTest "Statistics"
+
+logAndRun cat /sys/fs/emu3/loop0/clusters_allocated
+test
+logAndRun '[ $out -gt 0 ]'
+test
+logAndRun 'cat /sys/fs/emu3/loop0/create_latency_us | wc -w'
+test
+logAndRun '[ $out -eq 24 ]'
+test
+logAndRun 'sync && echo 2 | sudo tee /proc/sys/vm/drop_caches > /dev/null && ls -l $EMU3_MOUNTPOINT/d2 > /dev/null && cat /sys/fs/emu3/loop0/inodes_prefilled'
+test
+logAndRun '[ $out -gt 0 ]'
+test
+
+printTest "Catalog"
+
+logAndRun make -s -C ../tools emu3-catalog
+test
+logAndRun '../tools/emu3-catalog $EMU3_MOUNTPOINT | wc -l'
+test
+logAndRun '[ $out -eq $(find $EMU3_MOUNTPOINT -mindepth 1 | wc -l) ]'
+test
+logAndRun '../tools/emu3-catalog $EMU3_MOUNTPOINT/d2 | awk '\''{ gsub(/[B.]/, "", $2); print $3, $4, $2 + 0, $NF }'\'' | sort'
+test
+catalog=$out
+logAndRun 'for f in $(ls $EMU3_MOUNTPOINT/d2); do echo $(stat --print "%i %s" $EMU3_MOUNTPOINT/d2/$f) $((10#$(getfattr --only-values -n "user.bank.number" $EMU3_MOUNTPOINT/d2/$f))) \'\''$f\'\''; done | sort'
+logAndRun '[ "$out" = "$catalog" ]'
+test
+logAndRun '[ "$(../tools/emu3-catalog $EMU3_MOUNTPOINT | grep "^d2 ")" = "$(../tools/emu3-catalog $EMU3_MOUNTPOINT/d2)" ]'
+test
+logAndRun "python3 -c 'import fcntl, os, struct, ctypes, sys; fd = os.open(sys.argv[1], os.O_RDONLY | os.O_DIRECTORY); buf = ctypes.create_string_buffer(64); arg = bytearray(struct.pack(\"QII\", ctypes.addressof(buf), 1, 0)); fcntl.ioctl(fd, 0xc010e301, arg); count, total = struct.unpack_from(\"II\", arg, 8); sys.exit(0 if count == 1 and total == int(sys.argv[2]) and buf.raw[:16].rstrip(b\"\\0\").decode() in os.listdir(sys.argv[1]) else 1)' $EMU3_MOUNTPOINT/d2 $(ls $EMU3_MOUNTPOINT/d2 | wc -l)"
+test
+
+printTest "Bank renumbering"
+
+logAndRun make -s -C ../tools emu3-renumber
+test
+logAndRun 'getfattr --only-values -n "user.bank.number" $EMU3_MOUNTPOINT/d2/t2'
+bn2=$out
+logAndRun 'getfattr --only-values -n "user.bank.number" $EMU3_MOUNTPOINT/d2/t4'
+bn4=$out
+logAndRun 'printf "$bn4 t2\n$bn2 t4\n" | ../tools/emu3-renumber $EMU3_MOUNTPOINT/d2'
+test
+logAndRun 'echo $(getfattr --only-values -n "user.bank.number" $EMU3_MOUNTPOINT/d2/t2) $(getfattr --only-values -n "user.bank.number" $EMU3_MOUNTPOINT/d2/t4)'
+logAndRun '[ "$out" = "$bn4 $bn2" ]'
+test
+logAndRun 'printf "50 t2\n50 t4\n" | ../tools/emu3-renumber $EMU3_MOUNTPOINT/d2 2>&1 | grep -c "File exists"'
+test
+logAndRun 'echo $(getfattr --only-values -n "user.bank.number" $EMU3_MOUNTPOINT/d2/t2) $(getfattr --only-values -n "user.bank.number" $EMU3_MOUNTPOINT/d2/t4)'
+logAndRun '[ "$out" = "$bn4 $bn2" ]'
+test
+logAndRun 'echo "50 $(stat --print "%i" $EMU3_MOUNTPOINT/full/f-2)" | ../tools/emu3-renumber -i $EMU3_MOUNTPOINT/d2 2>&1 | grep -c "No such file or directory"'
+test
+logAndRun sudo umount $EMU3_MOUNTPOINT
+logAndRun sudo mount -t emu4 /dev/loop0 $EMU3_MOUNTPOINT
+test
+logAndRun 'echo $(getfattr --only-values -n "user.bank.number" $EMU3_MOUNTPOINT/d2/t2) $(getfattr --only-values -n "user.bank.number" $EMU3_MOUNTPOINT/d2/t4)'
+logAndRun '[ "$out" = "$bn4 $bn2" ]'
+test
+
+printTest "Lazy mounts"
+
+logAndRun 'cat /sys/fs/emu3/loop0/free_extents /sys/fs/emu3/loop0/largest_free_run'
+free_runs=$out
+logAndRun sudo umount $EMU3_MOUNTPOINT
+logAndRun sudo mount -t emu4 -o lazy /dev/loop0 $EMU3_MOUNTPOINT
+testError
+logAndRun sudo mount -t emu4 -o ro,lazy /dev/loop0 $EMU3_MOUNTPOINT
+test
+logAndRun 'cat /sys/fs/emu3/loop0/free_extents /sys/fs/emu3/loop0/largest_free_run'
+logAndRun '[ "$out" = "$free_runs" ]'
+test
+logAndRun 'cat $EMU3_MOUNTPOINT/d2/t2 > /dev/null'
+test
+logAndRun sudo mount -o remount,rw $EMU3_MOUNTPOINT
+testError
+logAndRun sudo umount $EMU3_MOUNTPOINT
+logAndRun sudo mount -t emu4 /dev/loop0 $EMU3_MOUNTPOINT
+test
+
+printTest "Read-only mounts"
+
+logAndRun sudo umount $EMU3_MOUNTPOINT
+logAndRun sudo mount -t emu4 -o ro /dev/loop0 $EMU3_MOUNTPOINT
+test
+logAndRun 'ls $EMU3_MOUNTPOINT/d2 | grep -c "^t[24]$"'
+test
+logAndRun '[ $out -eq 2 ]'
+test
+logAndRun cmp $EMU3_MOUNTPOINT/d2/t2 $EMU3_MOUNTPOINT/d2/t4
+test
+logAndRun sudo mount -o remount,rw $EMU3_MOUNTPOINT
+test
+logAndRun 'echo "456" > $EMU3_MOUNTPOINT/d2/t5'
+logAndRun cat $EMU3_MOUNTPOINT/d2/t5
+test
+logAndRun '[ "456" == "$out" ]'
+test
+
 logAndRun sudo umount $EMU3_MOUNTPOINT
 logAndRun sudo losetup -d /dev/loop0
 echo
@@ -0,0 +1,143 @@
+/*
+ *   emu3-catalog.c
+ *   Copyright (C) 2018 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of emu3fs.
+ *
+ *   emu3fs is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   emu3fs is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with emu3fs. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+//Lists the folders and banks of a mounted volume with a single ioctl.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include "../emu3_ioctl.h"
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [-s] [dir]\n"
+		"  -s  sort the banks of each folder by bank number\n", prog);
+	exit(EXIT_FAILURE);
+}
+
+static int cmp_bank(const void *a, const void *b)
+{
+	const struct emu3_catalog_entry *x = a;
+	const struct emu3_catalog_entry *y = b;
+	int ret;
+
+	if ((x->flags ^ y->flags) & EMU3_CATALOG_FOLDER)
+		return x->flags & EMU3_CATALOG_FOLDER ? -1 : 1;
+	if (x->flags & EMU3_CATALOG_FOLDER)
+		return strncmp(x->name, y->name, EMU3_IOCTL_NAME_LEN);
+	ret = strncmp(x->folder, y->folder, EMU3_IOCTL_NAME_LEN);
+	if (ret)
+		return ret;
+	return x->id - y->id;
+}
+
+//The volume might change between both calls so the size is asked again until it fits.
+static int get_catalog(int fd, struct emu3_catalog *cat)
+{
+	struct emu3_catalog_entry *entries = NULL, *tmp;
+
+	cat->count = 0;
+	cat->entries = 0;
+	while (1) {
+		if (ioctl(fd, EMU3_IOC_CATALOG, cat)) {
+			free(entries);
+			return -errno;
+		}
+		if (cat->count == cat->total)
+			return 0;
+
+		tmp = realloc(entries, cat->total * sizeof(*entries));
+		if (!tmp) {
+			free(entries);
+			return -ENOMEM;
+		}
+		entries = tmp;
+		cat->entries = (uintptr_t) entries;
+		cat->count = cat->total;
+	}
+}
+
+static void print(const struct emu3_catalog_entry *e)
+{
+	char bank[8];
+
+	if (e->flags & EMU3_CATALOG_FOLDER)
+		snprintf(bank, sizeof(bank), "D");
+	else if (e->id < 100)
+		snprintf(bank, sizeof(bank), " B%02d ", e->id);
+	else
+		snprintf(bank, sizeof(bank), ".%3d ", e->id);
+
+	printf("%-16.16s %5s %9llu %10llu %5u %4u 0x%02x '%.16s'\n", e->folder,
+	       bank, (unsigned long long)e->ino, (unsigned long long)e->size,
+	       e->clusters, e->fragments, e->type, e->name);
+}
+
+int main(int argc, char *argv[])
+{
+	struct emu3_catalog cat;
+	struct emu3_catalog_entry *entries;
+	const char *dir = ".";
+	int opt, fd, err, sort = 0;
+	unsigned int i;
+
+	while ((opt = getopt(argc, argv, "s")) != -1) {
+		switch (opt) {
+		case 's':
+			sort = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (optind < argc - 1)
+		usage(argv[0]);
+	if (optind == argc - 1)
+		dir = argv[optind];
+
+	fd = open(dir, O_RDONLY | O_DIRECTORY);
+	if (fd < 0) {
+		fprintf(stderr, "%s: %s\n", dir, strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	err = get_catalog(fd, &cat);
+	close(fd);
+	if (err) {
+		fprintf(stderr, "%s: %s\n", dir, strerror(-err));
+		return EXIT_FAILURE;
+	}
+
+	entries = (struct emu3_catalog_entry *)(uintptr_t) cat.entries;
+	if (sort)
+		qsort(entries, cat.count, sizeof(*entries), cmp_bank);
+	for (i = 0; i < cat.count; i++)
+		print(&entries[i]);
+	free(entries);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,335 @@
+/*
+ *   emu3-extract.c
+ *   Copyright (C) 2018 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of emu3fs.
+ *
+ *   emu3fs is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   emu3fs is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with emu3fs. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+//Extracts every bank of an image without mounting it.
+//The metadata is read from a shared mapping of the image and the data is
+//copied in the kernel with copy_file_range, falling back to writing the mapped
+//regions when the filesystems do not support it.
+
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "libemu3.h"
+
+#define EMU3_MAX_THREADS 64
+
+struct job {
+	const struct emu3_dentry *dir;
+	const struct emu3_dentry *file;
+	char dir_name[EMU3_LENGTH_FILENAME + 1];
+};
+
+struct extractor {
+	struct emu3_image img;
+	const char *dest;
+	int dest_fd;
+	struct job *jobs;
+	unsigned int njobs;
+	unsigned int max_jobs;
+	atomic_uint next;
+	atomic_uint errors;
+	atomic_ullong bytes;
+	int list;
+};
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [-j threads] image dest\n"
+		"       %s -l image\n"
+		"  -j threads  worker threads (default: online CPUs)\n"
+		"  -l          list the banks instead of extracting them\n",
+		prog, prog);
+	exit(EXIT_FAILURE);
+}
+
+//Image names become path components, so the ones that would not name an entry
+//inside their folder are replaced.
+static void path_name(const struct emu3_dentry *e3d, char *name)
+{
+	emu3_file_name(e3d, name);
+	if (!name[0] || !strcmp(name, ".") || !strcmp(name, ".."))
+		strcpy(name, "unnamed");
+}
+
+static int add_job(struct emu3_image *img, const struct emu3_dentry *dir,
+		   const struct emu3_dentry *file, void *arg)
+{
+	struct extractor *ex = arg;
+	struct job *tmp;
+
+	if (ex->njobs == ex->max_jobs) {
+		ex->max_jobs = ex->max_jobs ? ex->max_jobs * 2 : 256;
+		tmp = realloc(ex->jobs, ex->max_jobs * sizeof(struct job));
+		if (!tmp)
+			return -ENOMEM;
+		ex->jobs = tmp;
+	}
+
+	ex->jobs[ex->njobs].dir = dir;
+	ex->jobs[ex->njobs].file = file;
+	path_name(dir, ex->jobs[ex->njobs].dir_name);
+	ex->njobs++;
+
+	return 0;
+}
+
+static int copy_extent(struct extractor *ex, int out,
+		       const struct emu3_extent *e)
+{
+	loff_t in_off = e->offset;
+	uint64_t done = 0;
+	ssize_t ret;
+	long page = sysconf(_SC_PAGESIZE);
+	uint64_t start = e->offset & ~(page - 1);
+
+	madvise(ex->img.map + start, e->offset + e->length - start,
+		MADV_SEQUENTIAL | MADV_WILLNEED);
+
+	while (done < e->length) {
+		ret = copy_file_range(ex->img.fd, &in_off, out, NULL,
+				      e->length - done, 0);
+		if (ret > 0) {
+			done += ret;
+			continue;
+		}
+		if (ret == 0)
+			return -EIO;
+		if (errno != EXDEV && errno != EINVAL && errno != ENOSYS
+		    && errno != EOPNOTSUPP)
+			return -errno;
+		break;
+	}
+
+	while (done < e->length) {
+		ret = write(out, ex->img.map + e->offset + done,
+			    e->length - done);
+		if (ret < 0)
+			return -errno;
+		done += ret;
+	}
+
+	return 0;
+}
+
+//Repeated names are allowed in the same folder, so the bank number is appended
+//to the repeated ones. Folders can share a name too, so their slot in the root
+//is appended if that is not enough either. Nothing is ever overwritten.
+static int create_file(struct extractor *ex, struct job *j)
+{
+	char name[EMU3_LENGTH_FILENAME + 1];
+	char path[PATH_MAX];
+	const struct emu3_dentry *root = (const struct emu3_dentry *)
+	    EMU3_IMAGE_BLOCK(&ex->img, ex->img.start_root_block);
+	int fd;
+
+	path_name(j->file, name);
+	snprintf(path, PATH_MAX, "%s/%s", j->dir_name, name);
+	fd = openat(ex->dest_fd, path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+	if (fd < 0 && errno == EEXIST) {
+		snprintf(path, PATH_MAX, "%s/%s.%u", j->dir_name, name,
+			 j->file->id);
+		fd = openat(ex->dest_fd, path, O_WRONLY | O_CREAT | O_EXCL,
+			    0644);
+	}
+	if (fd < 0 && errno == EEXIST) {
+		snprintf(path, PATH_MAX, "%s/%s.%u.%td", j->dir_name, name,
+			 j->file->id, j->dir - root);
+		fd = openat(ex->dest_fd, path, O_WRONLY | O_CREAT | O_EXCL,
+			    0644);
+	}
+	if (fd < 0)
+		fprintf(stderr, "%s/%s: %s\n", ex->dest, path, strerror(errno));
+
+	return fd;
+}
+
+static int extract(struct extractor *ex, struct job *j)
+{
+	struct emu3_extent *extents;
+	uint64_t size = emu3_file_size(&ex->img, j->file);
+	int i, n, fd, err = 0;
+
+	n = emu3_file_extents(&ex->img, j->file, &extents);
+	if (n < 0) {
+		fprintf(stderr, "%s: bad cluster chain for bank %u\n",
+			j->dir_name, j->file->id);
+		return n;
+	}
+
+	fd = create_file(ex, j);
+	if (fd < 0) {
+		free(extents);
+		return -errno;
+	}
+
+	for (i = 0; i < n && !err; i++)
+		err = copy_extent(ex, fd, &extents[i]);
+
+	if (!err && ftruncate(fd, size))
+		err = -errno;
+	if (close(fd) && !err)
+		err = -errno;
+	free(extents);
+
+	if (err)
+		fprintf(stderr, "%s: bank %u: %s\n", j->dir_name, j->file->id,
+			strerror(-err));
+	else
+		ex->bytes += size;
+
+	return err;
+}
+
+static void *worker(void *arg)
+{
+	struct extractor *ex = arg;
+	unsigned int i;
+
+	while ((i = atomic_fetch_add(&ex->next, 1)) < ex->njobs)
+		if (extract(ex, &ex->jobs[i]))
+			ex->errors++;
+
+	return NULL;
+}
+
+static void list(struct extractor *ex)
+{
+	struct emu3_extent *extents;
+	char name[EMU3_LENGTH_FILENAME + 1];
+	unsigned int i;
+	int n;
+
+	for (i = 0; i < ex->njobs; i++) {
+		emu3_file_name(ex->jobs[i].file, name);
+		n = emu3_file_extents(&ex->img, ex->jobs[i].file, &extents);
+		free(extents);
+		printf("%-16s %3u %-16s %10llu %4d\n", ex->jobs[i].dir_name,
+		       ex->jobs[i].file->id, name,
+		       (unsigned long long)emu3_file_size(&ex->img,
+							  ex->jobs[i].file),
+		       n);
+	}
+}
+
+//Everything is created relative to dest.
+static int make_dirs(struct extractor *ex)
+{
+	unsigned int i;
+
+	if (mkdir(ex->dest, 0755) && errno != EEXIST)
+		goto err;
+
+	ex->dest_fd = open(ex->dest, O_RDONLY | O_DIRECTORY);
+	if (ex->dest_fd < 0)
+		goto err;
+
+	for (i = 0; i < ex->njobs; i++) {
+		if (i && ex->jobs[i].dir == ex->jobs[i - 1].dir)
+			continue;
+		if (mkdirat(ex->dest_fd, ex->jobs[i].dir_name, 0755) &&
+		    errno != EEXIST)
+			goto err;
+	}
+
+	return 0;
+
+err:
+	fprintf(stderr, "%s: %s\n", ex->dest, strerror(errno));
+	return -errno;
+}
+
+int main(int argc, char *argv[])
+{
+	struct extractor ex = { 0 };
+	pthread_t threads[EMU3_MAX_THREADS];
+	long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	int opt, err, i;
+
+	while ((opt = getopt(argc, argv, "j:l")) != -1) {
+		switch (opt) {
+		case 'j':
+			nthreads = atoi(optarg);
+			break;
+		case 'l':
+			ex.list = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (optind != argc - (ex.list ? 1 : 2) || nthreads < 1)
+		usage(argv[0]);
+	if (nthreads > EMU3_MAX_THREADS)
+		nthreads = EMU3_MAX_THREADS;
+
+	err = emu3_image_open(&ex.img, argv[optind], 0);
+	if (err) {
+		fprintf(stderr, "%s: %s\n", argv[optind], strerror(-err));
+		return EXIT_FAILURE;
+	}
+
+	err = emu3_image_walk(&ex.img, add_job, &ex);
+	if (err) {
+		fprintf(stderr, "%s: %s\n", argv[optind], strerror(-err));
+		return EXIT_FAILURE;
+	}
+
+	if (ex.list) {
+		list(&ex);
+		return EXIT_SUCCESS;
+	}
+
+	ex.dest = argv[optind + 1];
+	if (make_dirs(&ex))
+		return EXIT_FAILURE;
+
+	if (nthreads > ex.njobs)
+		nthreads = ex.njobs ? ex.njobs : 1;
+	for (i = 0; i < nthreads; i++)
+		if (pthread_create(&threads[i], NULL, worker, &ex)) {
+			nthreads = i;
+			ex.errors++;
+			break;
+		}
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+
+	printf("%u banks, %llu bytes extracted, %u errors\n", ex.njobs,
+	       (unsigned long long)ex.bytes, (unsigned int)ex.errors);
+
+	close(ex.dest_fd);
+	emu3_image_close(&ex.img);
+	free(ex.jobs);
+
+	return ex.errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,135 @@
+/*
+ *   emu3-renumber.c
+ *   Copyright (C) 2018 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of emu3fs.
+ *
+ *   emu3fs is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   emu3fs is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with emu3fs. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+//Changes the bank numbers of a folder of a mounted volume in a single ioctl.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include "../emu3_ioctl.h"
+
+#define MAX_ENTRIES 112
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [-i] [dir]\n"
+		"Reads '<bank number> <name>' lines from the standard input.\n"
+		"  -i  read '<bank number> <inode>' lines instead\n", prog);
+	exit(EXIT_FAILURE);
+}
+
+//Names are resolved in the folder so a repeated name is the one the kernel finds.
+static int parse(int fd, char *line, int by_ino,
+		 struct emu3_renumber_entry *e)
+{
+	char *name, *end;
+	struct stat st;
+	unsigned long id;
+
+	line[strcspn(line, "\n")] = 0;
+	errno = 0;
+	id = strtoul(line, &end, 10);
+	if (errno || end == line || *end != ' ' || id > UINT8_MAX)
+		return -EINVAL;
+	name = end + 1;
+
+	if (by_ino) {
+		e->ino = strtoull(name, &end, 10);
+		if (errno || end == name || *end)
+			return -EINVAL;
+	} else {
+		if (fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW))
+			return -errno;
+		e->ino = st.st_ino;
+	}
+	e->id = id;
+	e->pad = 0;
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct emu3_renumber ren;
+	struct emu3_renumber_entry entries[MAX_ENTRIES];
+	const char *dir = ".";
+	char line[256];
+	int opt, fd, err, by_ino = 0;
+	unsigned int n = 0, lineno = 0;
+
+	while ((opt = getopt(argc, argv, "i")) != -1) {
+		switch (opt) {
+		case 'i':
+			by_ino = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (optind < argc - 1)
+		usage(argv[0]);
+	if (optind == argc - 1)
+		dir = argv[optind];
+
+	fd = open(dir, O_RDONLY | O_DIRECTORY);
+	if (fd < 0) {
+		fprintf(stderr, "%s: %s\n", dir, strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	while (fgets(line, sizeof(line), stdin)) {
+		lineno++;
+		if (line[0] == '\n' || line[0] == '#')
+			continue;
+		if (n == MAX_ENTRIES) {
+			fprintf(stderr, "Too many banks\n");
+			goto err;
+		}
+		err = parse(fd, line, by_ino, &entries[n]);
+		if (err) {
+			fprintf(stderr, "Line %u: %s\n", lineno, strerror(-err));
+			goto err;
+		}
+		n++;
+	}
+
+	ren.entries = (uintptr_t) entries;
+	ren.count = n;
+	ren.pad = 0;
+	if (ioctl(fd, EMU3_IOC_RENUMBER, &ren)) {
+		fprintf(stderr, "%s: %s\n", dir, strerror(errno));
+		goto err;
+	}
+
+	close(fd);
+	return EXIT_SUCCESS;
+
+ err:
+	close(fd);
+	return EXIT_FAILURE;
+}
@@ -0,0 +1,525 @@
+/*
+ *   fsck.emu3.c
+ *   Copyright (C) 2018 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of emu3fs.
+ *
+ *   emu3fs is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   emu3fs is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with emu3fs. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+//Checks and optionally repairs an image.
+//Every cluster has an owner, set atomically by the first chain that reaches it,
+//so looping and cross-linked chains are found while walking them and every
+//cluster is visited once. Folders are checked in parallel.
+
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "libemu3.h"
+
+#define EMU3_MAX_THREADS 64
+
+//Exit codes as in fsck(8)
+#define FSCK_OK 0
+#define FSCK_CORRECTED 1
+#define FSCK_UNCORRECTED 4
+#define FSCK_ERROR 8
+
+enum chain_state {
+	CHAIN_OK,
+	CHAIN_BAD_LINK,		//Out of range or free cluster in the chain
+	CHAIN_LOOP,
+	CHAIN_CROSS,		//Cluster already owned by another file
+	CHAIN_LENGTH		//Chain length not matching the file attributes
+};
+
+static const char *chain_state_str[] = {
+	"ok", "bad link", "loop", "cross-linked", "wrong length"
+};
+
+struct file {
+	struct emu3_dentry *e3d;
+	unsigned int folder;
+	unsigned int len;	//Clusters owned
+	uint16_t last;		//Last cluster owned
+	uint16_t other;		//Owner of the cross-linked cluster
+	enum chain_state state;
+};
+
+struct folder {
+	struct emu3_dentry *e3d;
+	unsigned int first_file;
+	unsigned int files;
+};
+
+struct fsck {
+	struct emu3_image img;
+	uint16_t *cluster_list;
+	struct folder *folders;
+	unsigned int nfolders;
+	struct file *files;
+	unsigned int nfiles;
+	unsigned int max_files;
+	atomic_uint *owner;	//File index + 1 or 0
+	atomic_uint next;
+	atomic_uint problems;
+	unsigned int fixed;
+	int repair;
+	int verbose;
+};
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [-r] [-v] [-j threads] image\n"
+		"  -r          repair the problems found\n"
+		"  -v          show every file checked\n"
+		"  -j threads  worker threads (default: online CPUs)\n", prog);
+	exit(FSCK_ERROR);
+}
+
+static void report(struct fsck *fsck, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+static void report(struct fsck *fsck, const char *fmt, ...)
+{
+	va_list ap;
+	char msg[256];
+
+	va_start(ap, fmt);
+	vsnprintf(msg, sizeof(msg), fmt, ap);
+	va_end(ap);
+
+	printf("%s\n", msg);
+	fsck->problems++;
+}
+
+static const char *name(const struct emu3_dentry *e3d, char *buf)
+{
+	emu3_file_name(e3d, buf);
+	return buf;
+}
+
+static int add_file(struct fsck *fsck, struct emu3_dentry *e3d,
+		    unsigned int folder)
+{
+	struct file *tmp;
+
+	if (fsck->nfiles == fsck->max_files) {
+		fsck->max_files = fsck->max_files ? fsck->max_files * 2 : 256;
+		tmp = realloc(fsck->files, fsck->max_files * sizeof(*tmp));
+		if (!tmp)
+			return -ENOMEM;
+		fsck->files = tmp;
+	}
+
+	memset(&fsck->files[fsck->nfiles], 0, sizeof(struct file));
+	fsck->files[fsck->nfiles].e3d = e3d;
+	fsck->files[fsck->nfiles].folder = folder;
+	fsck->nfiles++;
+
+	return 0;
+}
+
+//Removes the block list entries from position i.
+static void cut_block_list(struct fsck *fsck, struct emu3_dentry *dir, int i)
+{
+	if (!fsck->repair)
+		return;
+
+	for (; i < EMU3_BLOCKS_PER_DIR; i++)
+		dir->dattrs.block_list[i] = htole16(EMU3_FREE_DIR_BLOCK);
+	fsck->fixed++;
+}
+
+//Checks the block lists of the folders, as the files are found through them.
+//A dir content block can only belong to one folder.
+static int check_folders(struct fsck *fsck)
+{
+	struct emu3_image *img = &fsck->img;
+	struct emu3_dentry *dir, *e3d;
+	unsigned int *block_owner;
+	unsigned int i, j, k, slots, index;
+	uint16_t blknum, expected;
+	char buf[EMU3_LENGTH_FILENAME + 1], obuf[EMU3_LENGTH_FILENAME + 1];
+	int err;
+
+	slots = img->root_blocks * EMU3_ENTRIES_PER_BLOCK;
+	fsck->folders = calloc(slots, sizeof(struct folder));
+	block_owner = calloc(img->dir_content_blocks, sizeof(unsigned int));
+	if (!fsck->folders || !block_owner)
+		return -ENOMEM;
+
+	dir = (struct emu3_dentry *)EMU3_IMAGE_BLOCK(img,
+						     img->start_root_block);
+
+	//The module rewrites the first folder blocks at mount. See emu3_fix_first_dir_blocks.
+	for (j = 0; EMU3_DENTRY_IS_DIR(dir) && j < EMU3_BLOCKS_PER_DIR; j++) {
+		blknum = le16toh(dir->dattrs.block_list[j]);
+		if (blknum == EMU3_FREE_DIR_BLOCK)
+			break;
+		expected = img->start_dir_content_block + j;
+		if (blknum != expected) {
+			report(fsck,
+			       "Folder '%s': block %u is 0x%04x instead of 0x%04x",
+			       name(dir, buf), j, blknum, expected);
+			if (fsck->repair) {
+				dir->dattrs.block_list[j] = htole16(expected);
+				fsck->fixed++;
+			}
+		}
+	}
+
+	for (i = 0; i < slots; i++, dir++) {
+		if (!EMU3_DENTRY_IS_DIR(dir))
+			continue;
+
+		index = fsck->nfolders++;
+		fsck->folders[index].e3d = dir;
+		fsck->folders[index].first_file = fsck->nfiles;
+
+		for (j = 0; j < EMU3_BLOCKS_PER_DIR; j++) {
+			blknum = le16toh(dir->dattrs.block_list[j]);
+			if (blknum == EMU3_FREE_DIR_BLOCK)
+				break;
+
+			if (blknum < img->start_dir_content_block ||
+			    blknum >= img->start_dir_content_block +
+			    img->dir_content_blocks) {
+				report(fsck,
+				       "Folder '%s': block 0x%04x out of the dir content area",
+				       name(dir, buf), blknum);
+				cut_block_list(fsck, dir, j);
+				break;
+			}
+
+			k = blknum - img->start_dir_content_block;
+			if (block_owner[k]) {
+				report(fsck,
+				       "Folder '%s': block 0x%04x also used by folder '%s'",
+				       name(dir, buf), blknum,
+				       name(fsck->folders[block_owner[k] -
+							  1].e3d, obuf));
+				cut_block_list(fsck, dir, j);
+				break;
+			}
+			block_owner[k] = index + 1;
+
+			e3d = (struct emu3_dentry *)EMU3_IMAGE_BLOCK(img,
+								     blknum);
+			for (k = 0; k < EMU3_ENTRIES_PER_BLOCK; k++, e3d++) {
+				if (!EMU3_DENTRY_IS_FILE(e3d))
+					continue;
+				err = add_file(fsck, e3d, index);
+				if (err) {
+					free(block_owner);
+					return err;
+				}
+			}
+		}
+
+		//The list ends at the first free block.
+		for (k = j + 1; j < EMU3_BLOCKS_PER_DIR &&
+		     le16toh(dir->dattrs.block_list[j]) == EMU3_FREE_DIR_BLOCK
+		     && k < EMU3_BLOCKS_PER_DIR; k++)
+			if (le16toh(dir->dattrs.block_list[k]) !=
+			    EMU3_FREE_DIR_BLOCK) {
+				report(fsck,
+				       "Folder '%s': blocks after the end of the block list",
+				       name(dir, buf));
+				cut_block_list(fsck, dir, j);
+				break;
+			}
+
+		fsck->folders[index].files = fsck->nfiles -
+		    fsck->folders[index].first_file;
+	}
+
+	free(block_owner);
+	return 0;
+}
+
+static void check_chain(struct fsck *fsck, unsigned int index)
+{
+	struct emu3_image *img = &fsck->img;
+	struct file *f = &fsck->files[index];
+	uint16_t next, cluster = le16toh(f->e3d->fattrs.start_cluster);
+	unsigned int owner;
+
+	f->state = CHAIN_OK;
+	while (1) {
+		if (cluster < 1 || cluster >= img->clusters) {
+			f->state = CHAIN_BAD_LINK;
+			break;
+		}
+
+		owner = 0;
+		if (!atomic_compare_exchange_strong(&fsck->owner[cluster],
+						    &owner, index + 1)) {
+			f->state = owner == index + 1 ? CHAIN_LOOP :
+			    CHAIN_CROSS;
+			f->other = owner - 1;
+			break;
+		}
+
+		f->len++;
+		f->last = cluster;
+
+		next = le16toh(fsck->cluster_list[cluster]);
+		if (next == EMU_LAST_FILE_CLUSTER)
+			break;
+		cluster = next;
+	}
+
+	if (f->state == CHAIN_OK && f->len != le16toh(f->e3d->fattrs.clusters))
+		f->state = CHAIN_LENGTH;
+}
+
+static void check_folder(struct fsck *fsck, struct folder *folder)
+{
+	unsigned char ids[EMU3_MAX_FILES_PER_DIR] = { 0 };
+	char dbuf[EMU3_LENGTH_FILENAME + 1], fbuf[EMU3_LENGTH_FILENAME + 1];
+	struct emu3_image *img = &fsck->img;
+	struct file *f;
+	unsigned int i;
+
+	for (i = 0; i < folder->files; i++) {
+		f = &fsck->files[folder->first_file + i];
+		check_chain(fsck, folder->first_file + i);
+
+		if (fsck->verbose)
+			printf("%s/%s: bank %u, %u clusters, %s\n",
+			       name(folder->e3d, dbuf), name(f->e3d, fbuf),
+			       f->e3d->id, f->len, chain_state_str[f->state]);
+
+		if (f->state != CHAIN_OK && f->state != CHAIN_CROSS)
+			report(fsck, "%s/%s: %s chain (%u of %u clusters)",
+			       name(folder->e3d, dbuf), name(f->e3d, fbuf),
+			       chain_state_str[f->state], f->len,
+			       le16toh(f->e3d->fattrs.clusters));
+
+		if (le16toh(f->e3d->fattrs.blocks) > img->blocks_per_cluster)
+			report(fsck, "%s/%s: %u blocks in the last cluster",
+			       name(folder->e3d, dbuf), name(f->e3d, fbuf),
+			       le16toh(f->e3d->fattrs.blocks));
+
+		//Devices only show the first bank with a given number.
+		if (ids[f->e3d->id]++)
+			printf("%s/%s: repeated bank number %u\n",
+			       name(folder->e3d, dbuf), name(f->e3d, fbuf),
+			       f->e3d->id);
+	}
+}
+
+static void *worker(void *arg)
+{
+	struct fsck *fsck = arg;
+	unsigned int i;
+
+	while ((i = atomic_fetch_add(&fsck->next, 1)) < fsck->nfolders)
+		check_folder(fsck, &fsck->folders[i]);
+
+	return NULL;
+}
+
+//Cross links are reported once both chains are known, as the owner might still be walking its chain.
+static void check_cross_links(struct fsck *fsck)
+{
+	char fdbuf[EMU3_LENGTH_FILENAME + 1], fbuf[EMU3_LENGTH_FILENAME + 1];
+	char odbuf[EMU3_LENGTH_FILENAME + 1], obuf[EMU3_LENGTH_FILENAME + 1];
+	struct file *f, *o;
+	unsigned int i;
+
+	for (i = 0; i < fsck->nfiles; i++) {
+		f = &fsck->files[i];
+		if (f->state != CHAIN_CROSS)
+			continue;
+		o = &fsck->files[f->other];
+		report(fsck, "%s/%s: cross-linked with %s/%s after %u clusters",
+		       name(fsck->folders[f->folder].e3d, fdbuf),
+		       name(f->e3d, fbuf),
+		       name(fsck->folders[o->folder].e3d, odbuf),
+		       name(o->e3d, obuf), f->len);
+	}
+}
+
+//Clusters in use without an owner are leaked. Runs are followed as the scan
+//goes since repairing frees the previous cluster.
+static void check_orphans(struct fsck *fsck)
+{
+	unsigned int i, orphans = 0, runs = 0, in_run = 0;
+
+	for (i = 1; i < fsck->img.clusters; i++) {
+		if (!fsck->cluster_list[i] || fsck->owner[i]) {
+			in_run = 0;
+			continue;
+		}
+		if (!in_run)
+			runs++;
+		in_run = 1;
+		orphans++;
+		if (fsck->repair)
+			fsck->cluster_list[i] = 0;
+	}
+
+	if (orphans) {
+		report(fsck, "%u orphaned clusters in %u runs", orphans, runs);
+		if (fsck->repair)
+			fsck->fixed++;
+	}
+}
+
+//Frees the clusters of the chain owned by f after the n first ones.
+static void free_tail(struct fsck *fsck, struct file *f, unsigned int n)
+{
+	uint16_t next, cluster = le16toh(f->e3d->fattrs.start_cluster);
+	unsigned int i;
+
+	for (i = 1; i < n; i++)
+		cluster = le16toh(fsck->cluster_list[cluster]);
+
+	next = le16toh(fsck->cluster_list[cluster]);
+	fsck->cluster_list[cluster] = htole16(EMU_LAST_FILE_CLUSTER);
+	for (i = n; i < f->len; i++) {
+		cluster = next;
+		next = le16toh(fsck->cluster_list[cluster]);
+		fsck->cluster_list[cluster] = 0;
+	}
+	f->len = n;
+}
+
+//Broken chains are cut after the last cluster owned by the file and the
+//size is set to the clusters kept. Files without clusters are deleted.
+static void repair_files(struct fsck *fsck)
+{
+	struct file *f;
+	unsigned int i, clusters;
+
+	for (i = 0; i < fsck->nfiles; i++) {
+		f = &fsck->files[i];
+		if (f->state == CHAIN_OK)
+			continue;
+
+		if (!f->len) {
+			f->e3d->fattrs.type = EMU3_FTYPE_DEL;
+			fsck->fixed++;
+			continue;
+		}
+
+		clusters = le16toh(f->e3d->fattrs.clusters);
+		if (f->state == CHAIN_LENGTH && f->len > clusters) {
+			free_tail(fsck, f, clusters);
+			fsck->fixed++;
+			continue;
+		}
+
+		fsck->cluster_list[f->last] = htole16(EMU_LAST_FILE_CLUSTER);
+		f->e3d->fattrs.clusters = htole16(f->len);
+		f->e3d->fattrs.blocks = 0;
+		f->e3d->fattrs.bytes = 0;
+		fsck->fixed++;
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	struct fsck fsck = { 0 };
+	pthread_t threads[EMU3_MAX_THREADS];
+	long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	int opt, err, i;
+
+	while ((opt = getopt(argc, argv, "rvj:")) != -1) {
+		switch (opt) {
+		case 'r':
+			fsck.repair = 1;
+			break;
+		case 'v':
+			fsck.verbose = 1;
+			break;
+		case 'j':
+			nthreads = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (optind != argc - 1 || nthreads < 1)
+		usage(argv[0]);
+	if (nthreads > EMU3_MAX_THREADS)
+		nthreads = EMU3_MAX_THREADS;
+
+	err = emu3_image_open(&fsck.img, argv[optind], fsck.repair);
+	if (err) {
+		fprintf(stderr, "%s: %s\n", argv[optind], strerror(-err));
+		return FSCK_ERROR;
+	}
+
+	fsck.cluster_list = (uint16_t *)
+	    EMU3_IMAGE_BLOCK(&fsck.img, fsck.img.start_cluster_list_block);
+	fsck.owner = calloc(fsck.img.clusters, sizeof(atomic_uint));
+	if (!fsck.owner) {
+		fprintf(stderr, "%s\n", strerror(ENOMEM));
+		return FSCK_ERROR;
+	}
+
+	err = check_folders(&fsck);
+	if (err) {
+		fprintf(stderr, "%s\n", strerror(-err));
+		return FSCK_ERROR;
+	}
+
+	if (nthreads > fsck.nfolders)
+		nthreads = fsck.nfolders ? fsck.nfolders : 1;
+	for (i = 0; i < nthreads; i++)
+		if (pthread_create(&threads[i], NULL, worker, &fsck)) {
+			nthreads = i;
+			break;
+		}
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+
+	//Folders left by a failed thread creation.
+	worker(&fsck);
+
+	check_cross_links(&fsck);
+	check_orphans(&fsck);
+
+	if (fsck.repair) {
+		repair_files(&fsck);
+		err = emu3_image_sync(&fsck.img);
+		if (err) {
+			fprintf(stderr, "%s: %s\n", argv[optind],
+				strerror(-err));
+			return FSCK_ERROR;
+		}
+	}
+
+	printf("%s: %u folders, %u files, %u problems, %u fixed\n",
+	       argv[optind], fsck.nfolders, fsck.nfiles,
+	       (unsigned int)fsck.problems, fsck.fixed);
+
+	emu3_image_close(&fsck.img);
+
+	if (!fsck.problems)
+		return FSCK_OK;
+	return fsck.repair ? FSCK_CORRECTED : FSCK_UNCORRECTED;
+}
@@ -0,0 +1,275 @@
+/*
+ *   libemu3.c
+ *   Copyright (C) 2018 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of emu3fs.
+ *
+ *   emu3fs is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   emu3fs is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with emu3fs. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _FILE_OFFSET_BITS 64
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include "libemu3.h"
+
+static int emu3_image_size(int fd, uint64_t *size)
+{
+	struct stat st;
+
+	if (fstat(fd, &st))
+		return -errno;
+
+	if (S_ISBLK(st.st_mode)) {
+		if (ioctl(fd, BLKGETSIZE64, size))
+			return -errno;
+	} else
+		*size = st.st_size;
+
+	return 0;
+}
+
+//Same checks and fields than emu3_fill_super. The metadata must be inside the image.
+static int emu3_read_super(struct emu3_image *img)
+{
+	const uint32_t *parameters = (const uint32_t *)img->map;
+	uint64_t meta_blocks;
+
+	if (img->size < EMU3_BSIZE || memcmp(img->map, EMU3_FS_SIGNATURE, 4))
+		return -EINVAL;
+
+	img->blocks = le32toh(parameters[1]) + 1;
+	img->start_root_block = le32toh(parameters[2]);
+	img->root_blocks = le32toh(parameters[3]);
+	img->start_dir_content_block = le32toh(parameters[4]);
+	img->dir_content_blocks = le32toh(parameters[5]);
+	img->start_cluster_list_block = le32toh(parameters[6]);
+	img->cluster_list_blocks = le32toh(parameters[7]);
+	img->start_data_block = le32toh(parameters[8]);
+	img->clusters = le32toh(parameters[9]);
+	img->cluster_size_shift = EMU3_MIN_CLUSTER_SHIFT + img->map[0x28];
+	if (img->cluster_size_shift > 30)
+		return -EINVAL;
+	img->blocks_per_cluster =
+	    1 << (img->cluster_size_shift - EMU3_BSIZE_BITS);
+
+	meta_blocks = img->size / EMU3_BSIZE;
+	if ((uint64_t) img->start_root_block + img->root_blocks > meta_blocks
+	    || (uint64_t) img->start_dir_content_block +
+	    img->dir_content_blocks > meta_blocks
+	    || (uint64_t) img->start_cluster_list_block +
+	    img->cluster_list_blocks > meta_blocks
+	    || img->clusters > img->cluster_list_blocks * EMU3_BSIZE / 2)
+		return -EINVAL;
+
+	img->cluster_list = (const uint16_t *)
+	    EMU3_IMAGE_BLOCK(img, img->start_cluster_list_block);
+
+	return 0;
+}
+
+int emu3_image_open(struct emu3_image *img, const char *path, int rw)
+{
+	int err;
+
+	memset(img, 0, sizeof(*img));
+
+	img->fd = open(path, rw ? O_RDWR : O_RDONLY);
+	if (img->fd < 0)
+		return -errno;
+
+	err = emu3_image_size(img->fd, &img->size);
+	if (err)
+		goto err;
+
+	if (!img->size) {
+		err = -EINVAL;
+		goto err;
+	}
+
+	img->map = mmap(NULL, img->size,
+			rw ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED,
+			img->fd, 0);
+	if (img->map == MAP_FAILED) {
+		err = -errno;
+		img->map = NULL;
+		goto err;
+	}
+
+	err = emu3_read_super(img);
+	if (err)
+		goto err;
+
+	return 0;
+
+err:
+	emu3_image_close(img);
+	return err;
+}
+
+int emu3_image_sync(struct emu3_image *img)
+{
+	if (msync(img->map, img->size, MS_SYNC) || fsync(img->fd))
+		return -errno;
+
+	return 0;
+}
+
+void emu3_image_close(struct emu3_image *img)
+{
+	if (img->map)
+		munmap(img->map, img->size);
+	if (img->fd >= 0)
+		close(img->fd);
+	img->map = NULL;
+	img->fd = -1;
+}
+
+static int emu3_dir_block_ok(const struct emu3_image *img, uint16_t blknum)
+{
+	return blknum >= img->start_dir_content_block &&
+	    blknum < img->start_data_block &&
+	    (uint64_t) blknum < img->size / EMU3_BSIZE;
+}
+
+int emu3_image_walk(struct emu3_image *img, emu3_walk_cb cb, void *arg)
+{
+	const struct emu3_dentry *dir, *file;
+	unsigned int i, j, k;
+	uint16_t blknum;
+	int ret;
+
+	dir = (const struct emu3_dentry *)
+	    EMU3_IMAGE_BLOCK(img, img->start_root_block);
+	for (i = 0; i < img->root_blocks * EMU3_ENTRIES_PER_BLOCK; i++, dir++) {
+		if (!EMU3_DENTRY_IS_DIR(dir))
+			continue;
+
+		for (j = 0; j < EMU3_BLOCKS_PER_DIR; j++) {
+			blknum = le16toh(dir->dattrs.block_list[j]);
+			if (!emu3_dir_block_ok(img, blknum))
+				break;
+
+			file = (const struct emu3_dentry *)
+			    EMU3_IMAGE_BLOCK(img, blknum);
+			for (k = 0; k < EMU3_ENTRIES_PER_BLOCK; k++, file++) {
+				if (!EMU3_DENTRY_IS_FILE(file))
+					continue;
+
+				ret = cb(img, dir, file, arg);
+				if (ret)
+					return ret;
+			}
+		}
+	}
+
+	return 0;
+}
+
+//Same as emu3_set_inode_size_file in the module.
+uint64_t emu3_file_size(const struct emu3_image *img,
+			const struct emu3_dentry *e3d)
+{
+	uint64_t clusters = le16toh(e3d->fattrs.clusters);
+	uint64_t blocks = le16toh(e3d->fattrs.blocks);
+	uint64_t bytes = le16toh(e3d->fattrs.bytes);
+
+	if (clusters == 1 && blocks == 1 && bytes == 0)
+		return 0;
+
+	if (blocks)
+		clusters--;
+	if (bytes)
+		blocks--;
+
+	return (clusters * img->blocks_per_cluster + blocks) * EMU3_BSIZE +
+	    bytes;
+}
+
+int emu3_file_extents(const struct emu3_image *img,
+		      const struct emu3_dentry *e3d,
+		      struct emu3_extent **extents)
+{
+	uint64_t cluster_size = 1ULL << img->cluster_size_shift;
+	uint64_t remaining = emu3_file_size(img, e3d);
+	uint64_t offset, len;
+	uint16_t cluster = le16toh(e3d->fattrs.start_cluster);
+	struct emu3_extent *ext = NULL, *tmp;
+	unsigned int steps = 0;
+	int n = 0, max = 0;
+
+	*extents = NULL;
+
+	while (remaining) {
+		//Also catches loops in the chain.
+		if (cluster < 1 || cluster >= img->clusters
+		    || steps++ > img->clusters) {
+			free(ext);
+			return -EIO;
+		}
+
+		offset = ((uint64_t) img->start_data_block +
+			  (uint64_t) (cluster - 1) * img->blocks_per_cluster) *
+		    EMU3_BSIZE;
+		len = remaining < cluster_size ? remaining : cluster_size;
+		if (offset + len > img->size) {
+			free(ext);
+			return -EIO;
+		}
+
+		if (n && ext[n - 1].offset + ext[n - 1].length == offset)
+			ext[n - 1].length += len;
+		else {
+			if (n == max) {
+				max = max ? max * 2 : 8;
+				tmp = realloc(ext, max * sizeof(*ext));
+				if (!tmp) {
+					free(ext);
+					return -ENOMEM;
+				}
+				ext = tmp;
+			}
+			ext[n].offset = offset;
+			ext[n].length = len;
+			n++;
+		}
+
+		remaining -= len;
+		if (remaining)
+			cluster = le16toh(img->cluster_list[cluster]);
+	}
+
+	*extents = ext;
+	return n;
+}
+
+void emu3_file_name(const struct emu3_dentry *e3d, char *name)
+{
+	int i, len = EMU3_LENGTH_FILENAME;
+
+	while (len > 0 && (e3d->name[len - 1] == ' ' ||
+			   e3d->name[len - 1] == '\0'))
+		len--;
+
+	for (i = 0; i < len; i++)
+		name[i] = e3d->name[i] == '/' ? '?' : e3d->name[i];
+	name[len] = '\0';
+}
@@ -0,0 +1,138 @@
+/*
+ *   libemu3.h
+ *   Copyright (C) 2018 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of emu3fs.
+ *
+ *   emu3fs is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   emu3fs is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with emu3fs. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+//Userspace access to EMU3 images without mounting them.
+//The on-disk definitions follow the ones in emu3_fs.h.
+
+#ifndef LIBEMU3_H
+#define LIBEMU3_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <endian.h>
+
+#define EMU3_FS_SIGNATURE "EMU3"
+
+#define EMU3_BSIZE_BITS 9
+#define EMU3_BSIZE (1 << EMU3_BSIZE_BITS)
+#define EMU3_MIN_CLUSTER_SHIFT 15
+
+#define EMU3_BLOCKS_PER_DIR 7
+#define EMU3_LENGTH_FILENAME 16
+#define EMU3_FILE_PROPS_LEN 5
+#define EMU3_ENTRIES_PER_BLOCK (EMU3_BSIZE / sizeof(struct emu3_dentry))
+#define EMU3_MAX_FILES_PER_DIR (EMU3_ENTRIES_PER_BLOCK * EMU3_BLOCKS_PER_DIR)
+
+#define EMU_LAST_FILE_CLUSTER 0x7fff
+#define EMU3_FREE_DIR_BLOCK 0xffff
+
+#define EMU3_FTYPE_DEL 0x00
+#define EMU3_FTYPE_STD 0x81
+#define EMU3_FTYPE_UPD 0x83
+#define EMU3_FTYPE_SYS 0x80
+
+#define EMU3_DTYPE_1 0x40
+#define EMU3_DTYPE_2 0x80
+
+struct __attribute__((packed)) emu3_file_attrs {
+	uint16_t start_cluster;
+	uint16_t clusters;
+	uint16_t blocks;
+	uint16_t bytes;
+	uint8_t type;
+	uint8_t props[EMU3_FILE_PROPS_LEN];
+};
+
+struct __attribute__((packed)) emu3_dir_attrs {
+	uint16_t block_list[EMU3_BLOCKS_PER_DIR];
+};
+
+struct __attribute__((packed)) emu3_dentry {
+	char name[EMU3_LENGTH_FILENAME];
+	uint8_t unknown;
+	uint8_t id;
+	union {
+		struct emu3_file_attrs fattrs;
+		struct emu3_dir_attrs dattrs;
+	};
+};
+
+#define EMU3_DENTRY_IS_FILE(e3d) ((e3d)->id < EMU3_MAX_FILES_PER_DIR &&	\
+				  le16toh((e3d)->fattrs.clusters) > 0 &&	\
+				  ((e3d)->fattrs.type == EMU3_FTYPE_STD ||	\
+				   (e3d)->fattrs.type == EMU3_FTYPE_UPD ||	\
+				   (e3d)->fattrs.type == EMU3_FTYPE_SYS))
+
+#define EMU3_DENTRY_IS_DIR(e3d) (((e3d)->id == EMU3_DTYPE_1 || (e3d)->id == EMU3_DTYPE_2) && \
+				 le16toh((e3d)->dattrs.block_list[0]) > 0)
+
+struct emu3_image {
+	int fd;
+	uint8_t *map;
+	uint64_t size;
+	uint32_t blocks;
+	uint32_t start_root_block;
+	uint32_t root_blocks;
+	uint32_t start_dir_content_block;
+	uint32_t dir_content_blocks;
+	uint32_t start_cluster_list_block;
+	uint32_t cluster_list_blocks;
+	uint32_t start_data_block;
+	uint32_t clusters;
+	unsigned int cluster_size_shift;
+	unsigned int blocks_per_cluster;
+	const uint16_t *cluster_list;
+};
+
+//A contiguous run of clusters, in bytes from the start of the image.
+struct emu3_extent {
+	uint64_t offset;
+	uint64_t length;
+};
+
+#define EMU3_IMAGE_BLOCK(img, blknum) ((img)->map + (uint64_t)(blknum) * EMU3_BSIZE)
+
+typedef int (*emu3_walk_cb) (struct emu3_image *,
+			     const struct emu3_dentry * dir,
+			     const struct emu3_dentry * file, void *);
+
+//Functions returning int return 0 or a negative errno value.
+
+//The mapping is only writable when rw is set. Changes are written back with emu3_image_sync.
+int emu3_image_open(struct emu3_image *, const char *path, int rw);
+
+int emu3_image_sync(struct emu3_image *);
+
+void emu3_image_close(struct emu3_image *);
+
+//Calls the callback for every file of every folder until it returns non zero.
+int emu3_image_walk(struct emu3_image *, emu3_walk_cb, void *);
+
+uint64_t emu3_file_size(const struct emu3_image *,
+			const struct emu3_dentry *);
+
+//Returns the amount of extents allocated in *extents, which must be freed.
+int emu3_file_extents(const struct emu3_image *, const struct emu3_dentry *,
+		      struct emu3_extent **extents);
+
+//Stores the name as shown by the module, which is at most 16 bytes plus NUL.
+void emu3_file_name(const struct emu3_dentry *, char *name);
+
+#endif
@@ -24,29 +24,129 @@
 #define EMU3_XATTR_BNUM "bank.number"
 #define EMU3_XATTR_BNUM_LEN_MAX 8
 
+//Read-only attributes with the on-disk layout of a bank.
+#define EMU3_XATTR_LAYOUT "emu3."
+
+enum emu3_xattr_layout {
+	EMU3_XATTR_START_CLUSTER,
+	EMU3_XATTR_CLUSTERS,
+	EMU3_XATTR_FRAGMENTS,
+	EMU3_XATTR_TYPE,
+	EMU3_XATTR_PROPS,
+	EMU3_XATTR_LAYOUT_NUM
+};
+
+static const char *const emu3_xattr_layout_names[EMU3_XATTR_LAYOUT_NUM] = {
+	[EMU3_XATTR_START_CLUSTER] = "start_cluster",
+	[EMU3_XATTR_CLUSTERS] = "clusters",
+	[EMU3_XATTR_FRAGMENTS] = "fragments",
+	[EMU3_XATTR_TYPE] = "type",
+	[EMU3_XATTR_PROPS] = "props"
+};
+
+static int emu3_list_name(char *buffer, size_t size, ssize_t *total,
+			  const char *prefix, const char *name)
+{
+	size_t len = strlen(XATTR_USER_PREFIX) + strlen(prefix) +
+	    strlen(name) + 1;
+
+	if (buffer) {
+		if (*total + len > size)
+			return -ERANGE;
+		sprintf(buffer + *total, "%s%s%s", XATTR_USER_PREFIX, prefix,
+			name);
+	}
+	*total += len;
+
+	return 0;
+}
+
 ssize_t emu3_listxattr(struct dentry *dentry, char *buffer, size_t size)
 {
-	return snprintf(buffer, size, "%s%s", XATTR_USER_PREFIX,
-			EMU3_XATTR_BNUM) + 1;
+	int i, err;
+	ssize_t total = 0;
+
+	err = emu3_list_name(buffer, size, &total, "", EMU3_XATTR_BNUM);
+	for (i = 0; !err && i < EMU3_XATTR_LAYOUT_NUM; i++)
+		err = emu3_list_name(buffer, size, &total, EMU3_XATTR_LAYOUT,
+				     emu3_xattr_layout_names[i]);
+
+	return err ? err : total;
 }
 
-static int emu3_xattr_get(const struct xattr_handler *handler,
-			  struct dentry *dentry, struct inode *inode,
-			  const char *name, void *buffer, size_t size)
+//Values are formatted into a local buffer as the one of the VFS might be smaller.
+#define EMU3_XATTR_VALUE_LEN 16
+
+//Everything comes from the inode and the chain in memory so no block is read.
+static int emu3_xattr_get_layout(struct inode *inode, const char *name,
+				 char *value)
 {
-	int ret;
-	struct emu3_inode *e3i;
+	int i;
+	struct emu3_file_attrs fattrs;
+	struct emu3_inode *e3i = EMU3_I(inode);
 	struct emu3_sb_info *info = EMU3_SB(inode->i_sb);
 
-	if (strcmp(name, EMU3_XATTR_BNUM))
+	for (i = 0; i < EMU3_XATTR_LAYOUT_NUM; i++)
+		if (!strcmp(name, emu3_xattr_layout_names[i]))
+			break;
+
+	down_read(&e3i->data_sem);
+	fattrs = e3i->data.fattrs;
+	up_read(&e3i->data_sem);
+
+	switch (i) {
+	case EMU3_XATTR_START_CLUSTER:
+		return scnprintf(value, EMU3_XATTR_VALUE_LEN, "%d",
+				 le16_to_cpu(fattrs.start_cluster));
+	case EMU3_XATTR_CLUSTERS:
+		return scnprintf(value, EMU3_XATTR_VALUE_LEN, "%d",
+				 le16_to_cpu(fattrs.clusters));
+	case EMU3_XATTR_FRAGMENTS:
+		//The index already has them while the mount is read-only.
+		if (e3i->ientry && emu3_get_index(info))
+			return scnprintf(value, EMU3_XATTR_VALUE_LEN, "%u",
+					 e3i->ientry->nfragments);
+		return scnprintf(value, EMU3_XATTR_VALUE_LEN, "%u",
+				 emu3_get_fragments(info,
+						    le16_to_cpu(fattrs.
+								start_cluster)));
+	case EMU3_XATTR_TYPE:
+		return scnprintf(value, EMU3_XATTR_VALUE_LEN, "0x%02x",
+				 fattrs.type);
+	case EMU3_XATTR_PROPS:
+		return scnprintf(value, EMU3_XATTR_VALUE_LEN, "%*phN",
+				 EMU3_FILE_PROPS_LEN, fattrs.props);
+	default:
 		return -ENODATA;
+	}
+}
 
-	mutex_lock(&info->lock);
-	e3i = EMU3_I(inode);
-	ret = snprintf(buffer, size, "%d", e3i->data.id);
-	mutex_unlock(&info->lock);
+static int emu3_xattr_get(const struct xattr_handler *handler,
+			  struct dentry *dentry, struct inode *inode,
+			  const char *name, void *buffer, size_t size)
+{
+	int len;
+	char value[EMU3_XATTR_VALUE_LEN];
+	struct emu3_inode *e3i = EMU3_I(inode);
+
+	if (!strncmp(name, EMU3_XATTR_LAYOUT, strlen(EMU3_XATTR_LAYOUT)))
+		len = emu3_xattr_get_layout(inode,
+					    name + strlen(EMU3_XATTR_LAYOUT),
+					    value);
+	else if (!strcmp(name, EMU3_XATTR_BNUM))
+		//A single byte is read so no lock is needed.
+		len = scnprintf(value, sizeof(value), "%d",
+				READ_ONCE(e3i->data.id));
+	else
+		len = -ENODATA;
+
+	if (len < 0 || !size)
+		return len;
+	if (len > size)
+		return -ERANGE;
 
-	return ret;
+	memcpy(buffer, value, len);
+	return len;
 }
 
 static int emu3_xattr_set(const struct xattr_handler *handler,
@@ -58,10 +158,13 @@ static int emu3_xattr_set(const struct xattr_handler *handler,
 	int ret;
 	struct buffer_head *b;
 	struct emu3_dentry *e3d;
+	struct inode *dir;
 	struct emu3_inode *e3i;
-	struct emu3_sb_info *info = EMU3_SB(inode->i_sb);
 	char value[EMU3_XATTR_BNUM_LEN_MAX];
 
+	if (!strncmp(name, EMU3_XATTR_LAYOUT, strlen(EMU3_XATTR_LAYOUT)))
+		return -EPERM;
+
 	if (strcmp(name, EMU3_XATTR_BNUM))
 		return -ENODATA;
 
@@ -80,15 +183,23 @@ static int emu3_xattr_set(const struct xattr_handler *handler,
 		return -ERANGE;
 	}
 
-	mutex_lock(&info->lock);
+	dir = d_inode(dentry->d_parent);
 	e3i = EMU3_I(inode);
-	e3i->data.id = bn;
-	mark_inode_dirty(inode);
+
+	down_write(&EMU3_I(dir)->dir_sem);
+	down_write(&e3i->data_sem);
 	e3d = emu3_find_dentry_by_inode(inode, &b);
-	e3d->data.id = bn;
-	mark_buffer_dirty_inode(b, inode);
-	brelse(b);
-	mutex_unlock(&info->lock);
+	if (e3d) {
+		WRITE_ONCE(e3i->data.id, bn);
+		mark_inode_dirty(inode);
+		e3d->data.id = bn;
+		mark_buffer_dirty_inode(b, inode);
+		brelse(b);
+	} else
+		ret = -EIO;
+	up_write(&e3i->data_sem);
+	emu3_invalidate_dir_maps(dir);
+	up_write(&EMU3_I(dir)->dir_sem);
 
 	return ret;
 }